@@ -0,0 +1,130 @@
+#include  "Lz4.h"
+
+#include  <Library/BaseMemoryLib.h>
+
+#define FLG_VERSION_MASK       0xC0
+#define FLG_VERSION_01         0x40
+#define FLG_BLOCK_INDEPENDENT  0x20
+#define FLG_BLOCK_CHECKSUM     0x10
+#define FLG_CONTENT_SIZE       0x08
+#define FLG_CONTENT_CHECKSUM   0x04
+#define FLG_DICTIONARY_ID      0x01
+
+#define MIN_MATCH 4
+
+static UINT32 ReadLE32(const UINT8* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+EFI_STATUS Lz4ParseFrameHeader(const UINT8* buf, UINTN size,
+                               struct Lz4FrameInfo* info) {
+  if (size < 7 || ReadLE32(buf) != LZ4_FRAME_MAGIC) {
+    return EFI_LOAD_ERROR;
+  }
+
+  UINT8 flg = buf[4];
+  UINT8 bd = buf[5];
+  if ((flg & FLG_VERSION_MASK) != FLG_VERSION_01 ||
+      (flg & FLG_DICTIONARY_ID) != 0) {
+    return EFI_UNSUPPORTED;
+  }
+
+  // block maximum size: 4 -> 64 KiB, 5 -> 256 KiB, 6 -> 1 MiB, 7 -> 4 MiB
+  UINT8 block_max_size_id = (bd >> 4) & 7;
+  if (block_max_size_id < 4) {
+    return EFI_LOAD_ERROR;
+  }
+
+  info->block_independent = (flg & FLG_BLOCK_INDEPENDENT) != 0;
+  info->block_checksum = (flg & FLG_BLOCK_CHECKSUM) != 0;
+  info->content_checksum = (flg & FLG_CONTENT_CHECKSUM) != 0;
+  info->block_max_size = 1U << (8 + 2 * block_max_size_id);
+  info->content_size = 0;
+
+  UINTN pos = 6;
+  if (flg & FLG_CONTENT_SIZE) {
+    if (size < pos + 8 + 1) {
+      return EFI_LOAD_ERROR;
+    }
+    info->content_size = ReadLE32(buf + pos) | ((UINT64)ReadLE32(buf + pos + 4) << 32);
+    pos += 8;
+  }
+  info->header_size = pos + 1;  // header checksum (HC)
+  return EFI_SUCCESS;
+}
+
+// read the extra length bytes following a token nibble of 15
+static BOOLEAN ReadLength(const UINT8** ip, const UINT8* iend, UINTN* len) {
+  UINT8 b;
+  do {
+    if (*ip >= iend) {
+      return FALSE;
+    }
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return TRUE;
+}
+
+EFI_STATUS Lz4DecompressBlock(const UINT8* src, UINTN src_size,
+                              UINT8* dst, UINTN dst_size,
+                              UINTN history_size, UINTN* out_size) {
+  const UINT8* ip = src;
+  const UINT8* iend = src + src_size;
+  UINT8* op = dst;
+  UINT8* oend = dst + dst_size;
+
+  while (ip < iend) {
+    UINT8 token = *ip++;
+
+    // literals
+    UINTN literal_len = token >> 4;
+    if (literal_len == 15 && !ReadLength(&ip, iend, &literal_len)) {
+      return EFI_LOAD_ERROR;
+    }
+    if (literal_len > (UINTN)(iend - ip) || literal_len > (UINTN)(oend - op)) {
+      return EFI_LOAD_ERROR;
+    }
+    CopyMem(op, ip, literal_len);
+    ip += literal_len;
+    op += literal_len;
+
+    // the last sequence of a block has literals only
+    if (ip == iend) {
+      break;
+    }
+
+    // match
+    if (iend - ip < 2) {
+      return EFI_LOAD_ERROR;
+    }
+    UINTN offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (UINTN)(op - dst) + history_size) {
+      return EFI_LOAD_ERROR;
+    }
+
+    UINTN match_len = token & 15;
+    if (match_len == 15 && !ReadLength(&ip, iend, &match_len)) {
+      return EFI_LOAD_ERROR;
+    }
+    match_len += MIN_MATCH;
+    if (match_len > (UINTN)(oend - op)) {
+      return EFI_LOAD_ERROR;
+    }
+
+    const UINT8* match = op - offset;
+    if (offset >= match_len) {
+      CopyMem(op, match, match_len);
+      op += match_len;
+    } else {
+      // overlapping match repeats the last offset bytes
+      for (UINTN i = 0; i < match_len; ++i) {
+        *op++ = *match++;
+      }
+    }
+  }
+
+  *out_size = op - dst;
+  return EFI_SUCCESS;
+}
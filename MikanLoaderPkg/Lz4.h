@@ -0,0 +1,34 @@
+#pragma once
+
+#include  <Uefi.h>
+
+// minimal decoder for the LZ4 frame format, enough to load a kernel image
+// compressed by the lz4 command. checksums are skipped, dictionaries are
+// not supported.
+
+#define LZ4_FRAME_MAGIC 0x184D2204
+// magic(4) + FLG(1) + BD(1) + content size(8) + dictionary ID(4) + HC(1)
+#define LZ4_MAX_FRAME_HEADER_SIZE 19
+// blocks of a linked frame may refer to the last 64 KiB of previous blocks
+#define LZ4_HISTORY_SIZE (64 * 1024)
+// highest bit of a block size means the block is stored uncompressed
+#define LZ4_BLOCK_UNCOMPRESSED 0x80000000U
+
+struct Lz4FrameInfo {
+  BOOLEAN block_independent;
+  BOOLEAN block_checksum;
+  BOOLEAN content_checksum;
+  UINT32 block_max_size;
+  UINT64 content_size;  // 0 if the frame does not record it
+  UINTN header_size;
+};
+
+// parse the frame header at the beginning of buf (size bytes)
+EFI_STATUS Lz4ParseFrameHeader(const UINT8* buf, UINTN size,
+                               struct Lz4FrameInfo* info);
+
+// decompress one block into dst. history_size bytes just before dst hold
+// the output of previous blocks which matches may refer to.
+EFI_STATUS Lz4DecompressBlock(const UINT8* src, UINTN src_size,
+                              UINT8* dst, UINTN dst_size,
+                              UINTN history_size, UINTN* out_size);
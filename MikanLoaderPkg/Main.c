@@ -4,14 +4,54 @@
 #include  <Library/PrintLib.h>
 #include  <Library/MemoryAllocationLib.h>
 #include  <Library/BaseMemoryLib.h>
+#include  <Library/BaseLib.h>
 #include  <Protocol/LoadedImage.h>
 #include  <Protocol/SimpleFileSystem.h>
 #include  <Protocol/DiskIo2.h>
 #include  <Protocol/BlockIo.h>
 #include  <Guid/FileInfo.h>
+#include  <Guid/Acpi.h>
 #include  "frame_buffer_config.hpp"
 #include  "memory_map.hpp"
 #include  "elf.hpp"
+#include  "boot_info.hpp"
+#include  "Lz4.h"
+
+// TSC cycles per microsecond, also passed to the kernel
+UINT64 tsc_per_us = 0;
+
+// convert TSC cycles to microseconds.
+// the TSC frequency is measured by a 1 ms stall on the first call.
+UINT64 TscToMicroseconds(UINT64 cycles) {
+  if (tsc_per_us == 0) {
+    UINT64 start = AsmReadTsc();
+    gBS->Stall(1000);
+    tsc_per_us = MAX((AsmReadTsc() - start) / 1000, 1);
+  }
+  return cycles / tsc_per_us;
+}
+
+// TSC values at the end of each boot phase, passed to the kernel
+struct BootTimestamp boot_phases[BOOT_INFO_MAX_TIMESTAMPS];
+UINTN num_boot_phases = 0;
+
+void EndPhase(const CHAR8* name) {
+  if (num_boot_phases < BOOT_INFO_MAX_TIMESTAMPS) {
+    AsciiStrCpyS(boot_phases[num_boot_phases].name,
+                 sizeof(boot_phases[num_boot_phases].name), name);
+    boot_phases[num_boot_phases].tsc = AsmReadTsc();
+    ++num_boot_phases;
+  }
+}
+
+void PrintPhaseTimings(void) {
+  for (UINTN i = 1; i < num_boot_phases; ++i) {
+    Print(L"  %-12a %8lu us\n", boot_phases[i].name,
+          TscToMicroseconds(boot_phases[i].tsc - boot_phases[i - 1].tsc));
+  }
+  Print(L"  %-12s %8lu us\n", L"total",
+        TscToMicroseconds(boot_phases[num_boot_phases - 1].tsc - boot_phases[0].tsc));
+}
 
 EFI_STATUS GetMemoryMap(struct MemoryMap* map) {
   if (map->buffer == NULL) {
@@ -130,9 +170,65 @@ EFI_STATUS OpenRootDir(EFI_HANDLE image_handle, EFI_FILE_PROTOCOL** root) {
   return EFI_SUCCESS;
 }
 
-void CalcLoadAddressRange(Elf64_Ehdr* ehdr, UINT64* first, UINT64* last) {
-  Elf64_Phdr* phdr = (Elf64_Phdr*)((UINT64)ehdr + ehdr->e_phoff);
+// read the loader options from "cmdline" on the boot volume, e.g. "memmap gop=min".
+// options are separated by spaces or newlines. no file means no options.
+EFI_STATUS ReadCommandLine(EFI_FILE_PROTOCOL* root_dir,
+                           CHAR8* cmdline, UINTN size) {
+  cmdline[0] = '\0';
+
+  EFI_FILE_PROTOCOL* file;
+  EFI_STATUS status = root_dir->Open(
+      root_dir, &file, L"\\cmdline", EFI_FILE_MODE_READ, 0);
+  if (status == EFI_NOT_FOUND) {
+    return EFI_SUCCESS;
+  } else if (EFI_ERROR(status)) {
+    return status;
+  }
+
+  UINTN len = size - 1;
+  status = file->Read(file, &len, cmdline);
+  file->Close(file);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
 
+  for (UINTN i = 0; i < len; ++i) {
+    if (cmdline[i] == '\n' || cmdline[i] == '\r' || cmdline[i] == '\t') {
+      cmdline[i] = ' ';
+    }
+  }
+  while (len > 0 && cmdline[len - 1] == ' ') {
+    --len;
+  }
+  cmdline[len] = '\0';
+  return EFI_SUCCESS;
+}
+
+// return the value of option "name=value" or "" for a bare "name".
+// NULL if cmdline does not have the option.
+const CHAR8* FindOption(const CHAR8* cmdline, const CHAR8* name) {
+  UINTN name_len = AsciiStrLen(name);
+  const CHAR8* p = cmdline;
+  while (*p != '\0') {
+    while (*p == ' ') {
+      ++p;
+    }
+    if (AsciiStrnCmp(p, name, name_len) == 0) {
+      if (p[name_len] == '=') {
+        return p + name_len + 1;
+      } else if (p[name_len] == ' ' || p[name_len] == '\0') {
+        return p + name_len;
+      }
+    }
+    while (*p != ' ' && *p != '\0') {
+      ++p;
+    }
+  }
+  return NULL;
+}
+
+void CalcLoadAddressRange(Elf64_Ehdr* ehdr, Elf64_Phdr* phdr,
+                          UINT64* first, UINT64* last) {
   *first = MAX_UINT64;
   *last = 0;
 
@@ -146,92 +242,376 @@ void CalcLoadAddressRange(Elf64_Ehdr* ehdr, UINT64* first, UINT64* last) {
   }
 }
 
-void CopyLoadSegments(Elf64_Ehdr* ehdr) {
-  Elf64_Phdr* phdr = (Elf64_Phdr*)((UINT64)ehdr + ehdr->e_phoff);
+// time spent on reading and decompressing the kernel image
+struct LoadStats {
+  UINT64 read_bytes;
+  UINT64 read_cycles;
+  UINT64 decoded_bytes;
+  UINT64 decode_cycles;
+};
+
+// read exactly size bytes at offset of file into buf
+EFI_STATUS ReadFileAt(EFI_FILE_PROTOCOL* file, UINT64 offset,
+                      UINTN size, VOID* buf, struct LoadStats* stats) {
+  UINT64 start = AsmReadTsc();
+  EFI_STATUS status = file->SetPosition(file, offset);
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+
+  UINTN read_size = size;
+  status = file->Read(file, &read_size, buf);
+  stats->read_cycles += AsmReadTsc() - start;
+  stats->read_bytes += read_size;
+  if (EFI_ERROR(status)) {
+    return status;
+  }
+  if (read_size != size) {
+    return EFI_END_OF_FILE;
+  }
+  return EFI_SUCCESS;
+}
+
+EFI_STATUS CheckElfHeader(Elf64_Ehdr* ehdr) {
+  if (CompareMem(ehdr->e_ident, "\x7f" "ELF", 4) != 0 ||
+      ehdr->e_phentsize != sizeof(Elf64_Phdr)) {
+    Print(L"kernel is not a valid ELF64 file\n");
+    return EFI_LOAD_ERROR;
+  }
+  return EFI_SUCCESS;
+}
+
+// allocate pages at the addresses where PT_LOAD segments are loaded
+EFI_STATUS AllocateSegments(Elf64_Ehdr* ehdr, Elf64_Phdr* phdr) {
+  UINT64 kernel_first_addr, kernel_last_addr;
+  CalcLoadAddressRange(ehdr, phdr, &kernel_first_addr, &kernel_last_addr);
+
+  UINTN num_pages = (kernel_last_addr - kernel_first_addr + 0xfff) / 0x1000;
+  EFI_STATUS status = gBS->AllocatePages(
+      AllocateAddress, EfiLoaderData,
+      num_pages, &kernel_first_addr);
+  if (EFI_ERROR(status)) {
+    Print(L"Memory allocation Failed: %r\n", status);
+    return status;
+  }
+  Print(L"Kernel: 0x%0lx - 0x%0lx\n", kernel_first_addr, kernel_last_addr);
+  return EFI_SUCCESS;
+}
+
+// fill zero to bytes of each PT_LOAD segment which are not in the file
+void ZeroFillSegments(Elf64_Ehdr* ehdr, Elf64_Phdr* phdr) {
+  for (Elf64_Half i = 0; i < ehdr->e_phnum; ++i) {
+    if (phdr[i].p_type != PT_LOAD)
+      continue;
+
+    UINTN remain_bytes = phdr[i].p_memsz - phdr[i].p_filesz;
+    SetMem((VOID*)(phdr[i].p_vaddr + phdr[i].p_filesz), remain_bytes, 0);
+  }
+}
+
+// read each PT_LOAD segment from file directly to its final address.
+// sections not covered by PT_LOAD (debug info, symbols) are never read.
+EFI_STATUS LoadSegments(EFI_FILE_PROTOCOL* file,
+                        Elf64_Ehdr* ehdr, Elf64_Phdr* phdr,
+                        struct LoadStats* stats) {
+  EFI_STATUS status;
 
   for (Elf64_Half i = 0; i < ehdr->e_phnum; ++i)  // read each program heder
   {
     if (phdr[i].p_type != PT_LOAD)
       continue;
 
-    // copy segments
-    UINT64 segm_in_file = (UINT64)ehdr + phdr[i].p_offset;
-    CopyMem((VOID*)phdr[i].p_vaddr, (VOID*)segm_in_file, phdr[i].p_filesz);
-
-    // fill zero to remain bytes
-    UINTN remain_bytes = phdr->p_memsz - phdr->p_filesz;
-    SetMem((VOID*)(phdr[i].p_vaddr + phdr[i].p_filesz), remain_bytes, 0);
+    // read segments
+    status = ReadFileAt(file, phdr[i].p_offset, phdr[i].p_filesz,
+                        (VOID*)phdr[i].p_vaddr, stats);
+    if (EFI_ERROR(status)) {
+      Print(L"Failed to read segment %u: %r\n", i, status);
+      return status;
+    }
   }
+
+  ZeroFillSegments(ehdr, phdr);
+  return EFI_SUCCESS;
 }
 
-EFI_STATUS LoadKernel(EFI_FILE_PROTOCOL* root_dir, EFI_PHYSICAL_ADDRESS kernel_base_addr) {
+// load an uncompressed ELF file
+EFI_STATUS LoadElf(EFI_FILE_PROTOCOL* file, UINT64* entry_addr,
+                   struct LoadStats* stats) {
   EFI_STATUS status;
 
-  // open "kernel.elf"
-  EFI_FILE_PROTOCOL* kernel_file;
-  status = root_dir->Open(
-      root_dir, &kernel_file, L"\\kernel.elf",
-      EFI_FILE_MODE_READ, 0);
+  // read ELF header
+  Elf64_Ehdr kernel_ehdr;
+  status = ReadFileAt(file, 0, sizeof(kernel_ehdr), &kernel_ehdr, stats);
+  if (EFI_ERROR(status)) {
+    Print(L"Failed to read ELF header of kernel: %r\n", status);
+    return status;
+  }
+  status = CheckElfHeader(&kernel_ehdr);
   if (EFI_ERROR(status)) {
-    Print(L"Failed to open file kernel.elf: %r\n", status);
     return status;
   }
 
-  // get fileinfo
-  UINTN file_info_size = sizeof(EFI_FILE_INFO) + sizeof(CHAR16) * 12;
-  UINT8 file_info_buffer[file_info_size];
-  status = kernel_file->GetInfo(
-      kernel_file, &gEfiFileInfoGuid,
-      &file_info_size, file_info_buffer);
-
+  // read program headers only
+  UINTN phdr_size = sizeof(Elf64_Phdr) * kernel_ehdr.e_phnum;
+  Elf64_Phdr* kernel_phdr;
+  status = gBS->AllocatePool(EfiLoaderData, phdr_size, (VOID**)&kernel_phdr);
   if (EFI_ERROR(status)) {
-    Print(L"Failed to get file info of kernel.elf: %r\n", status);
+    Print(L"Memory pool allocation failed: %r\n", status);
     return status;
   }
 
-  // file size
-  EFI_FILE_INFO* file_info = (EFI_FILE_INFO*)file_info_buffer;
-  UINTN kernel_file_size = file_info->FileSize;
+  status = ReadFileAt(file, kernel_ehdr.e_phoff, phdr_size, kernel_phdr, stats);
+  if (EFI_ERROR(status)) {
+    Print(L"Failed to read program headers of kernel: %r\n", status);
+    goto free_phdr;
+  }
 
-  // allocate temporary buffer for read kernel program headers
-  VOID* kernel_buffer;
-  status = gBS->AllocatePool(EfiLoaderData, kernel_file_size, &kernel_buffer);
+  status = AllocateSegments(&kernel_ehdr, kernel_phdr);
   if (EFI_ERROR(status)) {
-    Print(L"Memory pool allocation failed: %r\n", status);
+    goto free_phdr;
+  }
+
+  status = LoadSegments(file, &kernel_ehdr, kernel_phdr, stats);
+  if (EFI_ERROR(status)) {
+    goto free_phdr;
+  }
+
+  *entry_addr = kernel_ehdr.e_entry;
+
+free_phdr:
+  gBS->FreePool(kernel_phdr);
+  return status;
+}
+
+// copy the part of decompressed ELF file [offset, offset + size)
+// which belongs to PT_LOAD segments to their final addresses
+void CopyToSegments(Elf64_Ehdr* ehdr, Elf64_Phdr* phdr,
+                    UINT64 offset, const UINT8* data, UINTN size) {
+  for (Elf64_Half i = 0; i < ehdr->e_phnum; ++i) {
+    if (phdr[i].p_type != PT_LOAD)
+      continue;
+
+    UINT64 first = MAX(offset, phdr[i].p_offset);
+    UINT64 last = MIN(offset + size, phdr[i].p_offset + phdr[i].p_filesz);
+    if (first >= last)
+      continue;
+
+    CopyMem((VOID*)(phdr[i].p_vaddr + (first - phdr[i].p_offset)),
+            data + (first - offset), last - first);
+  }
+}
+
+// return the end of file offset which PT_LOAD segments need
+UINT64 CalcLoadFileEnd(Elf64_Ehdr* ehdr, Elf64_Phdr* phdr) {
+  UINT64 end = 0;
+  for (Elf64_Half i = 0; i < ehdr->e_phnum; ++i) {
+    if (phdr[i].p_type != PT_LOAD)
+      continue;
+
+    end = MAX(end, phdr[i].p_offset + phdr[i].p_filesz);
+  }
+  return end;
+}
+
+// load an ELF file compressed into a LZ4 frame.
+// each block is decompressed into a small buffer and then copied to
+// PT_LOAD segments, so the whole ELF file never exists in memory.
+EFI_STATUS LoadCompressedElf(EFI_FILE_PROTOCOL* file, UINT64* entry_addr,
+                             struct LoadStats* stats) {
+  EFI_STATUS status;
+
+  UINT8 frame_header[LZ4_MAX_FRAME_HEADER_SIZE];
+  status = ReadFileAt(file, 0, sizeof(frame_header), frame_header, stats);
+  if (EFI_ERROR(status)) {
+    Print(L"Failed to read LZ4 frame header: %r\n", status);
     return status;
   }
 
-  status = kernel_file->Read(kernel_file, &kernel_file_size, kernel_buffer);
+  struct Lz4FrameInfo frame;
+  status = Lz4ParseFrameHeader(frame_header, sizeof(frame_header), &frame);
   if (EFI_ERROR(status)) {
-    Print(L"Failed to load kernel.elf to temporary memory: kernel_buffer = %08lx, kernel_file_size = %lu: %r\n", kernel_buffer, kernel_file_size, status);
+    Print(L"Unsupported LZ4 frame: %r\n", status);
     return status;
   }
 
-  Elf64_Ehdr* kernel_ehdr = (Elf64_Ehdr*)kernel_buffer;
-  UINT64 kernel_first_addr, kernel_last_addr;
-  CalcLoadAddressRange(kernel_ehdr, &kernel_first_addr, &kernel_last_addr);
+  // in_buf holds a block, its checksum and the size of the next block.
+  // out_buf keeps the tail of previous blocks before the output if blocks are linked.
+  UINTN checksum_size = frame.block_checksum ? 4 : 0;
+  UINTN history_size = frame.block_independent ? 0 : LZ4_HISTORY_SIZE;
+  UINT8* in_buf = NULL;
+  UINT8* out_buf = NULL;
+  Elf64_Ehdr kernel_ehdr;
+  Elf64_Phdr* kernel_phdr = NULL;
+
+  status = gBS->AllocatePool(EfiLoaderData,
+                             frame.block_max_size + checksum_size + 4,
+                             (VOID**)&in_buf);
+  if (EFI_ERROR(status)) {
+    Print(L"Memory pool allocation failed: %r\n", status);
+    goto free_buf;
+  }
+  status = gBS->AllocatePool(EfiLoaderData, history_size + frame.block_max_size,
+                             (VOID**)&out_buf);
+  if (EFI_ERROR(status)) {
+    Print(L"Memory pool allocation failed: %r\n", status);
+    goto free_buf;
+  }
 
-  UINTN num_pages = (kernel_last_addr - kernel_first_addr + 0xfff) / 0x1000;
+  UINT64 file_pos = frame.header_size;
+  UINT64 elf_pos = 0;  // offset in the decompressed ELF file
+  UINTN history_len = 0;
+  UINT8* out = out_buf + history_size;
+
+  UINT32 block_header;
+  status = ReadFileAt(file, file_pos, sizeof(block_header), &block_header, stats);
+  file_pos += sizeof(block_header);
+
+  while (!EFI_ERROR(status) && block_header != 0) {  // 0 is the end mark
+    UINTN block_size = block_header & ~LZ4_BLOCK_UNCOMPRESSED;
+    if (block_size > frame.block_max_size) {
+      status = EFI_LOAD_ERROR;
+      break;
+    }
+
+    UINTN read_size = block_size + checksum_size + sizeof(block_header);
+    status = ReadFileAt(file, file_pos, read_size, in_buf, stats);
+    if (EFI_ERROR(status)) {
+      break;
+    }
+    file_pos += read_size;
+
+    UINT64 start = AsmReadTsc();
+    UINTN out_size = block_size;
+    if (block_header & LZ4_BLOCK_UNCOMPRESSED) {
+      CopyMem(out, in_buf, block_size);
+    } else {
+      status = Lz4DecompressBlock(in_buf, block_size, out, frame.block_max_size,
+                                  history_len, &out_size);
+      if (EFI_ERROR(status)) {
+        break;
+      }
+    }
+
+    // ELF header and program headers come at the head of the first block
+    if (kernel_phdr == NULL) {
+      UINTN phdr_size = 0;
+      if (out_size >= sizeof(kernel_ehdr)) {
+        CopyMem(&kernel_ehdr, out, sizeof(kernel_ehdr));
+        phdr_size = sizeof(Elf64_Phdr) * kernel_ehdr.e_phnum;
+      }
+      if (out_size < sizeof(kernel_ehdr) ||
+          kernel_ehdr.e_phoff + phdr_size > out_size) {
+        Print(L"Program headers are not in the first LZ4 block\n");
+        status = EFI_LOAD_ERROR;
+        break;
+      }
+      status = CheckElfHeader(&kernel_ehdr);
+      if (EFI_ERROR(status)) {
+        break;
+      }
+
+      status = gBS->AllocatePool(EfiLoaderData, phdr_size, (VOID**)&kernel_phdr);
+      if (EFI_ERROR(status)) {
+        Print(L"Memory pool allocation failed: %r\n", status);
+        kernel_phdr = NULL;
+        break;
+      }
+      CopyMem(kernel_phdr, out + kernel_ehdr.e_phoff, phdr_size);
+
+      status = AllocateSegments(&kernel_ehdr, kernel_phdr);
+      if (EFI_ERROR(status)) {
+        break;
+      }
+    }
+
+    CopyToSegments(&kernel_ehdr, kernel_phdr, elf_pos, out, out_size);
+    elf_pos += out_size;
+
+    // keep the last 64 KiB of output for matches in the next block
+    if (history_size > 0) {
+      UINTN keep = MIN(history_len + out_size, history_size);
+      CopyMem(out - keep, out + out_size - keep, keep);
+      history_len = keep;
+    }
+    stats->decoded_bytes += out_size;
+    stats->decode_cycles += AsmReadTsc() - start;
+
+    CopyMem(&block_header, in_buf + block_size + checksum_size,
+            sizeof(block_header));
+  }
 
-  // read kernel into base_addr
-  status = gBS->AllocatePages(
-      AllocateAddress, EfiLoaderData,
-      num_pages, &kernel_first_addr);
   if (EFI_ERROR(status)) {
-    Print(L"Memory allocation Failed: %r\n", status);
-    return status;
+    Print(L"Failed to decompress kernel: %r\n", status);
+    goto free_buf;
+  }
+  if (kernel_phdr == NULL ||
+      elf_pos < CalcLoadFileEnd(&kernel_ehdr, kernel_phdr) ||
+      (frame.content_size != 0 && elf_pos != frame.content_size)) {
+    Print(L"Compressed kernel is truncated\n");
+    status = EFI_LOAD_ERROR;
+    goto free_buf;
   }
 
-  CopyLoadSegments(kernel_ehdr);
-  Print(L"Kernel: 0x%0lx - 0x%0lx\n", kernel_first_addr, kernel_last_addr);
+  ZeroFillSegments(&kernel_ehdr, kernel_phdr);
+  *entry_addr = kernel_ehdr.e_entry;
+
+free_buf:
+  if (kernel_phdr != NULL)
+    gBS->FreePool(kernel_phdr);
+  if (out_buf != NULL)
+    gBS->FreePool(out_buf);
+  if (in_buf != NULL)
+    gBS->FreePool(in_buf);
+  return status;
+}
+
+// load "kernel.elf.lz4" if it exists, otherwise "kernel.elf".
+// the format is told from the magic number, not from the file name.
+EFI_STATUS LoadKernel(EFI_FILE_PROTOCOL* root_dir, UINT64* entry_addr) {
+  EFI_STATUS status;
 
-  status = gBS->FreePool(kernel_buffer);
+  EFI_FILE_PROTOCOL* kernel_file;
+  status = root_dir->Open(
+      root_dir, &kernel_file, L"\\kernel.elf.lz4",
+      EFI_FILE_MODE_READ, 0);
   if (EFI_ERROR(status)) {
-    Print(L"failed to free pool: %r\n", status);
+    status = root_dir->Open(
+        root_dir, &kernel_file, L"\\kernel.elf",
+        EFI_FILE_MODE_READ, 0);
+  }
+  if (EFI_ERROR(status)) {
+    Print(L"Failed to open file kernel.elf: %r\n", status);
     return status;
   }
 
-  return EFI_SUCCESS;
+  struct LoadStats stats = {0, 0, 0, 0};
+  UINT32 magic;
+  status = ReadFileAt(kernel_file, 0, sizeof(magic), &magic, &stats);
+  if (EFI_ERROR(status)) {
+    Print(L"Failed to read kernel file: %r\n", status);
+    goto close_file;
+  }
+
+  if (magic == LZ4_FRAME_MAGIC) {
+    status = LoadCompressedElf(kernel_file, entry_addr, &stats);
+  } else {
+    status = LoadElf(kernel_file, entry_addr, &stats);
+  }
+  if (EFI_ERROR(status)) {
+    goto close_file;
+  }
+
+  Print(L"Kernel: read %lu bytes in %lu us",
+        stats.read_bytes, TscToMicroseconds(stats.read_cycles));
+  if (magic == LZ4_FRAME_MAGIC) {
+    Print(L", decompressed to %lu bytes in %lu us",
+          stats.decoded_bytes, TscToMicroseconds(stats.decode_cycles));
+  }
+  Print(L"\n");
+
+close_file:
+  kernel_file->Close(kernel_file);
+  return status;
 }
 
 EFI_STATUS ExitBootService(EFI_HANDLE image_handle, struct MemoryMap* map) {
@@ -305,13 +685,117 @@ const CHAR16* GetPixelFormatUnicode(EFI_GRAPHICS_PIXEL_FORMAT fmt) {
   }
 }
 
-EFI_STATUS FillScreen(EFI_HANDLE image_handle, EFI_GRAPHICS_OUTPUT_PROTOCOL** gop) {
+BOOLEAN IsSupportedPixelFormat(EFI_GRAPHICS_PIXEL_FORMAT fmt) {
+  return fmt == PixelRedGreenBlueReserved8BitPerColor ||
+         fmt == PixelBlueGreenRedReserved8BitPerColor;
+}
+
+// return true if option value (terminated by space or NUL) equals str
+BOOLEAN OptionValueIs(const CHAR8* value, const CHAR8* str) {
+  UINTN len = AsciiStrLen(str);
+  return AsciiStrnCmp(value, str, len) == 0 &&
+         (value[len] == ' ' || value[len] == '\0');
+}
+
+UINTN ParseDecimal(const CHAR8** p) {
+  UINTN value = 0;
+  while ('0' <= **p && **p <= '9') {
+    value = value * 10 + (*(*p)++ - '0');
+  }
+  return value;
+}
+
+// choose a GOP mode the kernel can draw on, by the "gop" option:
+//   gop=max  the mode with the most pixels
+//   gop=min  the mode with the fewest pixels, to reduce drawing cost
+//   gop=WxH  the mode of the given resolution
+// without the option, the current mode is kept if its pixel format is
+// supported, otherwise the mode with the most pixels is used.
+EFI_STATUS SelectGopMode(EFI_GRAPHICS_OUTPUT_PROTOCOL* gop, const CHAR8* policy) {
+  enum { kPolicyMax, kPolicyMin, kPolicyResolution } kind = kPolicyMax;
+  UINTN want_width = 0, want_height = 0;
+
+  if (policy == NULL) {
+    if (IsSupportedPixelFormat(gop->Mode->Info->PixelFormat)) {
+      return EFI_SUCCESS;
+    }
+  } else if (OptionValueIs(policy, "max")) {
+    kind = kPolicyMax;
+  } else if (OptionValueIs(policy, "min")) {
+    kind = kPolicyMin;
+  } else {
+    const CHAR8* p = policy;
+    want_width = ParseDecimal(&p);
+    if (*p == 'x') {
+      ++p;
+      want_height = ParseDecimal(&p);
+    }
+    if (want_width == 0 || want_height == 0 || (*p != ' ' && *p != '\0')) {
+      Print(L"Invalid gop option, keep the current mode\n");
+      return EFI_SUCCESS;
+    }
+    kind = kPolicyResolution;
+  }
+
+  UINT32 best_mode = gop->Mode->MaxMode;
+  UINT64 best_pixels = 0;
+  for (UINT32 i = 0; i < gop->Mode->MaxMode; ++i) {
+    UINTN info_size;
+    EFI_GRAPHICS_OUTPUT_MODE_INFORMATION* info;
+    EFI_STATUS status = gop->QueryMode(gop, i, &info_size, &info);
+    if (EFI_ERROR(status)) {
+      continue;
+    }
+
+    UINT64 pixels = (UINT64)info->HorizontalResolution * info->VerticalResolution;
+    BOOLEAN better = FALSE;
+    if (IsSupportedPixelFormat(info->PixelFormat)) {
+      switch (kind) {
+        case kPolicyMax:
+          better = best_mode == gop->Mode->MaxMode || pixels > best_pixels;
+          break;
+        case kPolicyMin:
+          better = best_mode == gop->Mode->MaxMode || pixels < best_pixels;
+          break;
+        case kPolicyResolution:
+          better = best_mode == gop->Mode->MaxMode &&
+                   info->HorizontalResolution == want_width &&
+                   info->VerticalResolution == want_height;
+          break;
+      }
+    }
+    FreePool(info);
+
+    if (better) {
+      best_mode = i;
+      best_pixels = pixels;
+    }
+  }
+
+  if (best_mode == gop->Mode->MaxMode) {
+    Print(L"No suitable GOP mode, keep the current mode\n");
+    return EFI_SUCCESS;
+  }
+  if (best_mode == gop->Mode->Mode) {
+    return EFI_SUCCESS;
+  }
+  return gop->SetMode(gop, best_mode);
+}
+
+EFI_STATUS FillScreen(EFI_HANDLE image_handle, const CHAR8* gop_policy,
+                      EFI_GRAPHICS_OUTPUT_PROTOCOL** gop) {
   EFI_STATUS status;
   status = OpenGop(image_handle, gop);
   if (EFI_ERROR(status)) {
     return status;
   }
 
+  status = SelectGopMode(*gop, gop_policy);
+  if (EFI_ERROR(status)) {
+    Print(L"Failed to set GOP mode: %r\n", status);
+    return status;
+  }
+
   Print(L"Resolution: %ux%u, Pixel Format: %s, %u pixels/line\n",
         (*gop)->Mode->Info->HorizontalResolution,
         (*gop)->Mode->Info->VerticalResolution,
@@ -320,11 +804,18 @@ EFI_STATUS FillScreen(EFI_HANDLE image_handle, EFI_GRAPHICS_OUTPUT_PROTOCOL** go
   Print(L"Frame Buffer: 0x%0lx - 0x%0lx, Size: %lu bytes\n",
         (*gop)->Mode->FrameBufferBase,
         (*gop)->Mode->FrameBufferBase + (*gop)->Mode->FrameBufferSize,
-        (*gop)->Mode->FrameBufferBase);
-
-  UINT8* frame_buffer = (UINT8*)(*gop)->Mode->FrameBufferBase;
-  for (UINTN i = 0; i < (*gop)->Mode->FrameBufferSize; i++) {
-    frame_buffer[i] = 255;  // fill white to pixel
+        (*gop)->Mode->FrameBufferSize);
+
+  // fill white with Blt, which the firmware implements with wide stores.
+  // fall back to SetMem if Blt is not available.
+  EFI_GRAPHICS_OUTPUT_BLT_PIXEL white = {255, 255, 255, 0};
+  status = (*gop)->Blt(
+      *gop, &white, EfiBltVideoFill, 0, 0, 0, 0,
+      (*gop)->Mode->Info->HorizontalResolution,
+      (*gop)->Mode->Info->VerticalResolution, 0);
+  if (EFI_ERROR(status)) {
+    SetMem((VOID*)(*gop)->Mode->FrameBufferBase,
+           (*gop)->Mode->FrameBufferSize, 255);
   }
 
   return EFI_SUCCESS;
@@ -338,20 +829,10 @@ EFI_STATUS EFIAPI UefiMain(
     EFI_HANDLE image_handle,
     EFI_SYSTEM_TABLE* system_table) {
   EFI_STATUS status;
+  TscToMicroseconds(0);  // measure the TSC frequency before timing phases
+  EndPhase("start");
   Print(L"Hello, Mikan World!\n");
 
-  // get memroy map
-  CHAR8 memmap_buf[4096 * 4];
-  struct MemoryMap memmap = {sizeof(memmap_buf), memmap_buf, 0, 0, 0, 0};
-
-  status = GetMemoryMap(&memmap);
-  if (EFI_ERROR(status)) {
-    Print(L"Failed to GetMemoryMap: %r\n", status);
-    Halt();
-  }
-
-  // save memory map to the file
-
   EFI_FILE_PROTOCOL* root_dir;
   status = OpenRootDir(image_handle, &root_dir);
   if (EFI_ERROR(status)) {
@@ -359,41 +840,98 @@ EFI_STATUS EFIAPI UefiMain(
     Halt();
   }
 
-  EFI_FILE_PROTOCOL* memmap_file;
-  status = root_dir->Open(
-      root_dir, &memmap_file, L"\\memmap",
-      EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, 0);
+  CHAR8 cmdline[256];
+  status = ReadCommandLine(root_dir, cmdline, sizeof(cmdline));
   if (EFI_ERROR(status)) {
-    Print(L"Failed to open file memmap: %r\n", status);
+    Print(L"Failed to ReadCommandLine: %r\n", status);
     Halt();
   }
+  Print(L"Command line: %a\n", cmdline);
+  EndPhase("cmdline");
 
-  status = SaveMemoryMap(&memmap, memmap_file);
+  // get memroy map
+  CHAR8 memmap_buf[4096 * 4];
+  struct MemoryMap memmap = {sizeof(memmap_buf), memmap_buf, 0, 0, 0, 0};
+
+  status = GetMemoryMap(&memmap);
   if (EFI_ERROR(status)) {
-    Print(L"Failed to SaveMemoryMap: %r\n", status);
+    Print(L"Failed to GetMemoryMap: %r\n", status);
     Halt();
   }
-  status = memmap_file->Close(memmap_file);
-  if (EFI_ERROR(status)) {
-    Print(L"Failed to close memmap: %r\n", status);
-    Halt();
+
+  // save memory map to the file only if "memmap" option is given,
+  // since writing it to the boot volume is slow
+  if (FindOption(cmdline, "memmap") != NULL) {
+    EFI_FILE_PROTOCOL* memmap_file;
+    status = root_dir->Open(
+        root_dir, &memmap_file, L"\\memmap",
+        EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE | EFI_FILE_MODE_CREATE, 0);
+    if (EFI_ERROR(status)) {
+      Print(L"Failed to open file memmap: %r\n", status);
+      Halt();
+    }
+
+    status = SaveMemoryMap(&memmap, memmap_file);
+    if (EFI_ERROR(status)) {
+      Print(L"Failed to SaveMemoryMap: %r\n", status);
+      Halt();
+    }
+    status = memmap_file->Close(memmap_file);
+    if (EFI_ERROR(status)) {
+      Print(L"Failed to close memmap: %r\n", status);
+      Halt();
+    }
   }
+  EndPhase("memmap");
 
   // fill screen
   EFI_GRAPHICS_OUTPUT_PROTOCOL* gop;
-  status = FillScreen(image_handle, &gop);
+  status = FillScreen(image_handle, FindOption(cmdline, "gop"), &gop);
   if (EFI_ERROR(status)) {
     Print(L"Failed to FillScreen: %r\n", status);
     Halt();
   }
+  EndPhase("screen");
 
   // load kernel
-  EFI_PHYSICAL_ADDRESS kernel_base_addr = 0x100000;
-  status = LoadKernel(root_dir, kernel_base_addr);
+  UINT64 entry_addr;
+  status = LoadKernel(root_dir, &entry_addr);
   if (EFI_ERROR(status)) {
     Print(L"Failed to LoadKernel: %r\n", status);
     Halt();
   }
+  EndPhase("kernel");
+
+  // find ACPI table (RSDP) to pass to the kernel via boot info
+  VOID* acpi_table = NULL;
+  for (UINTN i = 0; i < gST->NumberOfTableEntries; ++i) {
+    if (CompareGuid(&gEfiAcpiTableGuid,
+                    &gST->ConfigurationTable[i].VendorGuid)) {
+      acpi_table = gST->ConfigurationTable[i].VendorTable;
+      break;
+    }
+  }
+  EndPhase("acpi");
+
+  Print(L"Boot phases:\n");
+  PrintPhaseTimings();
+
+  // boot info is allocated as loader data, which the kernel does not reuse
+  struct BootInfo* boot_info;
+  status = gBS->AllocatePool(EfiLoaderData, sizeof(struct BootInfo),
+                             (VOID**)&boot_info);
+  if (EFI_ERROR(status)) {
+    Print(L"Failed to allocate boot info: %r\n", status);
+    Halt();
+  }
+  SetMem(boot_info, sizeof(struct BootInfo), 0);
+  boot_info->magic = BOOT_INFO_MAGIC;
+  boot_info->version = BOOT_INFO_VERSION;
+  boot_info->size = sizeof(struct BootInfo);
+  boot_info->acpi_rsdp = acpi_table;
+  boot_info->runtime_services = gST->RuntimeServices;
+  boot_info->tsc_per_us = tsc_per_us;
+  AsciiStrCpyS(boot_info->cmdline, sizeof(boot_info->cmdline), cmdline);
 
   // exit boot service
   status = ExitBootService(image_handle, &memmap);
@@ -401,10 +939,9 @@ EFI_STATUS EFIAPI UefiMain(
     Print(L"Failed to ExitBootService: %r\n", status);
     Halt();
   }
+  EndPhase("exit");
 
   // launch kernel
-  UINT64 entry_addr = *(UINT64*)(kernel_base_addr + 24);
-
   struct FrameBufferConfig config = {
       (UINT8*)gop->Mode->FrameBufferBase,
       gop->Mode->Info->PixelsPerScanLine,
@@ -424,10 +961,15 @@ EFI_STATUS EFIAPI UefiMain(
       Halt();
   }
 
-  typedef void EntryPointType(const struct FrameBufferConfig*,
-                              const struct MemoryMap*);
+  boot_info->frame_buffer_config = config;
+  boot_info->memory_map = memmap;
+  boot_info->num_timestamps = num_boot_phases;
+  CopyMem(boot_info->timestamps, boot_phases,
+          sizeof(struct BootTimestamp) * num_boot_phases);
+
+  typedef void EntryPointType(const struct BootInfo*);
   EntryPointType* entry_point = (EntryPointType*)entry_addr;
-  entry_point(&config, &memmap);
+  entry_point(boot_info);
 
   Print(L"All done\n");
 
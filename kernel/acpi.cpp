@@ -0,0 +1,128 @@
+/**
+ * @file acpi.cpp
+ *
+ * ACPI テーブルの定義や操作用プログラムを集めたファイル．
+ */
+
+#include "acpi.hpp"
+
+#include <cstring>
+#include "asmfunc.h"
+#include "logger.hpp"
+
+namespace {
+  template <typename T>
+  uint8_t SumBytes(const T* data, size_t bytes) {
+    const auto p = reinterpret_cast<const uint8_t*>(data);
+    uint8_t sum = 0;
+    for (size_t i = 0; i < bytes; ++i) {
+      sum += p[i];
+    }
+    return sum;
+  }
+}  // namespace
+
+namespace acpi {
+  bool RSDP::IsValid() const {
+    if (strncmp(this->signature, "RSD PTR ", 8) != 0) {
+      Log(kDebug, "invalid signature: %.8s\n", this->signature);
+      return false;
+    }
+    if (this->revision != 2) {
+      Log(kDebug, "ACPI revision must be 2: %d\n", this->revision);
+      return false;
+    }
+    if (auto sum = SumBytes(this, 20); sum != 0) {
+      Log(kDebug, "sum of 20 bytes must be 0: %d\n", sum);
+      return false;
+    }
+    if (auto sum = SumBytes(this, 36); sum != 0) {
+      Log(kDebug, "sum of 36 bytes must be 0: %d\n", sum);
+      return false;
+    }
+    return true;
+  }
+
+  bool DescriptionHeader::IsValid(const char* expected_signature) const {
+    if (strncmp(this->signature, expected_signature, 4) != 0) {
+      return false;
+    }
+    if (auto sum = SumBytes(this, this->length); sum != 0) {
+      Log(kDebug, "sum of %u bytes must be 0: %d\n", this->length, sum);
+      return false;
+    }
+    return true;
+  }
+
+  const DescriptionHeader& XSDT::operator[](size_t i) const {
+    // エントリは 4 バイト境界にしか揃っていないので memcpy で読む
+    uint64_t addr;
+    memcpy(&addr, reinterpret_cast<const uint8_t*>(&this->header + 1) + 8 * i, 8);
+    return *reinterpret_cast<const DescriptionHeader*>(addr);
+  }
+
+  size_t XSDT::Count() const {
+    return (this->header.length - sizeof(DescriptionHeader)) / sizeof(uint64_t);
+  }
+
+  const MCFGEntry& MCFG::operator[](size_t i) const {
+    return reinterpret_cast<const MCFGEntry*>(this + 1)[i];
+  }
+
+  size_t MCFG::Count() const {
+    return (this->header.length - sizeof(MCFG)) / sizeof(MCFGEntry);
+  }
+
+  Error Initialize(const RSDP& rsdp) {
+    if (!rsdp.IsValid()) {
+      Log(kError, "RSDP is not valid\n");
+      return MAKE_ERROR(Error::kInvalidFormat);
+    }
+
+    const XSDT& xsdt = *reinterpret_cast<const XSDT*>(rsdp.xsdt_address);
+    if (!xsdt.header.IsValid("XSDT")) {
+      Log(kError, "XSDT is not valid\n");
+      return MAKE_ERROR(Error::kInvalidFormat);
+    }
+
+    mcfg = nullptr;
+    fadt = nullptr;
+    for (size_t i = 0; i < xsdt.Count(); ++i) {
+      const auto& entry = xsdt[i];
+      if (entry.IsValid("MCFG")) {
+        mcfg = reinterpret_cast<const MCFG*>(&entry);
+      } else if (entry.IsValid("FACP")) {
+        fadt = reinterpret_cast<const FADT*>(&entry);
+      }
+    }
+
+    if (mcfg) {
+      for (size_t i = 0; i < mcfg->Count(); ++i) {
+        const auto& e = (*mcfg)[i];
+        Log(kDebug, "MCFG: segment %u, bus %u-%u, base %08lx\n",
+            e.segment_group, e.start_bus, e.end_bus, e.base_address);
+      }
+    } else {
+      Log(kInfo, "MCFG is not found\n");
+    }
+    if (fadt == nullptr) {
+      Log(kInfo, "FADT is not found\n");
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  void WaitMilliseconds(unsigned long msec) {
+    const bool pm_timer_32 = (fadt->flags >> 8) & 1;
+    const uint32_t start = IoIn32(fadt->pm_tmr_blk);
+    uint32_t end = start + kPMTimerFreq * msec / 1000;
+    if (!pm_timer_32) {
+      end &= 0x00ffffffu;
+    }
+
+    // カウンタが一周する場合は，まず 0 に戻るのを待つ
+    if (end < start) {
+      while (IoIn32(fadt->pm_tmr_blk) >= start);
+    }
+    while (IoIn32(fadt->pm_tmr_blk) < end);
+  }
+}  // namespace acpi
@@ -0,0 +1,113 @@
+/**
+ * @file acpi.hpp
+ *
+ * ACPI テーブルの定義や操作用プログラムを集めたファイル．
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+
+namespace acpi {
+  /** @brief Root System Description Pointer（ACPI 2.0 以降の形式） */
+  struct RSDP {
+    char signature[8];
+    uint8_t checksum;
+    char oem_id[6];
+    uint8_t revision;
+    uint32_t rsdt_address;
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t extended_checksum;
+    char reserved[3];
+
+    /** @brief シグネチャ，リビジョン，チェックサムが正しければ真を返す */
+    bool IsValid() const;
+  } __attribute__((packed));
+
+  /** @brief 各記述テーブルに共通のヘッダ */
+  struct DescriptionHeader {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+
+    /** @brief シグネチャが expected_signature と一致し，チェックサムが正しければ真を返す */
+    bool IsValid(const char* expected_signature) const;
+  } __attribute__((packed));
+
+  /** @brief Extended System Descriptor Table */
+  struct XSDT {
+    DescriptionHeader header;
+
+    /** @brief i 番目の記述テーブルを返す */
+    const DescriptionHeader& operator[](size_t i) const;
+    /** @brief 記述テーブルの数を返す */
+    size_t Count() const;
+  } __attribute__((packed));
+
+  /** @brief MCFG の 1 エントリ．1 つの PCI セグメントの ECAM 領域を表す */
+  struct MCFGEntry {
+    /** バス番号 0 に対応する ECAM 領域の物理アドレス */
+    uint64_t base_address;
+    uint16_t segment_group;
+    uint8_t start_bus;
+    uint8_t end_bus;
+    uint32_t reserved;
+  } __attribute__((packed));
+
+  /** @brief PCI Express memory mapped configuration space base address Description Table */
+  struct MCFG {
+    DescriptionHeader header;
+    uint64_t reserved;
+
+    /** @brief i 番目のエントリを返す */
+    const MCFGEntry& operator[](size_t i) const;
+    /** @brief エントリの数を返す */
+    size_t Count() const;
+  } __attribute__((packed));
+
+  /** @brief Fixed ACPI Description Table（カーネルが使うフィールドだけを名前付きにしてある） */
+  struct FADT {
+    DescriptionHeader header;
+
+    char reserved1[76 - sizeof(header)];
+    /** ACPI PM タイマの I/O ポート番号 */
+    uint32_t pm_tmr_blk;
+    char reserved2[112 - 80];
+    /** ビット 8（TMR_VAL_EXT）が 1 なら PM タイマは 32 ビット，0 なら 24 ビット */
+    uint32_t flags;
+    char reserved3[276 - 116];
+  } __attribute__((packed));
+
+  /** @brief Initialize() で見つけた MCFG．無ければ nullptr */
+  inline const MCFG* mcfg;
+  /** @brief Initialize() で見つけた FADT．無ければ nullptr */
+  inline const FADT* fadt;
+
+  /** @brief ACPI PM タイマの周波数（Hz） */
+  const int kPMTimerFreq = 3579545;
+
+  /** @brief ACPI PM タイマを使って msec ミリ秒だけビジーウェイトする．
+   *
+   * fadt が nullptr でないときだけ呼ぶこと．
+   */
+  void WaitMilliseconds(unsigned long msec);
+
+  /** @brief RSDP から XSDT をたどり，カーネルが使うテーブルを探す
+   *
+   * 見つけたテーブルは mcfg や fadt などのグローバル変数に設定する．
+   *
+   * @param rsdp  UEFI のコンフィグレーションテーブルから得た RSDP
+   * @return RSDP や XSDT が壊れていれば Error::kInvalidFormat
+   */
+  Error Initialize(const RSDP& rsdp);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "frame_buffer_config.hpp"
+#include "memory_map.hpp"
+
+// the kernel refuses to boot unless both match, so a loader and a kernel
+// built from different versions of this header are detected.
+// when adding fields, append them and increment BOOT_INFO_VERSION.
+#define BOOT_INFO_MAGIC 0x4f464e49544f4f42ull  // "BOOTINFO"
+#define BOOT_INFO_VERSION 1
+
+#define BOOT_INFO_MAX_TIMESTAMPS 16
+#define BOOT_INFO_CMDLINE_SIZE 256
+
+struct BootTimestamp {
+  char name[16];
+  uint64_t tsc;  // TSC value at the end of the phase
+};
+
+struct BootInfo {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t size;  // sizeof(struct BootInfo) seen by the loader
+
+  struct FrameBufferConfig frame_buffer_config;
+  struct MemoryMap memory_map;
+
+  const void* acpi_rsdp;         // ACPI 2.0 RSDP, NULL if the firmware has none
+  const void* runtime_services;  // EFI_RUNTIME_SERVICES (physical address)
+
+  uint64_t tsc_per_us;  // measured by the loader
+  uint32_t num_timestamps;
+  struct BootTimestamp timestamps[BOOT_INFO_MAX_TIMESTAMPS];
+
+  char cmdline[BOOT_INFO_CMDLINE_SIZE];  // NUL terminated
+};
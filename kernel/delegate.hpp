@@ -0,0 +1,60 @@
+/**
+ * @file delegate.hpp
+ *
+ * 関数ポインタとコンテキストの組で表すコールバック．
+ *
+ * std::function と違い，呼び出し対象をヒープに確保しないので，
+ * ヒープの初期化前に登録でき，呼び出しも関数ポインタ経由の 1 回で済む．
+ * コンストラクタはすべて constexpr なので，グローバル変数にしても
+ * （グローバルコンストラクタを呼ばずに）静的に初期化される．
+ */
+
+#pragma once
+
+#include <type_traits>
+
+template <typename Signature>
+class Delegate;
+
+template <typename R, typename... Args>
+class Delegate<R (Args...)> {
+ public:
+  using FunctionType = R (*)(Args...);
+  using ContextFunctionType = R (*)(void* context, Args...);
+
+  constexpr Delegate() = default;
+  constexpr Delegate(std::nullptr_t) {}
+
+  /** @brief 通常の関数，またはキャプチャの無いラムダ式から作る． */
+  template <typename F,
+            typename = std::enable_if_t<std::is_convertible_v<F, FunctionType>>>
+  constexpr Delegate(F fn) : fn_{static_cast<FunctionType>(fn)} {}
+
+  /** @brief 呼び出し時に context を第 1 引数として渡す関数から作る． */
+  constexpr Delegate(ContextFunctionType fn, void* context)
+      : context_fn_{fn}, context_{context} {}
+
+  /** @brief obj のメンバ関数 Method を呼ぶ Delegate を作る． */
+  template <typename T, R (T::*Method)(Args...)>
+  static constexpr Delegate Bind(T* obj) {
+    return Delegate{[](void* context, Args... args) -> R {
+      return (static_cast<T*>(context)->*Method)(args...);
+    }, obj};
+  }
+
+  constexpr explicit operator bool() const {
+    return fn_ != nullptr || context_fn_ != nullptr;
+  }
+
+  R operator()(Args... args) const {
+    if (fn_) {
+      return fn_(args...);
+    }
+    return context_fn_(context_, args...);
+  }
+
+ private:
+  FunctionType fn_{nullptr};
+  ContextFunctionType context_fn_{nullptr};
+  void* context_{nullptr};
+};
@@ -28,6 +28,7 @@ public:
     kNoWaiter,
     kNoPCIMSI,
     kUnknownPixelFormat,
+    kInvalidFormat,
     kLastOfCode,  // この列挙子は常に最後に配置する
   };
 
@@ -55,6 +56,7 @@ private:
       "kNoWaiter",
       "kNoPCIMSI",
       "kUnknownPixelFormat",
+      "kInvalidFormat",
   };
   static_assert(Error::Code::kLastOfCode == code_names_.size());
 
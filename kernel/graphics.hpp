@@ -86,6 +86,23 @@ Rectangle<T> operator&(const Rectangle<T>& lhs, const Rectangle<U>& rhs) {
   return {new_pos, new_size};
 }
 
+/** @brief 2 つの矩形をともに含む最小の矩形を返す。大きさが 0 の矩形は無視する。 */
+template <typename T>
+Rectangle<T> operator|(const Rectangle<T>& lhs, const Rectangle<T>& rhs) {
+  if (lhs.size.x <= 0 || lhs.size.y <= 0) {
+    return rhs;
+  }
+  if (rhs.size.x <= 0 || rhs.size.y <= 0) {
+    return lhs;
+  }
+
+  const auto lhs_end = lhs.pos + lhs.size;
+  const auto rhs_end = rhs.pos + rhs.size;
+  auto new_pos = ElementMin(lhs.pos, rhs.pos);
+  auto new_size = ElementMax(lhs_end, rhs_end) - new_pos;
+  return {new_pos, new_size};
+}
+
 class PixelWriter {
 public:
   virtual ~PixelWriter() = default;
@@ -56,7 +56,10 @@ void SetIDTEntry(InterruptDescriptor& desc,
 class InterruptVector {
 public:
   enum Number {
-    kXHCI = 0x40,
+    kXHCI = 0x40,      // xHC primary interrupter
+    kXHCIBulk = 0x41,  // xHC bulk interrupter (MSI-X only)
+    kLAPICTimer = 0x42,
+    kVirtioBlk = 0x43,
   };
 };
 
@@ -69,3 +72,17 @@ struct InterruptFrame {
 };
 
 void NotifyEndOfInterrupt();
+
+/** @brief 割り込みを禁止し，禁止する前に割り込みが許可されていたか（RFLAGS.IF）を返す */
+inline bool DisableInterrupts() {
+  uint64_t rflags;
+  __asm__ volatile("pushfq\n\tpopq %0\n\tcli" : "=r"(rflags) : : "memory");
+  return rflags & (1u << 9);
+}
+
+/** @brief DisableInterrupts の前の状態に割り込みの許可を戻す */
+inline void RestoreInterrupts(bool enabled) {
+  if (enabled) {
+    __asm__ volatile("sti" : : : "memory");
+  }
+}
@@ -0,0 +1,106 @@
+#include "keyboard.hpp"
+
+#include "interrupt.hpp"
+#include "timer.hpp"
+#include "usb/classdriver/keyboard.hpp"
+
+namespace {
+  // HID Usage ID（Keyboard/Keypad ページ）から ASCII への変換表（US 配列）
+  const char keycode_map[256] = {
+    0,    0,    0,    0,    'a',  'b',  'c',  'd', // 0
+    'e',  'f',  'g',  'h',  'i',  'j',  'k',  'l', // 8
+    'm',  'n',  'o',  'p',  'q',  'r',  's',  't', // 16
+    'u',  'v',  'w',  'x',  'y',  'z',  '1',  '2', // 24
+    '3',  '4',  '5',  '6',  '7',  '8',  '9',  '0', // 32
+    '\n', 0x1b, '\b', '\t', ' ',  '-',  '=',  '[', // 40
+    ']', '\\',  '#',  ';', '\'',  '`',  ',',  '.', // 48
+    '/',  0,    0,    0,    0,    0,    0,    0,   // 56
+    0,    0,    0,    0,    0,    0,    0,    0,   // 64
+    0,    0,    0,    0,    0,    0,    0,    0,   // 72
+    0,    0,    0,    0,    '/',  '*',  '-',  '+', // 80
+    '\n', '1',  '2',  '3',  '4',  '5',  '6',  '7', // 88
+    '8',  '9',  '0',  '.', '\\',  0,    0,    '=', // 96
+  };
+
+  const char keycode_map_shifted[256] = {
+    0,    0,    0,    0,    'A',  'B',  'C',  'D', // 0
+    'E',  'F',  'G',  'H',  'I',  'J',  'K',  'L', // 8
+    'M',  'N',  'O',  'P',  'Q',  'R',  'S',  'T', // 16
+    'U',  'V',  'W',  'X',  'Y',  'Z',  '!',  '@', // 24
+    '#',  '$',  '%',  '^',  '&',  '*',  '(',  ')', // 32
+    '\n', 0x1b, '\b', '\t', ' ',  '_',  '+',  '{', // 40
+    '}',  '|',  '~',  ':',  '"',  '~',  '<',  '>', // 48
+    '?',  0,    0,    0,    0,    0,    0,    0,   // 56
+    0,    0,    0,    0,    0,    0,    0,    0,   // 64
+    0,    0,    0,    0,    0,    0,    0,    0,   // 72
+    0,    0,    0,    0,    '/',  '*',  '-',  '+', // 80
+    '\n', '1',  '2',  '3',  '4',  '5',  '6',  '7', // 88
+    '8',  '9',  '0',  '.',  '|',  0,    0,    '=', // 96
+  };
+
+  ArrayQueue<Message>* msg_queue;
+
+  /** 自動リピート中のキー．repeat_keycode が 0 ならリピートしていない．
+   * キーが変わるたびに repeat_generation を進め，古いタイマを無視する．
+   */
+  uint8_t repeat_keycode, repeat_modifier;
+  int repeat_generation;
+
+  void PushKeyMessage(uint8_t modifier, uint8_t keycode, bool press, bool repeat) {
+    Message msg{Message::kKeyPush};
+    msg.arg.keyboard.modifier = modifier;
+    msg.arg.keyboard.keycode = keycode;
+    msg.arg.keyboard.ascii = KeycodeToAscii(keycode, modifier);
+    msg.arg.keyboard.press = press;
+    msg.arg.keyboard.repeat = repeat;
+
+    // 割り込みハンドラも同じキューに積むので，その間は割り込みを止める
+    const bool interrupts_enabled = DisableInterrupts();
+    msg_queue->Push(msg);
+    RestoreInterrupts(interrupts_enabled);
+  }
+
+  void StartRepeat(uint8_t modifier, uint8_t keycode, unsigned long delay) {
+    repeat_keycode = keycode;
+    repeat_modifier = modifier;
+    ++repeat_generation;
+    timer_manager->AddTimer(Timer{
+        timer_manager->CurrentTick() + delay,
+        kKeyRepeatTimerTag | (repeat_generation & 0xffffff)});
+  }
+
+  void OnKey(uint8_t modifier, uint8_t keycode, bool press) {
+    PushKeyMessage(modifier, keycode, press, false);
+
+    if (press) {
+      StartRepeat(modifier, keycode, kKeyRepeatDelay);
+    } else if (keycode == repeat_keycode) {
+      repeat_keycode = 0;
+      ++repeat_generation;
+    }
+  }
+}  // namespace
+
+void InitializeKeyboard(ArrayQueue<Message>& msg_queue) {
+  ::msg_queue = &msg_queue;
+  usb::HIDKeyboardDriver::default_observer = OnKey;
+}
+
+char KeycodeToAscii(uint8_t keycode, uint8_t modifier) {
+  const bool shift = (modifier & (modifier::kLShift | modifier::kRShift)) != 0;
+  return shift ? keycode_map_shifted[keycode] : keycode_map[keycode];
+}
+
+bool OnKeyRepeatTimeout(int timer_value) {
+  if ((timer_value & 0xff000000) != kKeyRepeatTimerTag) {
+    return false;
+  }
+  if (repeat_keycode == 0 ||
+      (timer_value & 0xffffff) != (repeat_generation & 0xffffff)) {
+    return true;  // リピート中に別のキーが押されたか，離された
+  }
+
+  PushKeyMessage(repeat_modifier, repeat_keycode, true, true);
+  StartRepeat(repeat_modifier, repeat_keycode, kKeyRepeatInterval);
+  return true;
+}
@@ -0,0 +1,40 @@
+/**
+ * @file keyboard.hpp
+ *
+ * キーボード入力をメッセージに変換する機能．
+ */
+
+#pragma once
+
+#include "message.hpp"
+#include "queue.hpp"
+
+/** @brief 修飾キーのビット（HID キーボードレポートの先頭バイトと同じ並び） */
+namespace modifier {
+  const uint8_t kLControl = 1u << 0;
+  const uint8_t kLShift   = 1u << 1;
+  const uint8_t kLAlt     = 1u << 2;
+  const uint8_t kLGUI     = 1u << 3;
+  const uint8_t kRControl = 1u << 4;
+  const uint8_t kRShift   = 1u << 5;
+  const uint8_t kRAlt     = 1u << 6;
+  const uint8_t kRGUI     = 1u << 7;
+}
+
+/** @brief キーを押してから自動リピートが始まるまでの tick 数と，リピートの間隔 */
+const unsigned long kKeyRepeatDelay = 50;
+const unsigned long kKeyRepeatInterval = 3;
+
+/** @brief 自動リピート用タイマの Timer::Value の上位 8 ビット */
+const int kKeyRepeatTimerTag = 0x4b000000;
+
+/** @brief HID キーボードドライバに，キーの押下・解放を msg_queue に
+ * kKeyPush メッセージとして積むオブザーバを登録する．
+ */
+void InitializeKeyboard(ArrayQueue<Message>& msg_queue);
+
+/** @brief キーコードと修飾キーから ASCII 文字を求める．対応する文字が無ければ 0． */
+char KeycodeToAscii(uint8_t keycode, uint8_t modifier);
+
+/** @brief kTimerTimeout メッセージが自動リピート用のタイマなら処理して true を返す． */
+bool OnKeyRepeatTimeout(int timer_value);
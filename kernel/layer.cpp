@@ -67,6 +67,7 @@ void LayerManager::Draw(const Rectangle<int>& area) const {
     layer->DrawTo(back_buffer_, area);
   }
   screen_->Copy(area.pos, back_buffer_, area);
+  DrawCursor(area);
 }
 
 void LayerManager::Draw(unsigned int id) const {
@@ -84,6 +85,7 @@ void LayerManager::Draw(unsigned int id) const {
   }
 
   screen_->Copy(window_area.pos, back_buffer_, window_area);
+  DrawCursor(window_area);
 }
 
 void LayerManager::Move(unsigned int id, Vector2D<int> new_pos) {
@@ -104,6 +106,21 @@ void LayerManager::MoveRelative(unsigned int id, Vector2D<int> pos_diff) {
   Draw(id);
 }
 
+void LayerManager::MoveRelative(std::initializer_list<unsigned int> ids,
+                                Vector2D<int> pos_diff) {
+  Rectangle<int> dirty{{0, 0}, {0, 0}};
+  for (auto id : ids) {
+    auto layer = FindLayer(id);
+    const auto window_size = layer->GetWindow()->Size();
+    dirty = dirty | Rectangle<int>{layer->GetPosition(), window_size};
+    layer->MoveRelative(pos_diff);
+    dirty = dirty | Rectangle<int>{layer->GetPosition(), window_size};
+  }
+  if (dirty.size.x > 0 && dirty.size.y > 0) {
+    Draw(dirty);
+  }
+}
+
 void LayerManager::UpDown(unsigned int id, int new_height) {
   if (new_height < 0) {
     Hide(id);
@@ -159,6 +176,43 @@ Layer* LayerManager::FindLayerByPosition(Vector2D<int> pos, unsigned int exclude
   return *it;
 }
 
+void LayerManager::SetCursor(const std::shared_ptr<Window>& window, Vector2D<int> pos) {
+  cursor_window_ = window;
+  cursor_pos_ = pos;
+  DrawCursor({cursor_pos_, cursor_window_->Size()});
+}
+
+void LayerManager::MoveCursor(Vector2D<int> pos) {
+  if (!cursor_window_) {
+    return;
+  }
+  const Rectangle<int> old_area{cursor_pos_, cursor_window_->Size()};
+  cursor_pos_ = pos;
+  screen_->Copy(old_area.pos, back_buffer_, old_area);
+  DrawCursor({cursor_pos_, cursor_window_->Size()});
+}
+
+void LayerManager::DrawCursor(const Rectangle<int>& area) const {
+  if (!cursor_window_ || !screen_) {
+    return;
+  }
+
+  auto& writer = screen_->Writer();
+  const Rectangle<int> screen_area{{0, 0}, {writer.Width(), writer.Height()}};
+  const Rectangle<int> cursor_area{cursor_pos_, cursor_window_->Size()};
+  const auto draw_area = screen_area & cursor_area & area;
+
+  const auto tc = cursor_window_->TransparentColor();
+  for (int y = draw_area.pos.y; y < draw_area.pos.y + draw_area.size.y; ++y) {
+    for (int x = draw_area.pos.x; x < draw_area.pos.x + draw_area.size.x; ++x) {
+      const auto& c = cursor_window_->At(Vector2D<int>{x, y} - cursor_pos_);
+      if (!tc || c != tc.value()) {
+        writer.Write({x, y}, c);
+      }
+    }
+  }
+}
+
 Layer* LayerManager::FindLayer(unsigned int id) {
   auto pred = [id](const std::unique_ptr<Layer>& elem) {
     return elem->ID() == id;
@@ -6,6 +6,7 @@
 
 #pragma once
 
+#include <initializer_list>
 #include <memory>
 #include <map>
 #include <vector>
@@ -82,6 +83,13 @@ public:
   /** @brief レイヤーの位置情報を指定された相対座標へと更新する。再描画する。 */
   void MoveRelative(unsigned int id, Vector2D<int> pos_diff);
 
+  /** @brief 複数のレイヤーを同じだけ相対移動し，まとめて再描画する。
+   *
+   * 各レイヤーの移動前と移動後の領域をすべて含む矩形を 1 度だけ再描画する。
+   * 重なり合った複数のウィンドウを一緒に動かすときに使う。
+   */
+  void MoveRelative(std::initializer_list<unsigned int> ids, Vector2D<int> pos_diff);
+
   /** @brief レイヤーの高さ方向の位置を指定された位置に移動する。
    *
    * new_height に負の高さを指定するとレイヤーは非表示となり，
@@ -95,6 +103,19 @@ public:
   /** @brief 指定された座標にウィンドウを持つ最も上に表示されているレイヤーを探す。 */
   Layer* FindLayerByPosition(Vector2D<int> pos, unsigned int exclude_id) const;
 
+  /** @brief マウスカーソルの画像と位置を設定し，描画する。
+   *
+   * カーソルはレイヤーとしては扱わず，合成済みの画面の上に直接重ねて描く。
+   * window には透過色を設定しておくこと。
+   */
+  void SetCursor(const std::shared_ptr<Window>& window, Vector2D<int> pos);
+  /** @brief マウスカーソルを移動する。
+   *
+   * レイヤーの合成はせず，移動前の位置の画素を合成結果（back_buffer_）から
+   * 書き戻し，移動後の位置にカーソルを描くだけで済ませる。
+   */
+  void MoveCursor(Vector2D<int> pos);
+
 private:
   FrameBuffer* screen_{nullptr};
   mutable FrameBuffer back_buffer_{};
@@ -102,7 +123,12 @@ private:
   std::vector<Layer*> layer_stack_{};
   unsigned int latest_id_{0};
 
+  std::shared_ptr<Window> cursor_window_{};
+  Vector2D<int> cursor_pos_{};
+
   Layer* FindLayer(unsigned int id);
+  /** @brief 画面の area 内にかかるカーソルの部分を描く。合成結果を画面へ転送した後に呼ぶ。 */
+  void DrawCursor(const Rectangle<int>& area) const;
 };
 
 extern LayerManager* layer_manager;
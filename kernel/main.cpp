@@ -8,30 +8,39 @@
 #include <cstdint>
 #include <cstdio>
 
+#include <iterator>
 #include <numeric>
 #include <vector>
 
+#include "acpi.hpp"
 #include "asmfunc.h"
+#include "boot_info.hpp"
 #include "console.hpp"
 #include "font.hpp"
 #include "frame_buffer_config.hpp"
 #include "graphics.hpp"
 #include "interrupt.hpp"
+#include "keyboard.hpp"
 #include "layer.hpp"
 #include "logger.hpp"
 #include "memory_manager.hpp"
 #include "memory_map.hpp"
+#include "message.hpp"
 #include "mouse.hpp"
 #include "paging.hpp"
 #include "pci.hpp"
+#include "pci_driver.hpp"
 #include "queue.hpp"
 #include "segment.hpp"
+#include "timer.hpp"
 
+#include "usb/classdriver/hub.hpp"
 #include "usb/classdriver/mouse.hpp"
 #include "usb/device.hpp"
 #include "usb/memory.hpp"
 #include "usb/xhci/trb.hpp"
 #include "usb/xhci/xhci.hpp"
+#include "virtio/blk.hpp"
 #include "window.hpp"
 
 char pixel_writer_buf[sizeof(RGBResv8BitPerColorPixelWriter)];
@@ -56,55 +65,79 @@ int printk(const char* format, ...) {
 char memory_manager_buf[sizeof(BitmapMemoryManager)];
 BitmapMemoryManager* memory_manager;
 
-unsigned int mouse_layer_id;
 Vector2D<int> screen_size;
 Vector2D<int> mouse_position;
 
-void MouseObserver(uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
+/** @brief HID レポートで受け取ったマウスの動きを溜めておき，フレームごとにまとめて反映する．
+ *
+ * ポーリング周期の短いマウスではレポートごとにレイヤーを動かすと
+ * 再描画だけで CPU を使い切ってしまう．
+ */
+struct PendingMouseMotion {
+  Vector2D<int> displacement;
+  uint8_t buttons;
+  bool dirty;
+} pending_mouse;
+
+void ApplyMouseMotion() {
   static unsigned int mouse_drag_layer_id = 0;
   static uint8_t previous_buttons = 0;
 
+  if (!pending_mouse.dirty) {
+    return;
+  }
+  pending_mouse.dirty = false;
+  const uint8_t buttons = pending_mouse.buttons;
+
   const auto oldpos = mouse_position;
-  auto newpos = mouse_position + Vector2D<int>{displacement_x, displacement_y};
+  auto newpos = mouse_position + pending_mouse.displacement;
   newpos = ElementMin(newpos, screen_size + Vector2D<int>{-1, -1});
   mouse_position = ElementMax(newpos, {0, 0});
+  pending_mouse.displacement = {0, 0};
 
   const auto posdiff = mouse_position - oldpos;
 
-  layer_manager->Move(mouse_layer_id, mouse_position);
-
   const bool previous_left_pressed = (previous_buttons & 0x01);
   const bool left_pressed = (buttons & 0x01);
   // mouse left pressed
   // #@@range_begin(check_draggable)
   if (!previous_left_pressed && left_pressed) {
-    auto layer = layer_manager->FindLayerByPosition(mouse_position, mouse_layer_id);
+    auto layer = layer_manager->FindLayerByPosition(mouse_position, 0);
     if (layer && layer->IsDraggable()) {
       mouse_drag_layer_id = layer->ID();
     }
     // #@@range_end(check_draggable)
     // continue pressed
   } else if (previous_left_pressed && left_pressed) {
-    if (mouse_drag_layer_id > 0) {
-      layer_manager->MoveRelative(mouse_drag_layer_id, posdiff);
+    if (mouse_drag_layer_id > 0 && (posdiff.x != 0 || posdiff.y != 0)) {
+      layer_manager->MoveRelative({mouse_drag_layer_id}, posdiff);
     }
     // mouse left up
   } else if (previous_left_pressed && !left_pressed) {
     mouse_drag_layer_id = 0;
   }
 
+  // カーソルはレイヤーの合成をせずに動かせる
+  if (posdiff.x != 0 || posdiff.y != 0) {
+    layer_manager->MoveCursor(mouse_position);
+  }
+
   previous_buttons = buttons;
 }
 
-void SwitchEhci2Xhci(const pci::Device& xhc_dev) {
-  bool intel_ehc_exist = false;
-  for (int i = 0; i < pci::num_device; ++i) {
-    if (pci::devices[i].class_code.Match(0x0cu, 0x03u, 0x20u) /* EHCI */ &&
-        0x8086 == pci::ReadVendorId(pci::devices[i])) {
-      intel_ehc_exist = true;
-      break;
-    }
+void MouseObserver(uint8_t buttons, int displacement_x, int displacement_y, int wheel) {
+  // ボタンの状態が変わるなら，それまでの移動を変わる前の状態で反映しておく
+  if (pending_mouse.dirty && buttons != pending_mouse.buttons) {
+    ApplyMouseMotion();
   }
+  pending_mouse.displacement += Vector2D<int>{displacement_x, displacement_y};
+  pending_mouse.buttons = buttons;
+  pending_mouse.dirty = true;
+}
+
+void SwitchEhci2Xhci(const pci::Device& xhc_dev) {
+  const bool intel_ehc_exist =
+      pci::FindDeviceByClass({0x0cu, 0x03u, 0x20u} /* EHCI */, 0x8086) != nullptr;
 
   if (!intel_ehc_exist) {
     return;
@@ -120,28 +153,215 @@ void SwitchEhci2Xhci(const pci::Device& xhc_dev) {
 
 usb::xhci::Controller* xhc;
 
-struct Message {
-  enum Type {
-    kInterruptXHCI,
-  } type;
-};
-
 ArrayQueue<Message>* main_queue;
 
-/* XHCI Interrupt handler */
+/** インタラプタ i の kInterruptXHCI メッセージがキューに積まれていて
+ * 未処理なら xhci_interrupt_pending[i] が true．
+ *
+ * イベントリングは 1 つのメッセージの処理で空になるまで読み出すので，
+ * 未処理のメッセージがある間は新たなメッセージを積む必要がない．
+ */
+volatile bool xhci_interrupt_pending[usb::xhci::Controller::kMaxInterrupters] = {};
+
+static_assert(InterruptVector::kXHCIBulk ==
+              InterruptVector::kXHCI + usb::xhci::kBulkInterrupter,
+              "MSI-X assigns consecutive vectors to xHC interrupters");
+
+void OnInterruptXHCI(int interrupter) {
+  if (xhc == nullptr) {
+    // 初期化に失敗した xHC からの割り込み．処理する相手がいない
+    NotifyEndOfInterrupt();
+    return;
+  }
+  xhc->ModeratorAt(interrupter)->OnInterrupt();
+  if (!xhci_interrupt_pending[interrupter]) {
+    xhci_interrupt_pending[interrupter] = true;
+    Message msg{Message::kInterruptXHCI};
+    msg.arg.xhci.interrupter = interrupter;
+    if (main_queue->Push(msg)) {
+      xhci_interrupt_pending[interrupter] = false;
+    }
+  }
+  NotifyEndOfInterrupt();
+}
+
+/* XHCI Interrupt handlers (one per interrupter) */
 __attribute__((interrupt)) void IntHandlerXHCI(InterruptFrame* frame) {
-  main_queue->Push(Message{Message::kInterruptXHCI});
+  OnInterruptXHCI(usb::xhci::kPrimaryInterrupter);
+}
+
+__attribute__((interrupt)) void IntHandlerXHCIBulk(InterruptFrame* frame) {
+  OnInterruptXHCI(usb::xhci::kBulkInterrupter);
+}
+
+__attribute__((interrupt)) void IntHandlerLAPICTimer(InterruptFrame* frame) {
+  LAPICTimerOnInterrupt();
   NotifyEndOfInterrupt();
 }
 
+/** @brief xHC を初期化し，接続済みのポートの設定を始める．
+ *
+ * ポートの設定はコマンドを積むだけで，続きはイベントリングの処理で進む．
+ */
+Error ProbeXHC(pci::Device& xhc_dev) {
+  // setup msi-x interrupt to xhc: one edge-triggered vector per interrupter.
+  // fall back to a single msi vector (and a single interrupter) if msi-x is unavailable.
+  // vectors are enabled only after the controller is initialized successfully.
+  const uint8_t bsp_local_apic_id =
+      *reinterpret_cast<const uint32_t*>(0xfee00020) >> 24;
+  int xhc_num_interrupters = usb::xhci::Controller::kMaxInterrupters;
+  pci::MSIX xhc_msix{xhc_dev};
+  const auto msix_err = xhc_msix.Initialize();  // 成功すると全エントリがマスクされた状態になる
+  if (msix_err) {
+    Log(kInfo, "MSI-X is not available for xHC (%s). falling back to MSI\n",
+        msix_err.Name());
+    xhc_num_interrupters = 1;
+  } else {
+    xhc_num_interrupters = std::min<int>(xhc_num_interrupters, xhc_msix.TableSize());
+  }
+
+  const WithError<uint64_t> xhc_bar = pci::ReadBar(xhc_dev, 0);
+  if (xhc_bar.error) {
+    if (!msix_err) {
+      xhc_msix.SetFunctionMask(true);
+    }
+    return xhc_bar.error;
+  }
+  const uint64_t xhc_mmio_base = xhc_bar.value & ~static_cast<uint64_t>(0xf);
+  Log(kDebug, "xHC mmio_base = %08lx\n", xhc_mmio_base);
+
+  auto controller = new usb::xhci::Controller{xhc_mmio_base};
+
+  if (0x8086 == xhc_dev.vendor_id) {
+    SwitchEhci2Xhci(xhc_dev);
+  }
+  if (auto err = controller->Initialize(xhc_num_interrupters)) {
+    if (!msix_err) {
+      xhc_msix.SetFunctionMask(true);
+    }
+    delete controller;
+    return err;
+  }
+
+  if (msix_err) {
+    if (auto err = pci::ConfigureMSIFixedDestination(
+            xhc_dev, bsp_local_apic_id,
+            pci::MSITriggerMode::kEdge, pci::MSIDeliveryMode::kFixed,
+            InterruptVector::kXHCI, 0)) {
+      delete controller;
+      return err;
+    }
+  } else {
+    // Initialize は xHC の MaxIntrs でもさらに制限するので，実際に使う数だけ有効にする
+    for (int i = 0; i < controller->NumInterrupters(); ++i) {
+      xhc_msix.SetVector(i, bsp_local_apic_id,
+                         pci::MSITriggerMode::kEdge, pci::MSIDeliveryMode::kFixed,
+                         InterruptVector::kXHCI + i);
+      xhc_msix.Unmask(i);
+    }
+  }
+  Log(kInfo, "xHC starting\n");
+  controller->Run();
+
+  ::xhc = controller;
+
+  for (int i = 1; i <= controller->MaxPorts(); ++i) {
+    auto port = controller->PortAt(i);
+    Log(kDebug, "Port %d: IsConnected=%d\n", i, port.IsConnected());
+
+    if (port.IsConnected()) {
+      if (auto err = ConfigurePort(*controller, port)) {
+        Log(kError, "failed to configure port: %s at %s:%d\n",
+            err.Name(), err.File(), err.Line());
+        continue;
+      }
+    }
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+/** Intel 製を優先して xHC を 1 つだけ使う */
+constexpr pci::DeviceMatch kXHCIMatches[] = {
+  pci::MatchClass(0x0cu, 0x03u, 0x30u, 0x8086),
+  pci::MatchClass(0x0cu, 0x03u, 0x30u),
+};
+
+constexpr pci::Driver kXHCIDriver{
+  "xhci", kXHCIMatches, std::size(kXHCIMatches), 1, ProbeXHC,
+};
+
+virtio::BlockDevice* virtio_blk;
+
+/** virtio-blk の kInterruptVirtioBlk メッセージが未処理なら true */
+volatile bool virtio_blk_interrupt_pending = false;
+
+__attribute__((interrupt)) void IntHandlerVirtioBlk(InterruptFrame* frame) {
+  if (virtio_blk == nullptr) {
+    // 初期化に失敗したデバイスからの割り込み．処理する相手がいない
+    NotifyEndOfInterrupt();
+    return;
+  }
+  if (!virtio_blk_interrupt_pending) {
+    virtio_blk_interrupt_pending = true;
+    if (main_queue->Push(Message{Message::kInterruptVirtioBlk})) {
+      virtio_blk_interrupt_pending = false;
+    }
+  }
+  NotifyEndOfInterrupt();
+}
+
+Error ProbeVirtioBlk(pci::Device& dev) {
+  const uint8_t bsp_local_apic_id =
+      *reinterpret_cast<const uint32_t*>(0xfee00020) >> 24;
+  auto blk = new virtio::BlockDevice{dev};
+  if (auto err = blk->Initialize(bsp_local_apic_id, InterruptVector::kVirtioBlk)) {
+    delete blk;
+    return err;
+  }
+  ::virtio_blk = blk;
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+/** modern（0x1042）と transitional（0x1001）の virtio-blk．割り込みベクタが 1 つなので 1 台だけ使う */
+constexpr pci::DeviceMatch kVirtioBlkMatches[] = {
+  pci::MatchId(0x1af4, 0x1042),
+  pci::MatchId(0x1af4, 0x1001),
+};
+
+constexpr pci::Driver kVirtioBlkDriver{
+  "virtio-blk", kVirtioBlkMatches, std::size(kVirtioBlkMatches), 1, ProbeVirtioBlk,
+};
+
 /* kernel stack */
 alignas(16) uint8_t kernel_main_stack[1024 * 1024];
 
-extern "C" void KernelMainNewStack(
-    const FrameBufferConfig& frame_buffer_config_ref,
-    const MemoryMap& memory_map_ref) {
-  FrameBufferConfig frame_buffer_config{frame_buffer_config_ref};
-  MemoryMap memory_map{memory_map_ref};
+/** @brief ローダから渡されたコマンドラインと各フェーズの所要時間を表示する．
+ *
+ * ログレベルに関わらず見えるよう，Log ではなく printk で出す．
+ */
+void PrintBootInfo(const BootInfo& boot_info) {
+  printk("command line: %s\n", boot_info.cmdline);
+  if (boot_info.tsc_per_us == 0) {
+    return;
+  }
+  for (uint32_t i = 1; i < boot_info.num_timestamps; ++i) {
+    const auto& ts = boot_info.timestamps[i];
+    printk("loader %s: %lu us\n", ts.name,
+        (ts.tsc - boot_info.timestamps[i - 1].tsc) / boot_info.tsc_per_us);
+  }
+}
+
+extern "C" void KernelMainNewStack(const BootInfo& boot_info_ref) {
+  // 別の版のローダから起動されたら，画面の情報も信用できないので止まる
+  if (boot_info_ref.magic != BOOT_INFO_MAGIC ||
+      boot_info_ref.version != BOOT_INFO_VERSION ||
+      boot_info_ref.size != sizeof(BootInfo)) {
+    while (1) __asm__("hlt");
+  }
+
+  BootInfo boot_info{boot_info_ref};
+  FrameBufferConfig frame_buffer_config{boot_info.frame_buffer_config};
+  MemoryMap memory_map{boot_info.memory_map};
 
   // initialize PixelWriter
   switch (frame_buffer_config.pixel_format) {
@@ -164,6 +384,7 @@ extern "C" void KernelMainNewStack(
 
   printk("Welcome to MikanOS!\n");
   SetLogLevel(kWarn);
+  PrintBootInfo(boot_info);
 
   // setup segment
   SetupSegments();
@@ -217,86 +438,57 @@ extern "C" void KernelMainNewStack(
   ArrayQueue<Message> main_queue{main_queue_data};
   ::main_queue = &main_queue;
 
+  // find ECAM region from ACPI MCFG. fall back to IO port access without it
+  const auto acpi_table = reinterpret_cast<const acpi::RSDP*>(boot_info.acpi_rsdp);
+  if (acpi_table == nullptr) {
+    Log(kWarn, "ACPI table is not passed by the loader\n");
+  } else if (auto err = acpi::Initialize(*acpi_table)) {
+    Log(kWarn, "failed to parse ACPI table: %s at %s:%d\n",
+        err.Name(), err.File(), err.Line());
+  } else if (acpi::mcfg) {
+    pci::EnableECAM(*acpi::mcfg);
+  }
+
   // scan PCI devices
   auto err = pci::ScanAllBus();
   Log(kDebug, "ScanAllBus: %s\n", err.Name());
 
-  for (int i = 0; i < pci::num_device; ++i) {
-    const auto& dev = pci::devices[i];
-    auto vendor_id = pci::ReadVendorId(dev);
-    auto class_code = pci::ReadClassCode(dev.bus, dev.device, dev.function);
-    Log(kDebug, "%d.%d.%d: vend %04x, class %08x, head %02x\n",
-        dev.bus, dev.device, dev.function,
-        vendor_id, class_code, dev.header_type);
-  }
-
-  // Intel 製を優先して xHC を探す
-  pci::Device* xhc_dev = nullptr;
-  for (int i = 0; i < pci::num_device; ++i) {
-    if (pci::devices[i].class_code.Match(0x0cu, 0x03u, 0x30u)) {
-      xhc_dev = &pci::devices[i];
-
-      if (0x8086 == pci::ReadVendorId(*xhc_dev)) {
-        break;
-      }
-    }
-  }
-
-  if (xhc_dev) {
-    Log(kInfo, "xHC has been found: %d.%d.%d\n",
-        xhc_dev->bus, xhc_dev->device, xhc_dev->function);
+  for (const auto& dev : *pci::devices) {
+    Log(kDebug, "%d.%d.%d: vend %04x, dev %04x, class %02x%02x%02x, head %02x\n",
+        dev.bus, dev.device, dev.function, dev.vendor_id, dev.device_id,
+        dev.class_code.base, dev.class_code.sub, dev.class_code.interface,
+        dev.header_type);
   }
 
   // set XHCI interupt handler
   SetIDTEntry(idt[InterruptVector::kXHCI], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
       reinterpret_cast<uint64_t>(IntHandlerXHCI), kernel_cs);
+  SetIDTEntry(idt[InterruptVector::kXHCIBulk], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+      reinterpret_cast<uint64_t>(IntHandlerXHCIBulk), kernel_cs);
+  SetIDTEntry(idt[InterruptVector::kLAPICTimer], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+      reinterpret_cast<uint64_t>(IntHandlerLAPICTimer), kernel_cs);
+  SetIDTEntry(idt[InterruptVector::kVirtioBlk], MakeIDTAttr(DescriptorType::kInterruptGate, 0),
+      reinterpret_cast<uint64_t>(IntHandlerVirtioBlk), kernel_cs);
 
   // setup IDT
   LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
 
-  // setup msi interrupt to xhc
-  const uint8_t bsp_local_apic_id =
-      *reinterpret_cast<const uint32_t*>(0xfee00020) >> 24;
-  pci::ConfigureMSIFixedDestination(
-      *xhc_dev, bsp_local_apic_id,
-      pci::MSITriggerMode::kLevel, pci::MSIDeliveryMode::kFixed,
-      InterruptVector::kXHCI, 0);
-
-  const WithError<uint64_t> xhc_bar = pci::ReadBar(*xhc_dev, 0);
-  Log(kDebug, "ReadBar: %s\n", xhc_bar.error.Name());
-  const uint64_t xhc_mmio_base = xhc_bar.value & ~static_cast<uint64_t>(0xf);
-  Log(kDebug, "xHC mmio_base = %08lx\n", xhc_mmio_base);
-
-  usb::xhci::Controller xhc{xhc_mmio_base};
+  usb::HIDMouseDriver::default_observer = MouseObserver;
+  InitializeKeyboard(main_queue);
 
-  if (0x8086 == pci::ReadVendorId(*xhc_dev)) {
-    SwitchEhci2Xhci(*xhc_dev);
+  // bind PCI drivers
+  pci::RegisterDriver(kXHCIDriver);
+  pci::RegisterDriver(kVirtioBlkDriver);
+  if (auto err = pci::BindDrivers()) {
+    Log(kError, "failed to bind PCI drivers: %s\n", err.Name());
   }
-  {
-    auto err = xhc.Initialize();
-    Log(kDebug, "xhc.Initialize: %s\n", err.Name());
+  if (::xhc == nullptr) {
+    Log(kWarn, "no xHC is available\n");
   }
-  Log(kInfo, "xHC starting\n");
-  xhc.Run();
 
-  ::xhc = &xhc;
+  InitializeLAPICTimer(main_queue);
   __asm__("sti");
 
-  usb::HIDMouseDriver::default_observer = MouseObserver;
-
-  for (int i = 1; i <= xhc.MaxPorts(); ++i) {
-    auto port = xhc.PortAt(i);
-    Log(kDebug, "Port %d: IsConnected=%d\n", i, port.IsConnected());
-
-    if (port.IsConnected()) {
-      if (auto err = ConfigurePort(xhc, port)) {
-        Log(kError, "failed to configure port: %s at %s:%d\n",
-            err.Name(), err.File(), err.Line());
-        continue;
-      }
-    }
-  }
-
   // initialize background(Desktop) layer and mouse layer
   screen_size.x = frame_buffer_config.horizontal_resolution;
   screen_size.y = frame_buffer_config.vertical_resolution;
@@ -334,10 +526,6 @@ extern "C" void KernelMainNewStack(
                         .SetWindow(bgwindow)
                         .Move({0, 0})
                         .ID();
-  mouse_layer_id = layer_manager->NewLayer()
-                       .SetWindow(mouse_window)
-                       .Move(mouse_position)
-                       .ID();
 
   // #@@range_begin(main_window_draggable)
   auto main_window_layer_id = layer_manager->NewLayer()
@@ -355,7 +543,7 @@ extern "C" void KernelMainNewStack(
   layer_manager->UpDown(bglayer_id, 0);
   layer_manager->UpDown(console->LayerID(), 1);
   layer_manager->UpDown(main_window_layer_id, 2);
-  layer_manager->UpDown(mouse_layer_id, 3);
+  layer_manager->SetCursor(mouse_window, mouse_position);
   layer_manager->Draw({{0, 0}, screen_size});
 
   char str[128];
@@ -363,6 +551,8 @@ extern "C" void KernelMainNewStack(
 
   // event loop
   while (true) {
+    ApplyMouseMotion();
+
     ++count;
     sprintf(str, "%010u", count);
     FillRectangle(*main_window->Writer(), {24, 28}, {8 * 10, 16}, {0xc6, 0xc6, 0xc6});
@@ -378,15 +568,36 @@ extern "C" void KernelMainNewStack(
 
     Message msg = main_queue.Front();
     main_queue.Pop();
+    if (msg.type == Message::kInterruptXHCI) {
+      // フラグを下ろしてからイベントリングを読むので，
+      // 読み出し中に届いたイベントは次のメッセージで処理される．
+      xhci_interrupt_pending[msg.arg.xhci.interrupter] = false;
+    } else if (msg.type == Message::kInterruptVirtioBlk) {
+      virtio_blk_interrupt_pending = false;
+    }
     __asm__("sti");
 
     switch (msg.type) {
       case Message::kInterruptXHCI:
-        while (xhc.PrimaryEventRing()->HasFront()) {
-          if (auto err = ProcessEvent(xhc)) {
-            Log(kError, "Error while ProcessEvent: %s at %s:%d\n",
-                err.Name(), err.File(), err.Line());
-          }
+        ProcessEvents(*xhc, msg.arg.xhci.interrupter);
+        break;
+      case Message::kInterruptVirtioBlk:
+        if (virtio_blk == nullptr) {
+          break;
+        }
+        if (auto err = virtio_blk->ProcessCompletions()) {
+          Log(kError, "virtio-blk: %s at %s:%d\n", err.Name(), err.File(), err.Line());
+        }
+        break;
+      case Message::kTimerTimeout:
+        if (!OnKeyRepeatTimeout(msg.arg.timer.value) &&
+            !usb::HubDriver::OnTimerTimeout(msg.arg.timer.value)) {
+          Log(kWarn, "Unknown timer value: %08x\n", msg.arg.timer.value);
+        }
+        break;
+      case Message::kKeyPush:
+        if (msg.arg.keyboard.press && msg.arg.keyboard.ascii != 0) {
+          printk("%c", msg.arg.keyboard.ascii);
         }
         break;
       default:
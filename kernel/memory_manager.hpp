@@ -86,4 +86,6 @@ private:
   void SetBit(FrameID frame, bool allocated);
 };
 
+extern BitmapMemoryManager* memory_manager;
+
 Error InitializeHeap(BitmapMemoryManager& memory_manager);
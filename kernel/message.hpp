@@ -0,0 +1,37 @@
+/**
+ * @file message.hpp
+ *
+ * メインループに送るメッセージの定義．
+ */
+
+#pragma once
+
+#include <cstdint>
+
+struct Message {
+  enum Type {
+    kInterruptXHCI,
+    kTimerTimeout,
+    kKeyPush,
+    kInterruptVirtioBlk,
+  } type;
+
+  union {
+    struct {
+      int interrupter;
+    } xhci;
+
+    struct {
+      unsigned long timeout;
+      int value;
+    } timer;
+
+    struct {
+      uint8_t modifier;
+      uint8_t keycode;
+      char ascii;
+      bool press;   // false なら離されたキー
+      bool repeat;  // 押し続けによる自動リピートなら true
+    } keyboard;
+  } arg;
+};
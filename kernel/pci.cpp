@@ -6,7 +6,9 @@
 
 #include "pci.hpp"
 
+#include <algorithm>
 #include "asmfunc.h"
+#include "logger.hpp"
 
 namespace {
   using namespace pci;
@@ -21,37 +23,93 @@ namespace {
            | shl(bus, 16) | shl(device, 11) | shl(function, 8) | (reg_addr & 0xfcu);
   }
 
-  /** @brief devices[num_device] に情報を書き込み num_device をインクリメントする． */
-  Error AddDevice(const Device& device) {
-    if (num_device == devices.size()) {
-      return MAKE_ERROR(Error::kFull);
+  /** @brief セグメント 0 の ECAM 領域．ecam_base が 0 なら ECAM を使わない */
+  uintptr_t ecam_base;
+  uint8_t ecam_start_bus, ecam_end_bus;
+
+  /** @brief ECAM 上のレジスタのアドレスを返す．ECAM でアクセスできなければ nullptr を返す． */
+  volatile uint32_t* ECAMAddress(uint8_t bus, uint8_t device, uint8_t function, uint16_t reg_addr) {
+    if (ecam_base == 0 || bus < ecam_start_bus || ecam_end_bus < bus) {
+      return nullptr;
     }
+    const uintptr_t offset = (static_cast<uintptr_t>(bus) << 20)
+                             | (static_cast<uintptr_t>(device & 0x1fu) << 15)
+                             | (static_cast<uintptr_t>(function & 0x7u) << 12)
+                             | (reg_addr & 0xffcu);
+    return reinterpret_cast<volatile uint32_t*>(ecam_base + offset);
+  }
 
-    devices[num_device] = device;
-    ++num_device;
-    return MAKE_ERROR(Error::kSuccess);
+  /** @brief コンフィグレーション空間の 32 ビットレジスタを読む．
+   *
+   * ECAM が使えればメモリアクセス 1 回で読む．そうでなければ IO ポートを使うが，
+   * その場合は先頭 256 バイトしか読めないので，それ以降は 0xffffffff を返す．
+   */
+  uint32_t ReadConf(uint8_t bus, uint8_t device, uint8_t function, uint16_t reg_addr) {
+    if (auto p = ECAMAddress(bus, device, function, reg_addr)) {
+      return *p;
+    }
+    if (reg_addr >= 256) {
+      return 0xffffffffu;
+    }
+    WriteAddress(MakeAddress(bus, device, function, reg_addr));
+    return ReadData();
+  }
+
+  /** @brief コンフィグレーション空間の 32 ビットレジスタに書く．IO ポートで届かないレジスタへの書き込みは捨てる． */
+  void WriteConf(uint8_t bus, uint8_t device, uint8_t function, uint16_t reg_addr, uint32_t value) {
+    if (auto p = ECAMAddress(bus, device, function, reg_addr)) {
+      *p = value;
+      return;
+    }
+    if (reg_addr >= 256) {
+      return;
+    }
+    WriteAddress(MakeAddress(bus, device, function, reg_addr));
+    WriteData(value);
+  }
+
+  /** @brief ヘッダタイプごとの BAR の数を返す */
+  int NumBars(uint8_t header_type) {
+    switch (header_type & 0x7fu) {
+    case 0x00: return 6;  // 一般のデバイス
+    case 0x01: return 2;  // PCI-PCI ブリッジ
+    default: return 0;
+    }
   }
 
   Error ScanBus(uint8_t bus);
 
-  /** @brief 指定のファンクションを devices に追加する．
+  /** @brief 指定のファンクションのヘッダを 1 度ずつ読み，devices に追加する．
 	 * もし PCI-PCI ブリッジなら，セカンダリバスに対し ScanBus を実行する
+	 *
+	 * @param id_reg  呼び出し元で読んだベンダ ID / デバイス ID レジスタの値
 	 */
-  Error ScanFunction(uint8_t bus, uint8_t device, uint8_t function) {
-    auto class_code = ReadClassCode(bus, device, function);
-    auto header_type = ReadHeaderType(bus, device, function);
-
-    Device dev{bus, device, function, header_type, class_code};
-
-    // add device
-    if (auto err = AddDevice(dev)) {
-      return err;
+  Error ScanFunction(uint8_t bus, uint8_t device, uint8_t function, uint32_t id_reg) {
+    Device dev{bus, device, function};
+    dev.vendor_id = id_reg & 0xffffu;
+    dev.device_id = id_reg >> 16;
+
+    const auto class_reg = ReadConf(bus, device, function, 0x08);
+    dev.class_code.base = (class_reg >> 24) & 0xffu;
+    dev.class_code.sub = (class_reg >> 16) & 0xffu;
+    dev.class_code.interface = (class_reg >> 8) & 0xffu;
+    dev.header_type = (ReadConf(bus, device, function, 0x0c) >> 16) & 0xffu;
+
+    dev.num_bars = NumBars(dev.header_type);
+    for (int i = 0; i < dev.num_bars; ++i) {
+      dev.bars[i] = ReadConf(bus, device, function, CalcBarAddress(i));
     }
 
-    if (class_code.Match(0x06u, 0x04u)) {
+    devices->push_back(dev);
+
+    if (dev.class_code.Match(0x06u, 0x04u)) {
       // standard PCI-PCI bridge
-      auto bus_numbers = ReadBusNumbers(bus, device, function);
+      auto bus_numbers = ReadConf(bus, device, function, 0x18);
       uint8_t secondary_bus = (bus_numbers >> 8) & 0xffu;
+      if (secondary_bus <= bus) {
+        // バス番号が割り当てられていないブリッジ．辿ると同じバスを何度も読んでしまう
+        return MAKE_ERROR(Error::kSuccess);
+      }
       return ScanBus(secondary_bus);
     }
 
@@ -60,24 +118,28 @@ namespace {
 
   /** @brief 指定のデバイス番号の各ファンクションをスキャンする．
 	 * 有効なファンクションを見つけたら ScanFunction を実行する．
+	 *
+	 * @param id_reg  ファンクション 0 のベンダ ID / デバイス ID レジスタの値
 	 */
-  Error ScanDevice(uint8_t bus, uint8_t device) {
+  Error ScanDevice(uint8_t bus, uint8_t device, uint32_t id_reg) {
     // scan function-0
-    if (auto err = ScanFunction(bus, device, 0)) {
+    const size_t function0_index = devices->size();
+    if (auto err = ScanFunction(bus, device, 0, id_reg)) {
       return err;
     }
 
-    if (IsSingleFunctionDevice(ReadHeaderType(bus, device, 0))) {
+    if (IsSingleFunctionDevice((*devices)[function0_index].header_type)) {
       return MAKE_ERROR(Error::kSuccess);
     }
 
     // scan funciton 1-8
     for (uint8_t function = 1; function < 8; ++function) {
-      if (IsInvalidVendorId(bus, device, function)) {  // no device
+      const auto id = ReadConf(bus, device, function, 0x00);
+      if ((id & 0xffffu) == 0xffffu) {  // no device
         continue;
       }
 
-      if (auto err = ScanFunction(bus, device, function)) {
+      if (auto err = ScanFunction(bus, device, function, id)) {
         return err;
       }
     }
@@ -91,12 +153,12 @@ namespace {
   Error ScanBus(uint8_t bus) {
     // read device 0-31
     for (uint8_t device = 0; device < 32; ++device) {
-      if (IsInvalidVendorId(bus, device, 0))  // no device
-      {
+      const auto id = ReadConf(bus, device, 0, 0x00);
+      if ((id & 0xffffu) == 0xffffu) {  // no device
         continue;
       }
 
-      if (auto err = ScanDevice(bus, device)) {
+      if (auto err = ScanDevice(bus, device, id)) {
         return err;
       }
     }
@@ -175,9 +237,28 @@ namespace {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  /** @brief 指定された MSI レジスタを設定する */
-  Error ConfigureMSIXRegister(const Device& dev, uint8_t cap_addr, uint32_t msg_addr, uint32_t msg_data, unsigned int num_vector_exponent) {
-    return MAKE_ERROR(Error::kNotImplemented);
+  /** @brief 指定された ID を持つケーパビリティのアドレスを返す．無ければ 0 を返す． */
+  uint8_t FindCapability(const Device& dev, uint8_t cap_id) {
+    uint8_t cap_addr = ReadConfReg(dev, 0x34) & 0xffu;
+    while (cap_addr != 0) {
+      auto header = ReadCapabilityHeader(dev, cap_addr);
+      if (header.bits.cap_id == cap_id) {
+        return cap_addr;
+      }
+      cap_addr = header.bits.next_ptr;
+    }
+    return 0;
+  }
+
+  /** @brief ConfigureMSIFixedDestination 用のメッセージアドレスとデータを生成する */
+  void MakeMSIMessage(uint8_t apic_id, MSITriggerMode trigger_mode,
+                      MSIDeliveryMode delivery_mode, uint8_t vector,
+                      uint32_t& msg_addr, uint32_t& msg_data) {
+    msg_addr = 0xfee00000u | (apic_id << 12);
+    msg_data = (static_cast<uint32_t>(delivery_mode) << 8) | vector;
+    if (trigger_mode == MSITriggerMode::kLevel) {
+      msg_data |= 0xc000;
+    }
   }
 
 }  // namespace
@@ -196,23 +277,19 @@ namespace pci {
   }
 
   uint16_t ReadVendorId(uint8_t bus, uint8_t device, uint8_t function) {
-    WriteAddress(MakeAddress(bus, device, function, 0x00));
-    return ReadData() & 0xffffu;
+    return ReadConf(bus, device, function, 0x00) & 0xffffu;
   }
 
   uint16_t ReadDeviceId(uint8_t bus, uint8_t device, uint8_t function) {
-    WriteAddress(MakeAddress(bus, device, function, 0x00));
-    return ReadData() >> 16;
+    return ReadConf(bus, device, function, 0x00) >> 16;
   }
 
   uint8_t ReadHeaderType(uint8_t bus, uint8_t device, uint8_t function) {
-    WriteAddress(MakeAddress(bus, device, function, 0x0c));
-    return (ReadData() >> 16) & 0xffu;
+    return (ReadConf(bus, device, function, 0x0c) >> 16) & 0xffu;
   }
 
   ClassCode ReadClassCode(uint8_t bus, uint8_t device, uint8_t function) {
-    WriteAddress(MakeAddress(bus, device, function, 0x08));
-    auto reg = ReadData();
+    auto reg = ReadConf(bus, device, function, 0x08);
 
     ClassCode cc;
     cc.base = (reg >> 24) & 0xffu;
@@ -223,8 +300,7 @@ namespace pci {
   }
 
   uint32_t ReadBusNumbers(uint8_t bus, uint8_t device, uint8_t function) {
-    WriteAddress(MakeAddress(bus, device, function, 0x18));
-    return ReadData();
+    return ReadConf(bus, device, function, 0x18);
   }
 
   bool IsSingleFunctionDevice(uint8_t header_type) {
@@ -235,8 +311,27 @@ namespace pci {
     return (ReadVendorId(bus, device, function) == 0xffffu);
   }
 
+  void EnableECAM(const acpi::MCFG& mcfg) {
+    for (size_t i = 0; i < mcfg.Count(); ++i) {
+      const auto& entry = mcfg[i];
+      if (entry.segment_group != 0) {
+        continue;
+      }
+      ecam_start_bus = entry.start_bus;
+      ecam_end_bus = entry.end_bus;
+      ecam_base = entry.base_address;
+      Log(kInfo, "PCI: using ECAM at %08lx for bus %u-%u\n",
+          ecam_base, ecam_start_bus, ecam_end_bus);
+      return;
+    }
+    Log(kInfo, "PCI: no ECAM region for segment 0\n");
+  }
+
   Error ScanAllBus() {
-    num_device = 0;
+    if (devices == nullptr) {
+      devices = new std::vector<Device>;
+    }
+    devices->clear();
 
     auto header_type = ReadHeaderType(0, 0, 0);  // Host Bridge
     if (IsSingleFunctionDevice(header_type)) {
@@ -258,23 +353,20 @@ namespace pci {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  uint32_t ReadConfReg(const Device& dev, uint8_t reg_addr) {
-    WriteAddress(MakeAddress(dev.bus, dev.device, dev.function, reg_addr));
-    return ReadData();
+  uint32_t ReadConfReg(const Device& dev, uint16_t reg_addr) {
+    return ReadConf(dev.bus, dev.device, dev.function, reg_addr);
   }
 
-  void WriteConfReg(const Device& dev, uint8_t reg_addr, uint32_t value) {
-    WriteAddress(MakeAddress(dev.bus, dev.device, dev.function, reg_addr));
-    WriteData(value);
+  void WriteConfReg(const Device& dev, uint16_t reg_addr, uint32_t value) {
+    WriteConf(dev.bus, dev.device, dev.function, reg_addr, value);
   }
 
-  WithError<uint64_t> ReadBar(Device& device, unsigned int bar_index) {
-    if (bar_index >= 6) {
+  WithError<uint64_t> ReadBar(const Device& device, unsigned int bar_index) {
+    if (bar_index >= device.num_bars) {
       return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
     }
 
-    const auto addr = CalcBarAddress(bar_index);
-    const auto bar = ReadConfReg(device, addr);
+    const auto bar = device.bars[bar_index];
 
     // 32 bit address
     if ((bar & 4u) == 0) {
@@ -282,16 +374,35 @@ namespace pci {
     }
 
     // 64 bit address
-    if (bar_index >= 5) {
+    if (bar_index + 1 >= device.num_bars) {
       return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
     }
 
-    const auto bar_upper = ReadConfReg(device, addr + 4);
+    const auto bar_upper = device.bars[bar_index + 1];
     return {
         bar | (static_cast<uint64_t>(bar_upper) << 32),
         MAKE_ERROR(Error::kSuccess)};
   }
 
+  Device* FindDeviceByClass(ClassCode class_code, uint16_t vendor_id) {
+    for (auto& dev : *devices) {
+      if (dev.class_code.Match(class_code.base, class_code.sub, class_code.interface) &&
+          (vendor_id == kAnyVendorId || dev.vendor_id == vendor_id)) {
+        return &dev;
+      }
+    }
+    return nullptr;
+  }
+
+  Device* FindDeviceById(uint16_t vendor_id, uint16_t device_id) {
+    for (auto& dev : *devices) {
+      if (dev.vendor_id == vendor_id && dev.device_id == device_id) {
+        return &dev;
+      }
+    }
+    return nullptr;
+  }
+
   CapabilityHeader ReadCapabilityHeader(const Device& dev, uint8_t addr) {
     CapabilityHeader header;
     header.data = pci::ReadConfReg(dev, addr);
@@ -299,24 +410,14 @@ namespace pci {
   }
 
   Error ConfigureMSI(const Device& dev, uint32_t msg_addr, uint32_t msg_data, unsigned int num_vector_exponent) {
-    // read capability addrress
-    uint8_t cap_addr = ReadConfReg(dev, 0x34) & 0xffu;
     // search MSI/MSIX capabilty addrress
-    uint8_t msi_cap_addr = 0, msix_cap_addr = 0;
-    while (cap_addr != 0) {
-      auto header = ReadCapabilityHeader(dev, cap_addr);
-      if (header.bits.cap_id == kCapabilityMSI) {
-        msi_cap_addr = cap_addr;
-      } else if (header.bits.cap_id == kCapabilityMSIX) {
-        msix_cap_addr = cap_addr;
-      }
-      cap_addr = header.bits.next_ptr;
-    }
+    const uint8_t msi_cap_addr = FindCapability(dev, kCapabilityMSI);
+    const uint8_t msix_cap_addr = FindCapability(dev, kCapabilityMSIX);
 
     if (msi_cap_addr) {
       return ConfigureMSIRegister(dev, msi_cap_addr, msg_addr, msg_data, num_vector_exponent);
     } else if (msix_cap_addr) {
-      return ConfigureMSIXRegister(dev, msix_cap_addr, msg_addr, msg_data, num_vector_exponent);
+      return ConfigureMSIX(dev, msg_addr, msg_data, num_vector_exponent);
     }
 
     return MAKE_ERROR(Error::kNoPCIMSI);
@@ -329,12 +430,114 @@ namespace pci {
       MSIDeliveryMode delivery_mode,
       uint8_t vector,
       unsigned int num_vector_exponent) {
-    uint32_t msg_addr = 0xfee00000u | (apic_id << 12);
-    uint32_t msg_data = (static_cast<uint32_t>(delivery_mode) << 8) | vector;
-    if (trigger_mode == MSITriggerMode::kLevel) {
-      msg_data |= 0xc000;
+    uint32_t msg_addr, msg_data;
+    MakeMSIMessage(apic_id, trigger_mode, delivery_mode, vector, msg_addr, msg_data);
+    return ConfigureMSI(dev, msg_addr, msg_data, num_vector_exponent);
+  }
+
+  MSIX::MSIX(const Device& dev) : dev_{dev} {
+  }
+
+  Error MSIX::Initialize() {
+    cap_addr_ = FindCapability(dev_, kCapabilityMSIX);
+    if (cap_addr_ == 0) {
+      return MAKE_ERROR(Error::kNoPCIMSI);
     }
 
-    return ConfigureMSI(dev, msg_addr, msg_data, num_vector_exponent);
+    MSIXCapability msix_cap{};
+    msix_cap.header.data = ReadConfReg(dev_, cap_addr_);
+    msix_cap.table = ReadConfReg(dev_, cap_addr_ + 4);
+    msix_cap.pba = ReadConfReg(dev_, cap_addr_ + 8);
+    table_size_ = msix_cap.header.bits.table_size + 1;
+
+    const auto table_addr = BarOffsetToAddress(msix_cap.table);
+    if (table_addr.error) {
+      return table_addr.error;
+    }
+    const auto pba_addr = BarOffsetToAddress(msix_cap.pba);
+    if (pba_addr.error) {
+      return pba_addr.error;
+    }
+    table_ = reinterpret_cast<volatile MSIXTableEntry*>(table_addr.value);
+    pba_ = reinterpret_cast<volatile uint64_t*>(pba_addr.value);
+
+    // MSI が有効なままだと MSI-X と同時に有効になってしまうので無効化する
+    if (const uint8_t msi_cap_addr = FindCapability(dev_, kCapabilityMSI)) {
+      auto header = ReadConfReg(dev_, msi_cap_addr);
+      WriteConfReg(dev_, msi_cap_addr, header & ~(1u << 16));
+    }
+
+    // 各エントリをマスクし終えるまでは Function Mask で全体を止めておく
+    msix_cap.header.bits.function_mask = 1;
+    msix_cap.header.bits.msix_enable = 1;
+    WriteConfReg(dev_, cap_addr_, msix_cap.header.data);
+
+    for (unsigned int i = 0; i < table_size_; ++i) {
+      Mask(i);
+    }
+
+    SetFunctionMask(false);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  void MSIX::SetMessage(unsigned int entry, uint64_t msg_addr, uint32_t msg_data) {
+    table_[entry].msg_addr = msg_addr & 0xffffffffu;
+    table_[entry].msg_upper_addr = msg_addr >> 32;
+    table_[entry].msg_data = msg_data;
+  }
+
+  void MSIX::SetVector(unsigned int entry, uint8_t apic_id,
+                       MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
+                       uint8_t vector) {
+    uint32_t msg_addr, msg_data;
+    MakeMSIMessage(apic_id, trigger_mode, delivery_mode, vector, msg_addr, msg_data);
+    SetMessage(entry, msg_addr, msg_data);
+  }
+
+  void MSIX::Mask(unsigned int entry) {
+    table_[entry].vector_control = table_[entry].vector_control | 1u;
+  }
+
+  void MSIX::Unmask(unsigned int entry) {
+    table_[entry].vector_control = table_[entry].vector_control & ~1u;
+  }
+
+  bool MSIX::IsPending(unsigned int entry) const {
+    return (pba_[entry / 64] >> (entry % 64)) & 1u;
+  }
+
+  void MSIX::SetFunctionMask(bool mask) {
+    CapabilityHeader header = ReadCapabilityHeader(dev_, cap_addr_);
+    if (mask) {
+      header.bits.cap |= 1u << 14;
+    } else {
+      header.bits.cap &= ~(1u << 14);
+    }
+    WriteConfReg(dev_, cap_addr_, header.data);
+  }
+
+  WithError<uintptr_t> MSIX::BarOffsetToAddress(uint32_t bir_offset) const {
+    const auto bar = ReadBar(dev_, bir_offset & 0x7u);
+    if (bar.error) {
+      return {0, bar.error};
+    }
+    return {
+        (bar.value & ~static_cast<uint64_t>(0xf)) + (bir_offset & ~0x7u),
+        MAKE_ERROR(Error::kSuccess)};
+  }
+
+  Error ConfigureMSIX(const Device& dev, uint32_t msg_addr, uint32_t msg_data, unsigned int num_vector_exponent) {
+    MSIX msix{dev};
+    if (auto err = msix.Initialize()) {
+      return err;
+    }
+
+    const unsigned int num_vectors =
+        std::min(1u << num_vector_exponent, msix.TableSize());
+    for (unsigned int i = 0; i < num_vectors; ++i) {
+      msix.SetMessage(i, msg_addr, msg_data + i);
+      msix.Unmask(i);
+    }
+    return MAKE_ERROR(Error::kSuccess);
   }
 }  // namespace pci
\ No newline at end of file
@@ -8,7 +8,9 @@
 
 #include <cstdint>
 #include <array>
+#include <vector>
 
+#include "acpi.hpp"
 #include "error.hpp"
 
 namespace pci {
@@ -22,11 +24,11 @@ namespace pci {
     uint8_t base, sub, interface;
 
     /** @brief ベースクラスが等しい場合に真を返す */
-    bool Match(uint8_t b) { return b == base; }
+    bool Match(uint8_t b) const { return b == base; }
     /** @brief ベースクラスとサブクラスが等しい場合に真を返す */
-    bool Match(uint8_t b, uint8_t s) { return Match(b) && s == sub; }
+    bool Match(uint8_t b, uint8_t s) const { return Match(b) && s == sub; }
     /** @brief ベース，サブ，インターフェースが等しい場合に真を返す */
-    bool Match(uint8_t b, uint8_t s, uint8_t i) {
+    bool Match(uint8_t b, uint8_t s, uint8_t i) const {
       return Match(b, s) && i == interface;
     }
   };
@@ -34,13 +36,21 @@ namespace pci {
   /** @brief PCI デバイスを操作するための基礎データを格納する
 	 *
 	 * バス番号，デバイス番号，ファンクション番号はデバイスを特定するのに必須．
-	 * その他の情報は単に利便性のために加えてある．
+	 * その他の情報は ScanAllBus() がヘッダから 1 度だけ読み取って記録したもので，
+	 * ドライバの選択などにコンフィグレーション空間を読み直さずに済むようにしてある．
 	 * */
   struct Device {
     uint8_t bus, device, function, header_type;
     ClassCode class_code;
+    uint16_t vendor_id, device_id;
+    /** BAR レジスタの値（num_bars 個が有効） */
+    std::array<uint32_t, 6> bars;
+    uint8_t num_bars;
   };
 
+  /** @brief FindDeviceByClass() でベンダを問わないときに指定する値 */
+  const uint16_t kAnyVendorId = 0xffffu;
+
   /** @brief CONFIG_ADDRESS に指定された整数を書き込む */
   void WriteAddress(uint32_t address);
   /** @brief CONFIG_DATA に指定された整数を書き込む */
@@ -61,11 +71,22 @@ namespace pci {
     return ReadVendorId(dev.bus, dev.device, dev.function);
   }
 
-  /** @brief 指定された PCI デバイスの 32 ビットレジスタを読み取る */
-  uint32_t ReadConfReg(const Device& dev, uint8_t reg_addr);
+  /** @brief 指定された PCI デバイスの 32 ビットレジスタを読み取る
+	 *
+	 * reg_addr が 0x100 以上の拡張コンフィグレーション空間は ECAM が有効な場合のみ読める．
+	 * 読めない場合は 0xffffffff を返す．
+	 */
+  uint32_t ReadConfReg(const Device& dev, uint16_t reg_addr);
 
   /** @brief 指定された PCI デバイスの 32 ビットレジスタに書き込む */
-  void WriteConfReg(const Device& dev, uint8_t reg_addr, uint32_t value);
+  void WriteConfReg(const Device& dev, uint16_t reg_addr, uint32_t value);
+
+  /** @brief MCFG に記載されたセグメント 0 の ECAM 領域を使うように設定する
+	 *
+	 * 以降のコンフィグレーション空間へのアクセスは，ECAM が覆うバスについては
+	 * メモリアクセスで行い，それ以外は従来通り IO ポートで行う．
+	 */
+  void EnableECAM(const acpi::MCFG& mcfg);
 
   /** @brief バス番号レジスタを読み取る（ヘッダタイプ 1 用）
 	 *
@@ -82,23 +103,36 @@ namespace pci {
   /** @brief 無効なvenderIdの場合に真を返す. */
   bool IsInvalidVendorId(uint8_t bus, uint8_t device, uint8_t function);
 
-  /** @brief ScanAllBus() により発見された PCI デバイスの一覧 */
-  inline std::array<Device, 32> devices;
-  /** @brief devices の有効な要素の数 */
-  inline int num_device;
+  /** @brief ScanAllBus() により発見された PCI デバイスの一覧．ScanAllBus() が確保する． */
+  inline std::vector<Device>* devices;
 
   /** @brief PCI デバイスをすべて探索し devices に格納する
 	 *
-	 * バス 0 から再帰的に PCI デバイスを探索し，devices の先頭から詰めて書き込む．
-	 * 発見したデバイスの数を num_devices に設定する．
+	 * バス 0 から再帰的に PCI デバイスを探索し，devices の末尾に追加していく．
+	 * 各ファンクションのヘッダは 1 回ずつしか読まない．
+	 * ヒープを使うので InitializeHeap() の後に呼ぶこと．
 	 */
   Error ScanAllBus();
 
+  /** @brief クラスコードが一致する最初のデバイスを devices から探す
+	 *
+	 * @param vendor_id  kAnyVendorId 以外を指定すると，ベンダ ID も一致するものに限る
+	 * @return 見つからなければ nullptr
+	 */
+  Device* FindDeviceByClass(ClassCode class_code, uint16_t vendor_id = kAnyVendorId);
+
+  /** @brief ベンダ ID とデバイス ID が一致する最初のデバイスを devices から探す
+	 *
+	 * @return 見つからなければ nullptr
+	 */
+  Device* FindDeviceById(uint16_t vendor_id, uint16_t device_id);
+
   constexpr uint8_t CalcBarAddress(unsigned int bar_index) {
     return 0x10 + 4 * bar_index;
   }
 
-  WithError<uint64_t> ReadBar(Device& device, unsigned int bar_index);
+  /** @brief ScanAllBus() が記録した BAR の値を返す．64 ビット BAR なら上位も合わせる． */
+  WithError<uint64_t> ReadBar(const Device& device, unsigned int bar_index);
 
   /** @brief PCI ケーパビリティレジスタの共通ヘッダ */
   union CapabilityHeader {
@@ -157,6 +191,33 @@ namespace pci {
   Error ConfigureMSI(const Device& dev, uint32_t msg_addr, uint32_t msg_data,
                      unsigned int num_vector_exponent);
 
+  /** @brief MSI-X ケーパビリティ構造の先頭 3 つのレジスタ */
+  struct MSIXCapability {
+    union {
+      uint32_t data;
+      struct {
+        uint32_t cap_id : 8;
+        uint32_t next_ptr : 8;
+        uint32_t table_size : 11;
+        uint32_t : 3;
+        uint32_t function_mask : 1;
+        uint32_t msix_enable : 1;
+      } __attribute__((packed)) bits;
+    } __attribute__((packed)) header;
+
+    /** 下位 3 ビットが BAR 番号（BIR），残りが BAR 先頭からのオフセット */
+    uint32_t table;
+    uint32_t pba;
+  } __attribute__((packed));
+
+  /** @brief MSI-X テーブルの 1 エントリ（メモリ空間上に配置される） */
+  struct MSIXTableEntry {
+    uint32_t msg_addr;
+    uint32_t msg_upper_addr;
+    uint32_t msg_data;
+    uint32_t vector_control;  // ビット 0 がマスクビット
+  } __attribute__((packed));
+
   enum class MSITriggerMode {
     kEdge = 0,
     kLevel = 1
@@ -171,6 +232,70 @@ namespace pci {
     kExtINT         = 0b111,
   };
 
+  /** @brief 1 つのデバイスの MSI-X テーブルと PBA（Pending Bit Array）を操作する
+	 *
+	 * テーブルと PBA は BAR が指すメモリ空間にあるので，Initialize() で一度だけ
+	 * 位置を求めておけば，以降のベクタごとの設定やマスクはメモリアクセスだけで済む．
+	 */
+  class MSIX {
+   public:
+    MSIX(const Device& dev);
+
+    /** @brief MSI-X ケーパビリティを探し，テーブルと PBA の位置を求める
+		 *
+		 * MSI が有効なら無効化し，MSI-X を有効にする．
+		 * このとき全エントリはマスクされた状態になる．
+		 *
+		 * @return MSI-X ケーパビリティを持たなければ Error::kNoPCIMSI
+		 */
+    Error Initialize();
+
+    /** @brief MSI-X テーブルのエントリ数 */
+    unsigned int TableSize() const { return table_size_; }
+
+    /** @brief entry 番目のエントリに書き込むメッセージを設定する．マスク状態は変えない． */
+    void SetMessage(unsigned int entry, uint64_t msg_addr, uint32_t msg_data);
+
+    /** @brief entry 番目のエントリの宛先 APIC とベクタ番号を設定する．マスク状態は変えない． */
+    void SetVector(unsigned int entry, uint8_t apic_id,
+                   MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
+                   uint8_t vector);
+
+    /** @brief entry 番目のエントリをマスクする */
+    void Mask(unsigned int entry);
+    /** @brief entry 番目のエントリのマスクを解除する */
+    void Unmask(unsigned int entry);
+    /** @brief entry 番目のエントリにマスク中に発生した割り込みが保留されていれば真を返す */
+    bool IsPending(unsigned int entry) const;
+
+    /** @brief 全エントリをまとめてマスク（true），または個別のマスク設定に戻す（false） */
+    void SetFunctionMask(bool mask);
+
+   private:
+    const Device& dev_;
+    uint16_t cap_addr_{0};
+    unsigned int table_size_{0};
+    volatile MSIXTableEntry* table_{nullptr};
+    volatile uint64_t* pba_{nullptr};
+
+    /** @brief BIR とオフセットの組（テーブル，PBA レジスタの値）からメモリアドレスを求める */
+    WithError<uintptr_t> BarOffsetToAddress(uint32_t bir_offset) const;
+  };
+
+  /** @brief MSI-X 割り込みを設定する
+	 *
+	 * MSI-X テーブルの先頭から 2^num_vector_exponent 個のエントリを設定する．
+	 * i 番目のエントリには msg_data + i を書き込むので，ベクタ番号が連続する．
+	 *
+	 * @param dev  設定対象の PCI デバイス
+	 * @param msg_addr  割り込み発生時にメッセージを書き込む先のアドレス
+	 * @param msg_data  先頭エントリで書き込むメッセージの値
+	 * @param num_vector_exponent  割り当てるベクタ数（2^n の n を指定）
+	 * @return MSI-X ケーパビリティを持たなければ Error::kNoPCIMSI
+	 */
+  Error ConfigureMSIX(const Device& dev, uint32_t msg_addr, uint32_t msg_data,
+                      unsigned int num_vector_exponent);
+
   Error ConfigureMSIFixedDestination(
       const Device& dev, uint8_t apic_id,
       MSITriggerMode trigger_mode, MSIDeliveryMode delivery_mode,
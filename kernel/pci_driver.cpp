@@ -0,0 +1,106 @@
+/**
+ * @file pci_driver.cpp
+ *
+ * PCI デバイスとドライバを結び付ける仕組み．
+ */
+
+#include "pci_driver.hpp"
+
+#include <algorithm>
+#include <array>
+#include <vector>
+#include "logger.hpp"
+
+namespace {
+  using namespace pci;
+
+  std::array<const Driver*, kMaxDrivers> drivers;
+  int num_drivers;
+
+  /** @brief probe を呼ぶ候補．driver_index，match_index の小さい順に probe する */
+  struct Candidate {
+    int driver_index;
+    size_t match_index;
+    Device* dev;
+  };
+
+  /** @brief driver のマッチテーブルで dev に合う最初のエントリの位置を返す．無ければ -1 を返す． */
+  int FindMatch(const Driver& driver, const Device& dev) {
+    for (size_t i = 0; i < driver.num_matches; ++i) {
+      if (driver.matches[i].Match(dev)) {
+        return i;
+      }
+    }
+    return -1;
+  }
+}  // namespace
+
+namespace pci {
+  bool DeviceMatch::Match(const Device& dev) const {
+    if (vendor_id != kAnyVendorId && vendor_id != dev.vendor_id) {
+      return false;
+    }
+    if (device_id != kAnyDeviceId && device_id != dev.device_id) {
+      return false;
+    }
+    if ((class_mask & 1u) && class_code.base != dev.class_code.base) {
+      return false;
+    }
+    if ((class_mask & 2u) && class_code.sub != dev.class_code.sub) {
+      return false;
+    }
+    if ((class_mask & 4u) && class_code.interface != dev.class_code.interface) {
+      return false;
+    }
+    return true;
+  }
+
+  Error RegisterDriver(const Driver& driver) {
+    if (num_drivers == kMaxDrivers) {
+      return MAKE_ERROR(Error::kFull);
+    }
+    drivers[num_drivers++] = &driver;
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error BindDrivers() {
+    // デバイス一覧を 1 度だけ走査して候補を集める
+    std::vector<Candidate> candidates;
+    for (auto& dev : *devices) {
+      for (int d = 0; d < num_drivers; ++d) {
+        if (const int m = FindMatch(*drivers[d], dev); m >= 0) {
+          candidates.push_back({d, static_cast<size_t>(m), &dev});
+          break;
+        }
+      }
+    }
+
+    std::stable_sort(candidates.begin(), candidates.end(),
+                     [](const Candidate& a, const Candidate& b) {
+      if (a.driver_index != b.driver_index) {
+        return a.driver_index < b.driver_index;
+      }
+      return a.match_index < b.match_index;
+    });
+
+    std::array<int, kMaxDrivers> num_bound{};
+    for (const auto& c : candidates) {
+      const Driver& driver = *drivers[c.driver_index];
+      if (driver.max_devices > 0 && num_bound[c.driver_index] >= driver.max_devices) {
+        continue;
+      }
+
+      const Device& dev = *c.dev;
+      Log(kInfo, "%s: probing %d.%d.%d (%04x:%04x)\n", driver.name,
+          dev.bus, dev.device, dev.function, dev.vendor_id, dev.device_id);
+      if (auto err = driver.probe(*c.dev)) {
+        Log(kError, "%s: failed to probe %d.%d.%d: %s at %s:%d\n", driver.name,
+            dev.bus, dev.device, dev.function, err.Name(), err.File(), err.Line());
+        continue;
+      }
+      ++num_bound[c.driver_index];
+    }
+
+    return MAKE_ERROR(Error::kSuccess);
+  }
+}  // namespace pci
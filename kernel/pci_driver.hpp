@@ -0,0 +1,75 @@
+/**
+ * @file pci_driver.hpp
+ *
+ * PCI デバイスとドライバを結び付ける仕組み．
+ *
+ * 各ドライバは対応するデバイスの条件を constexpr なマッチテーブルとして
+ * 持ち，RegisterDriver() で登録しておく．BindDrivers() は ScanAllBus() が
+ * 作ったデバイス一覧を 1 度だけ走査し，ドライバごとに条件の合うデバイスを
+ * 集めてから probe を呼ぶ．コンフィグレーション空間を読み直すことはない．
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "error.hpp"
+#include "pci.hpp"
+
+namespace pci {
+  /** @brief DeviceMatch でデバイス ID を問わないときに指定する値 */
+  const uint16_t kAnyDeviceId = 0xffffu;
+
+  /** @brief マッチテーブルの 1 エントリ */
+  struct DeviceMatch {
+    uint16_t vendor_id;  // kAnyVendorId なら問わない
+    uint16_t device_id;  // kAnyDeviceId なら問わない
+    ClassCode class_code;
+    /** class_code のうち比較する部分．ビット 0 がベース，1 がサブ，2 がインターフェース */
+    uint8_t class_mask;
+
+    /** @brief dev がこのエントリの条件を満たせば真を返す */
+    bool Match(const Device& dev) const;
+  };
+
+  /** @brief クラスコード（とベンダ ID）で照合するエントリを作る */
+  constexpr DeviceMatch MatchClass(uint8_t base, uint8_t sub, uint8_t interface,
+                                   uint16_t vendor_id = kAnyVendorId) {
+    return {vendor_id, kAnyDeviceId, {base, sub, interface}, 0b111};
+  }
+
+  /** @brief ベンダ ID とデバイス ID で照合するエントリを作る */
+  constexpr DeviceMatch MatchId(uint16_t vendor_id, uint16_t device_id) {
+    return {vendor_id, device_id, {0, 0, 0}, 0};
+  }
+
+  /** @brief PCI デバイスのドライバ */
+  struct Driver {
+    const char* name;
+    /** 対応するデバイスの条件．先にあるエントリに合うデバイスほど優先して probe する */
+    const DeviceMatch* matches;
+    size_t num_matches;
+    /** probe に成功するデバイス数の上限．0 なら制限しない */
+    int max_devices;
+    /** @brief デバイスを初期化する．
+     *
+     * 時間の掛かる処理は割り込みで進めるようにし，ここではすぐに戻ること．
+     * 失敗した場合は条件に合う次のデバイスが試される．
+     */
+    Error (*probe)(Device& dev);
+  };
+
+  /** @brief 登録できるドライバの最大数 */
+  const int kMaxDrivers = 16;
+
+  /** @brief ドライバを登録する．driver はプログラムの終わりまで有効であること． */
+  Error RegisterDriver(const Driver& driver);
+
+  /** @brief devices の各デバイスに，登録されたドライバを結び付ける
+   *
+   * 1 つのデバイスには，登録順で最初に条件が合ったドライバだけを結び付ける．
+   * ScanAllBus() の後に呼ぶこと．
+   */
+  Error BindDrivers();
+}
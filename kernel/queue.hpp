@@ -8,9 +8,11 @@
 template <typename T>
 class ArrayQueue {
 public:
+  // constexpr にしておくと，グローバル変数として定義しても
+  // （グローバルコンストラクタを呼ばずに）静的に初期化される
   template <size_t N>
-  ArrayQueue(std::array<T, N>& buf);
-  ArrayQueue(T* buf, size_t size);
+  constexpr ArrayQueue(std::array<T, N>& buf);
+  constexpr ArrayQueue(T* buf, size_t size);
   Error Push(const T& value);
   Error Pop();
   size_t Count() const;
@@ -31,10 +33,10 @@ private:
 
 template <typename T>
 template <size_t N>
-ArrayQueue<T>::ArrayQueue(std::array<T, N>& buf) : ArrayQueue(buf.data(), N) {}
+constexpr ArrayQueue<T>::ArrayQueue(std::array<T, N>& buf) : ArrayQueue(buf.data(), N) {}
 
 template <typename T>
-ArrayQueue<T>::ArrayQueue(T* buf, size_t size)
+constexpr ArrayQueue<T>::ArrayQueue(T* buf, size_t size)
     : data_{buf}, read_pos_{0}, write_pos_{0}, count_{0}, capacity_{size}
  {}
 
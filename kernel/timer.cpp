@@ -1,26 +1,100 @@
 #include "timer.hpp"
 
+#include "acpi.hpp"
+#include "interrupt.hpp"
+#include "logger.hpp"
+
 namespace {
   const uint32_t kCountMax = 0xffffffffu;
+  // ACPI PM タイマが無いときに仮定する LAPIC タイマの周波数（QEMU の値）
+  const unsigned long kDefaultLAPICTimerFreq = 1000000000ul;
   volatile uint32_t& lvt_timer = *reinterpret_cast<uint32_t*>(0xfee00320);
   volatile uint32_t& initial_count = *reinterpret_cast<uint32_t*>(0xfee00380);
   volatile uint32_t& current_count = *reinterpret_cast<uint32_t*>(0xfee00390);
   volatile uint32_t& divide_config = *reinterpret_cast<uint32_t*>(0xfee003e0);
+
+  void StartLAPICTimer() {
+    initial_count = kCountMax;
+  }
+
+  uint32_t LAPICTimerElapsed() {
+    return kCountMax - current_count;
+  }
+
+  void StopLAPICTimer() {
+    initial_count = 0;
+  }
+
+  /** @brief ACPI PM タイマで 100 ミリ秒を測り，LAPIC タイマの周波数を求める */
+  unsigned long MeasureLAPICTimerFreq() {
+    if (acpi::fadt == nullptr) {
+      Log(kWarn, "no ACPI PM timer. assuming LAPIC timer runs at %lu Hz\n",
+          kDefaultLAPICTimerFreq);
+      return kDefaultLAPICTimerFreq;
+    }
+
+    lvt_timer = (0b001 << 16) | InterruptVector::kLAPICTimer;  // masked, one-shot
+    StartLAPICTimer();
+    acpi::WaitMilliseconds(100);
+    const auto elapsed = LAPICTimerElapsed();
+    StopLAPICTimer();
+    return static_cast<unsigned long>(elapsed) * 10;
+  }
 }  // namespace
 
-void InitializeLAPICTimer() {
-  divide_config = 0b1011;          // divide 1:1
-  lvt_timer = (0b001 << 16) | 32;  // masked, one-shot
+unsigned long lapic_timer_freq;
+
+void InitializeLAPICTimer(ArrayQueue<Message>& msg_queue) {
+  timer_manager = new TimerManager{msg_queue};
+
+  divide_config = 0b1011;  // divide 1:1
+  lapic_timer_freq = MeasureLAPICTimerFreq();
+  Log(kDebug, "LAPIC timer: %lu Hz\n", lapic_timer_freq);
+
+  lvt_timer = (0b010 << 16) | InterruptVector::kLAPICTimer;  // not-masked, periodic
+  initial_count = lapic_timer_freq / kTimerFreq;
+}
+
+Timer::Timer(unsigned long timeout, int value)
+    : timeout_{timeout}, value_{value} {
+}
+
+TimerManager::TimerManager(ArrayQueue<Message>& msg_queue)
+    : msg_queue_{msg_queue} {
+  // 番兵：決してタイムアウトしないので，Tick で空かどうかを調べずに済む
+  timers_.push(Timer{~0ul, -1});
 }
 
-void StartLAPICTimer() {
-  initial_count = kCountMax;
+void TimerManager::AddTimer(const Timer& timer) {
+  // Tick が割り込みから timers_ を書き換えるので，その間は割り込みを止める．
+  // 呼び出し元が既に割り込みを止めていれば，止めたままにしておく
+  const bool interrupts_enabled = DisableInterrupts();
+  timers_.push(timer);
+  RestoreInterrupts(interrupts_enabled);
 }
 
-uint32_t LAPICTimerElapsed() {
-  return kCountMax - current_count;
+void TimerManager::Tick() {
+  ++tick_;
+  while (true) {
+    const auto& t = timers_.top();
+    if (t.Timeout() > tick_) {
+      break;
+    }
+
+    Message m{Message::kTimerTimeout};
+    m.arg.timer.timeout = t.Timeout();
+    m.arg.timer.value = t.Value();
+    if (msg_queue_.Push(m)) {
+      // キューが満杯なら捨てずに残しておき，次の tick で送り直す
+      break;
+    }
+
+    timers_.pop();
+  }
 }
 
-void StopLAPICTimer() {
-  initial_count = 0;
+TimerManager* timer_manager;
+
+void LAPICTimerOnInterrupt() {
+  timer_manager->Tick();
 }
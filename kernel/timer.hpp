@@ -1,8 +1,61 @@
 #pragma once
 
 #include <cstdint>
+#include <queue>
+#include <vector>
 
-void InitializeLAPICTimer();
-void StartLAPICTimer();
-uint32_t LAPICTimerElapsed();
-void StopLAPICTimer();
+#include "message.hpp"
+#include "queue.hpp"
+
+/** @brief 1 秒あたりの tick 数 */
+const int kTimerFreq = 100;
+
+/** @brief LAPIC タイマを周期モードで起動し，割り込みごとに TimerManager::Tick を呼ばせる．
+ *
+ * LAPIC タイマの周波数は機種ごとに異なるので，起動前に ACPI PM タイマで測り，
+ * 周期が 1 / kTimerFreq 秒になるようにする．acpi::Initialize の後に呼ぶこと．
+ */
+void InitializeLAPICTimer(ArrayQueue<Message>& msg_queue);
+
+/** @brief InitializeLAPICTimer が測った LAPIC タイマの周波数（Hz） */
+extern unsigned long lapic_timer_freq;
+
+/** @brief 指定した tick に達したら kTimerTimeout メッセージを送るタイマ */
+class Timer {
+ public:
+  Timer(unsigned long timeout, int value);
+  unsigned long Timeout() const { return timeout_; }
+  int Value() const { return value_; }
+
+ private:
+  unsigned long timeout_;
+  int value_;
+};
+
+/** @brief タイムアウトが早いほど優先度が高い */
+inline bool operator<(const Timer& lhs, const Timer& rhs) {
+  return lhs.Timeout() > rhs.Timeout();
+}
+
+class TimerManager {
+ public:
+  TimerManager(ArrayQueue<Message>& msg_queue);
+
+  /** @brief タイマを登録する．割り込みを許可した状態（割り込みハンドラの外）から呼ぶこと． */
+  void AddTimer(const Timer& timer);
+  /** @brief tick を 1 進め，タイムアウトしたタイマのメッセージを送る．LAPIC タイマ割り込みから呼ばれる．
+   *
+   * メッセージキューが満杯で送れなかったタイマは登録したまま残し，次の tick で再び送る．
+   */
+  void Tick();
+  unsigned long CurrentTick() const { return tick_; }
+
+ private:
+  volatile unsigned long tick_{0};
+  std::priority_queue<Timer> timers_{};
+  ArrayQueue<Message>& msg_queue_;
+};
+
+extern TimerManager* timer_manager;
+
+void LAPICTimerOnInterrupt();
@@ -6,4 +6,12 @@ namespace usb {
 
   ClassDriver::~ClassDriver() {
   }
+
+  Error ClassDriver::OnControlFailed(EndpointID ep_id, SetupData setup_data, Error err) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error ClassDriver::OnBulkCompleted(EndpointID ep_id, Error err, const void* buf, int len) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
 }  // namespace usb
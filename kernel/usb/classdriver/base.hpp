@@ -24,6 +24,16 @@ namespace usb {
     virtual Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
                                      const void* buf, int len) = 0;
     virtual Error OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) = 0;
+    /** このクラスドライバが発行したコントロール転送が失敗したときに呼ばれる．
+     * setup_data は転送要求に渡した値．コントロールエンドポイントはリセット済み．
+     */
+    virtual Error OnControlFailed(EndpointID ep_id, SetupData setup_data, Error err);
+    /** バルク転送の完了時に呼ばれる．buf は転送要求に渡したバッファの先頭，
+     * len は実際に転送されたバイト数．
+     * 転送が失敗したら err が Error::kTransferFailed になる．このとき
+     * ホスト側のエンドポイントはリセット済みで，後続の転送要求も破棄されている．
+     */
+    virtual Error OnBulkCompleted(EndpointID ep_id, Error err, const void* buf, int len);
 
     /** このクラスドライバを保持する USB デバイスを返す． */
     Device* ParentDevice() const { return dev_; }
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include "logger.hpp"
 #include "usb/device.hpp"
+#include "usb/memory.hpp"
 
 namespace usb {
   HIDBaseDriver::HIDBaseDriver(Device* dev, int interface_index, int in_packet_size)
@@ -16,6 +17,7 @@ namespace usb {
   Error HIDBaseDriver::SetEndpoint(const EndpointConfig& config) {
     if (config.ep_type == EndpointType::kInterrupt && config.ep_id.IsIn()) {
       ep_interrupt_in_ = config.ep_id;
+      max_packet_size_ = config.max_packet_size;
     } else if (config.ep_type == EndpointType::kInterrupt && !config.ep_id.IsIn()) {
       ep_interrupt_out_ = config.ep_id;
     }
@@ -23,16 +25,30 @@ namespace usb {
   }
 
   Error HIDBaseDriver::OnEndpointsConfigured() {
+    // まずレポートディスクリプタを読み，扱えるならレポートプロトコルを使う
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kIn;
+    setup_data.request_type.bits.type = request_type::kStandard;
+    setup_data.request_type.bits.recipient = request_type::kInterface;
+    setup_data.request = request::kGetDescriptor;
+    setup_data.value = static_cast<uint16_t>(descriptor_type::kReport) << 8;
+    setup_data.index = interface_index_;
+    setup_data.length = report_desc_buf_.size();
+
+    initialize_phase_ = 1;
+    return ParentDevice()->ControlIn(kDefaultControlPipeID, setup_data,
+                                     report_desc_buf_.data(), report_desc_buf_.size(), this);
+  }
+
+  Error HIDBaseDriver::SetProtocol(bool report_protocol) {
     SetupData setup_data{};
     setup_data.request_type.bits.direction = request_type::kOut;
     setup_data.request_type.bits.type = request_type::kClass;
     setup_data.request_type.bits.recipient = request_type::kInterface;
     setup_data.request = request::kSetProtocol;
-    setup_data.value = 0;  // boot protocol
+    setup_data.value = report_protocol ? 1 : 0;  // 0: boot protocol, 1: report protocol
     setup_data.index = interface_index_;
     setup_data.length = 0;
-
-    initialize_phase_ = 1;
     return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
   }
 
@@ -41,7 +57,45 @@ namespace usb {
         this, initialize_phase_, len);
     if (initialize_phase_ == 1) {
       initialize_phase_ = 2;
-      return ParentDevice()->InterruptIn(ep_interrupt_in_, buf_.data(), in_packet_size_);
+
+      HIDReportLayout layout;
+      report_protocol_ = ParseReportDescriptor(report_desc_buf_.data(), len, layout) &&
+                         AcceptReportLayout(layout);
+      if (report_protocol_) {
+        layout_ = layout;
+        Log(kInfo, "HIDBaseDriver: report protocol, id %d, %d bytes\n",
+            layout_.report_id, layout_.report_size);
+      } else {
+        Log(kInfo, "HIDBaseDriver: boot protocol\n");
+      }
+      return SetProtocol(report_protocol_);
+    } else if (initialize_phase_ == 2) {
+      initialize_phase_ = 3;
+
+      if (report_protocol_ && max_packet_size_ > 0) {
+        in_packet_size_ = max_packet_size_;
+      }
+      // レポートが短くても，TD は最大パケット長を受け取れる大きさにする
+      in_packet_size_ = std::max(in_packet_size_, max_packet_size_);
+      for (auto& in_buf : in_bufs_) {
+        if (in_buf == nullptr) {
+          in_buf = AllocArray<uint8_t>(in_packet_size_, 64, 64 * 1024);
+        }
+        if (in_buf == nullptr) {
+          return MAKE_ERROR(Error::kNoEnoughMemory);
+        }
+      }
+
+      Error err = MAKE_ERROR(Error::kSuccess);
+      ParentDevice()->BeginBatch();
+      for (auto in_buf : in_bufs_) {
+        err = ParentDevice()->InterruptIn(ep_interrupt_in_, in_buf, in_packet_size_);
+        if (err) {
+          break;
+        }
+      }
+      ParentDevice()->EndBatch();
+      return err;
     }
 
     return MAKE_ERROR(Error::kNotImplemented);
@@ -49,9 +103,23 @@ namespace usb {
 
   Error HIDBaseDriver::OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) {
     if (ep_id.IsIn()) {
+      // レポートを取り出したら，処理する前に受信バッファを登録し直す
+      const auto report = reinterpret_cast<const uint8_t*>(buf);
+      const bool skip = report_protocol_ && layout_.report_id != 0 &&
+                        (len == 0 || report[0] != layout_.report_id);
+      len = std::min<int>(len, kBufferSize);
+      if (!skip) {
+        std::fill(std::copy_n(report, len, buf_.begin()), buf_.end(), 0);
+      }
+      auto err = ParentDevice()->InterruptIn(
+          ep_interrupt_in_, const_cast<void*>(buf), in_packet_size_);
+      if (skip) {
+        return err;  // 表を作っていない Report ID のレポート
+      }
+
       OnDataReceived();
       std::copy_n(buf_.begin(), len, previous_buf_.begin());
-      return ParentDevice()->InterruptIn(ep_interrupt_in_, buf_.data(), in_packet_size_);
+      return err;
     }
 
     return MAKE_ERROR(Error::kNotImplemented);
@@ -7,6 +7,7 @@
 #pragma once
 
 #include "usb/classdriver/base.hpp"
+#include "usb/classdriver/hidparser.hpp"
 
 namespace usb {
   class HIDBaseDriver : public ClassDriver {
@@ -20,17 +21,55 @@ namespace usb {
     Error OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) override;
 
     virtual Error OnDataReceived() = 0;
-    const static size_t kBufferSize = 1024;
+    /** @brief 解析したレポートディスクリプタをこのドライバで扱えるか判定する．
+     *
+     * true を返すとレポートプロトコルに切り替え，以後のレポートは layout に
+     * 従って読む．false ならブートプロトコルのまま使う．
+     */
+    virtual bool AcceptReportLayout(const HIDReportLayout& layout) { return false; }
+
+    /** @brief Buffer() に取っておくレポートの大きさ．これより長いレポートは先頭だけを見る． */
+    const static size_t kBufferSize = 64;
+    /** @brief 割り込み IN エンドポイントに常に登録しておく受信バッファの数 */
+    const static int kNumInFlightBuffers = 4;
+    /** @brief 直近に受信したレポート */
     const std::array<uint8_t, kBufferSize>& Buffer() const { return buf_; }
+    /** @brief Buffer() の 1 つ前に受信したレポート */
     const std::array<uint8_t, kBufferSize>& PreviousBuffer() const { return previous_buf_; }
 
+    /** @brief 読み込むレポートディスクリプタの最大長 */
+    const static size_t kReportDescriptorSize = 512;
+    /** @brief レポートプロトコルで動作しているなら true */
+    bool UsesReportProtocol() const { return report_protocol_; }
+    /** @brief レポートプロトコルで動作しているときのフィールドの表 */
+    const HIDReportLayout& ReportLayout() const { return layout_; }
+    /** @brief buf のレポートのうち，Report ID を除いたデータの先頭 */
+    const uint8_t* ReportData(const std::array<uint8_t, kBufferSize>& buf) const {
+      return buf.data() + (report_protocol_ && layout_.report_id != 0 ? 1 : 0);
+    }
+
    private:
     EndpointID ep_interrupt_in_;
     EndpointID ep_interrupt_out_;
     const int interface_index_;
     int in_packet_size_;
+    int max_packet_size_{0};
     int initialize_phase_{0};
 
+    bool report_protocol_{false};
+    HIDReportLayout layout_{};
+    std::array<uint8_t, kReportDescriptorSize> report_desc_buf_{};
+
+    Error SetProtocol(bool report_protocol);
+
     std::array<uint8_t, kBufferSize> buf_{}, previous_buf_{};
+
+    /** 転送リングに登録する受信バッファ．xHC は登録順に完了させるので，
+     * 完了したバッファはすぐに末尾へ登録し直し，常に kNumInFlightBuffers 個の
+     * 転送を待ち受けておく．
+     * 最大パケット長より短い TD を積むとバブルになるので，各バッファは
+     * in_packet_size_（最大パケット長以上）バイトを DMA 用のメモリから確保する．
+     */
+    std::array<uint8_t*, kNumInFlightBuffers> in_bufs_{};
   };
 }
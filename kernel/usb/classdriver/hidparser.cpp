@@ -0,0 +1,269 @@
+#include "usb/classdriver/hidparser.hpp"
+
+#include <algorithm>
+#include <array>
+
+namespace {
+  namespace item_type {
+    const int kMain = 0;
+    const int kGlobal = 1;
+    const int kLocal = 2;
+  }
+
+  namespace main_tag {
+    const int kInput = 8;
+  }
+
+  namespace global_tag {
+    const int kUsagePage = 0;
+    const int kLogicalMinimum = 1;
+    const int kReportSize = 7;
+    const int kReportID = 8;
+    const int kReportCount = 9;
+    const int kPush = 10;
+    const int kPop = 11;
+  }
+
+  namespace local_tag {
+    const int kUsage = 0;
+    const int kUsageMinimum = 1;
+    const int kUsageMaximum = 2;
+  }
+
+  namespace usage {
+    const uint32_t kX = 0x00010030;
+    const uint32_t kY = 0x00010031;
+    const uint32_t kWheel = 0x00010038;
+    const uint32_t kButton1 = 0x00090001;
+    const uint32_t kLeftControl = 0x000700e0;
+    const uint16_t kKeyboardPage = 0x0007;
+  }
+
+  struct GlobalState {
+    uint16_t usage_page;
+    int32_t logical_minimum;
+    uint32_t report_size;
+    uint32_t report_count;
+    uint8_t report_id;
+  };
+
+  struct LocalState {
+    std::array<uint32_t, 16> usages;
+    int num_usages;
+    uint32_t usage_minimum, usage_maximum;
+    bool has_range;
+
+    /** i 番目のフィールドの Usage（上位 16 ビットが Usage Page） */
+    uint32_t UsageAt(int i) const {
+      if (num_usages > 0) {
+        return usages[std::min(i, num_usages - 1)];
+      } else if (has_range) {
+        return std::min(usage_minimum + i, usage_maximum);
+      }
+      return 0;
+    }
+  };
+
+  /** @brief Input アイテム 1 つ分のフィールドの並び */
+  struct InputItem {
+    uint8_t report_id;
+    uint16_t bit_offset;  // 最初のフィールドのビット位置
+    uint32_t report_size, report_count;
+    bool is_constant, is_variable, is_signed;
+    const LocalState* locals;
+
+    uint32_t UsageAt(int i) const { return locals->UsageAt(i); }
+  };
+
+  uint32_t ReadData(const uint8_t* p, int size) {
+    uint32_t value = 0;
+    for (int i = 0; i < size; ++i) {
+      value |= static_cast<uint32_t>(p[i]) << (8 * i);
+    }
+    return value;
+  }
+
+  int32_t ReadSignedData(const uint8_t* p, int size) {
+    const uint32_t value = ReadData(p, size);
+    if (size == 0 || size == 4 || ((value >> (8 * size - 1)) & 1) == 0) {
+      return static_cast<int32_t>(value);
+    }
+    return static_cast<int32_t>(value | (~0u << (8 * size)));
+  }
+
+  /** @brief Usage の値に Usage Page を補う．4 バイトの Usage は Usage Page を含む． */
+  uint32_t ExtendUsage(uint32_t value, int size, uint16_t usage_page) {
+    return size == 4 ? value : (static_cast<uint32_t>(usage_page) << 16) | value;
+  }
+
+  /** @brief レポートディスクリプタを先頭から読み，Input アイテムごとに visit を呼ぶ．
+   *
+   * Report ID ごとのビット位置は Input アイテムを読むたびに進める．
+   *
+   * @return 全体を読み終えれば true．途中で壊れた記述に当たれば false．
+   */
+  template <class Visitor>
+  bool WalkInputItems(const uint8_t* desc, int len, Visitor visit) {
+    std::array<uint16_t, 256> offsets{};  // index: report ID
+    std::array<GlobalState, 4> global_stack{};
+    int stack_depth = 0;
+    GlobalState global{};
+    LocalState local{};
+
+    const uint8_t* p = desc;
+    const uint8_t* const end = desc + len;
+    while (p < end) {
+      const uint8_t prefix = *p++;
+      if (prefix == 0xfe) {  // long item
+        if (p + 2 > end) {
+          return false;
+        }
+        p += 2 + p[0];
+        continue;
+      }
+
+      const int size = (prefix & 3) == 3 ? 4 : (prefix & 3);
+      const int type = (prefix >> 2) & 3;
+      const int tag = prefix >> 4;
+      if (p + size > end) {
+        return false;
+      }
+      const uint32_t data = ReadData(p, size);
+
+      if (type == item_type::kMain) {
+        if (tag == main_tag::kInput) {
+          auto& offset = offsets[global.report_id];
+          InputItem item{
+            global.report_id, offset, global.report_size, global.report_count,
+            (data & 1) != 0, (data & 2) != 0, global.logical_minimum < 0, &local,
+          };
+          visit(item);
+          offset += global.report_size * global.report_count;
+        }
+        local = LocalState{};
+      } else if (type == item_type::kGlobal) {
+        switch (tag) {
+        case global_tag::kUsagePage: global.usage_page = data; break;
+        case global_tag::kLogicalMinimum: global.logical_minimum = ReadSignedData(p, size); break;
+        case global_tag::kReportSize: global.report_size = data; break;
+        case global_tag::kReportID: global.report_id = data; break;
+        case global_tag::kReportCount: global.report_count = data; break;
+        case global_tag::kPush:
+          if (stack_depth < static_cast<int>(global_stack.size())) {
+            global_stack[stack_depth++] = global;
+          }
+          break;
+        case global_tag::kPop:
+          if (stack_depth > 0) {
+            global = global_stack[--stack_depth];
+          }
+          break;
+        }
+      } else if (type == item_type::kLocal) {
+        switch (tag) {
+        case local_tag::kUsage:
+          if (local.num_usages < static_cast<int>(local.usages.size())) {
+            local.usages[local.num_usages++] = ExtendUsage(data, size, global.usage_page);
+          }
+          break;
+        case local_tag::kUsageMinimum:
+          local.usage_minimum = ExtendUsage(data, size, global.usage_page);
+          local.has_range = true;
+          break;
+        case local_tag::kUsageMaximum:
+          local.usage_maximum = ExtendUsage(data, size, global.usage_page);
+          local.has_range = true;
+          break;
+        }
+      }
+      p += size;
+    }
+    return true;
+  }
+}  // namespace
+
+namespace usb {
+  bool ParseReportDescriptor(const uint8_t* desc, int len, HIDReportLayout& layout) {
+    layout = HIDReportLayout{};
+
+    auto is_target = [](const InputItem& item) {
+      if (item.is_constant) {
+        return false;
+      }
+      if (!item.is_variable) {
+        return (item.UsageAt(0) >> 16) == usage::kKeyboardPage;
+      }
+      for (uint32_t i = 0; i < item.report_count; ++i) {
+        if (item.UsageAt(i) == usage::kX) {
+          return true;
+        }
+      }
+      return false;
+    };
+
+    // 1 回目：値を取り出すレポートを決める
+    int target_id = -1;
+    const bool parsed = WalkInputItems(desc, len, [&](const InputItem& item) {
+      if (target_id < 0 && is_target(item)) {
+        target_id = item.report_id;
+      }
+    });
+    if (!parsed || target_id < 0) {
+      return false;
+    }
+
+    // 2 回目：そのレポートのフィールドの位置を表にする
+    layout.report_id = target_id;
+    uint32_t report_bits = 0;
+    WalkInputItems(desc, len, [&](const InputItem& item) {
+      if (item.report_id != target_id) {
+        return;
+      }
+      report_bits = item.bit_offset + item.report_size * item.report_count;
+      if (item.is_constant || item.report_size == 0 || item.report_size > 32) {
+        return;
+      }
+
+      auto field_at = [&](uint32_t i, uint32_t count) {
+        return HIDField{
+          static_cast<uint16_t>(item.bit_offset + item.report_size * i),
+          static_cast<uint8_t>(item.report_size * count),
+          item.is_signed,
+        };
+      };
+
+      if (!item.is_variable) {
+        if ((item.UsageAt(0) >> 16) == usage::kKeyboardPage &&
+            !layout.keys.Exists()) {
+          layout.keys = field_at(0, 1);
+          layout.keys.is_signed = false;
+          layout.num_keys = std::min<uint32_t>(item.report_count, 255);
+        }
+        return;
+      }
+
+      for (uint32_t i = 0; i < item.report_count; ++i) {
+        const uint32_t u = item.UsageAt(i);
+        const uint32_t rest = item.report_count - i;
+        if (u == usage::kX && !layout.x.Exists()) {
+          layout.x = field_at(i, 1);
+        } else if (u == usage::kY && !layout.y.Exists()) {
+          layout.y = field_at(i, 1);
+        } else if (u == usage::kWheel && !layout.wheel.Exists()) {
+          layout.wheel = field_at(i, 1);
+        } else if (u == usage::kButton1 && item.report_size == 1 &&
+                   !layout.buttons.Exists()) {
+          layout.buttons = field_at(i, std::min<uint32_t>(rest, 8));
+          layout.buttons.is_signed = false;
+        } else if (u == usage::kLeftControl && item.report_size == 1 &&
+                   !layout.modifiers.Exists()) {
+          layout.modifiers = field_at(i, std::min<uint32_t>(rest, 8));
+          layout.modifiers.is_signed = false;
+        }
+      }
+    });
+    layout.report_size = (report_bits + 7) / 8;
+
+    return layout.IsMouse() || layout.IsKeyboard();
+  }
+}  // namespace usb
@@ -0,0 +1,80 @@
+/**
+ * @file usb/classdriver/hidparser.hpp
+ *
+ * HID report descriptor parser.
+ *
+ * レポートディスクリプタを 1 度だけ解析し，マウスやキーボードの
+ * レポートから値を取り出すためのビット位置の表を作る．
+ * 受信したレポートは表を引いてシフトとマスクで読むだけで済む．
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace usb {
+  /** @brief レポート中の 1 つのフィールドの位置 */
+  struct HIDField {
+    /** レポート先頭（Report ID を除く）からのビット位置 */
+    uint16_t bit_offset;
+    /** ビット幅（1 - 32）．0 ならフィールドが存在しない */
+    uint8_t bit_size;
+    /** Logical Minimum が負なら符号付きとして読む */
+    bool is_signed;
+
+    bool Exists() const { return bit_size != 0; }
+  };
+
+  /** @brief 1 つのレポートから値を取り出すための表 */
+  struct HIDReportLayout {
+    /** 値を取り出すレポートの Report ID．0 なら Report ID を持たない */
+    uint8_t report_id;
+    /** Report ID を除いたレポートの長さ（バイト） */
+    uint16_t report_size;
+
+    // マウス（Generic Desktop と Button ページ）
+    HIDField buttons;  // ボタン 1 から順に 1 ビットずつ並んだビット列の先頭
+    HIDField x, y, wheel;
+
+    // キーボード（Keyboard/Keypad ページ）
+    HIDField modifiers;  // 0xe0 - 0xe7 の修飾キーのビット列
+    HIDField keys;       // キーコード配列の最初の要素
+    uint8_t num_keys;
+
+    bool IsMouse() const { return x.Exists() && y.Exists(); }
+    bool IsKeyboard() const { return keys.Exists() && keys.bit_size == 8; }
+  };
+
+  /** @brief レポートディスクリプタを解析して layout を作る．
+   *
+   * 最初に見つかった X 軸またはキーコード配列を含む入力レポートを
+   * 対象とし，それ以外の Report ID のフィールドは無視する．
+   *
+   * @return マウスかキーボードとして使えるフィールドが見つかれば true
+   */
+  bool ParseReportDescriptor(const uint8_t* desc, int len, HIDReportLayout& layout);
+
+  /** @brief レポートからフィールドの値を取り出す．
+   *
+   * report は Report ID を除いたレポートの先頭，len はその長さ．
+   * レポートの範囲外のビットは 0 として読む．
+   */
+  inline int32_t ExtractField(const uint8_t* report, int len, HIDField field) {
+    if (!field.Exists()) {
+      return 0;
+    }
+    const int first = field.bit_offset / 8;
+    uint64_t bits = 0;
+    for (int i = 0; i < 5 && first + i < len; ++i) {
+      bits |= static_cast<uint64_t>(report[first + i]) << (8 * i);
+    }
+    bits >>= field.bit_offset % 8;
+    const uint32_t mask = field.bit_size >= 32 ? ~0u : (1u << field.bit_size) - 1;
+    uint32_t value = bits & mask;
+    if (field.is_signed && field.bit_size < 32 && (value >> (field.bit_size - 1)) & 1) {
+      value |= ~mask;
+    }
+    return static_cast<int32_t>(value);
+  }
+}
@@ -0,0 +1,306 @@
+#include "usb/classdriver/hub.hpp"
+
+#include <algorithm>
+#include "logger.hpp"
+#include "timer.hpp"
+#include "usb/device.hpp"
+#include "usb/memory.hpp"
+
+namespace {
+  const uint8_t kHubDescriptorType = 0x29;
+
+  namespace feature {
+    const int kPortReset = 4;
+    const int kPortPower = 8;
+    const int kCPortConnection = 16;
+    const int kCPortEnable = 17;
+    const int kCPortSuspend = 18;
+    const int kCPortOverCurrent = 19;
+    const int kCPortReset = 20;
+  }
+
+  namespace port_status {
+    const uint16_t kConnection = 0x0001;
+    const uint16_t kEnable = 0x0002;
+    const uint16_t kLowSpeed = 0x0200;
+    const uint16_t kHighSpeed = 0x0400;
+  }
+
+  // wPortChange の各ビットと，それをクリアする機能セレクタの対応
+  const std::array<std::pair<uint16_t, int>, 5> kPortChangeFeatures{{
+      {0x0001, feature::kCPortConnection},
+      {0x0002, feature::kCPortEnable},
+      {0x0004, feature::kCPortSuspend},
+      {0x0008, feature::kCPortOverCurrent},
+      {0x0010, feature::kCPortReset},
+  }};
+}  // namespace
+
+namespace usb {
+  std::array<HubDriver*, HubDriver::kMaxHubs> HubDriver::hubs_{};
+
+  HubDriver::HubDriver(Device* dev, int interface_index, bool multi_tt)
+      : ClassDriver{dev}, interface_index_{interface_index}, multi_tt_{multi_tt} {
+    for (int i = 0; i < kMaxHubs; ++i) {
+      if (hubs_[i] == nullptr) {
+        hubs_[i] = this;
+        hub_index_ = i;
+        break;
+      }
+    }
+  }
+
+  HubDriver::~HubDriver() {
+    if (hub_index_ >= 0) {
+      hubs_[hub_index_] = nullptr;
+    }
+  }
+
+  void* HubDriver::operator new(size_t size) {
+    return AllocMem(sizeof(HubDriver), 0, 0);
+  }
+
+  void HubDriver::operator delete(void* ptr) noexcept {
+    FreeMem(ptr);
+  }
+
+  Error HubDriver::Initialize() {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error HubDriver::SetEndpoint(const EndpointConfig& config) {
+    if (config.ep_type == EndpointType::kInterrupt && config.ep_id.IsIn()) {
+      ep_interrupt_in_ = config.ep_id;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error HubDriver::OnEndpointsConfigured() {
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kIn;
+    setup_data.request_type.bits.type = request_type::kClass;
+    setup_data.request_type.bits.recipient = request_type::kDevice;
+    setup_data.request = request::kGetDescriptor;
+    setup_data.value = static_cast<uint16_t>(kHubDescriptorType) << 8;
+    setup_data.index = 0;
+    setup_data.length = hub_desc_buf_.size();
+    return ParentDevice()->ControlIn(
+        kDefaultControlPipeID, setup_data, hub_desc_buf_.data(), hub_desc_buf_.size(), this);
+  }
+
+  Error HubDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                                      const void* buf, int len) {
+    const auto recipient = setup_data.request_type.bits.recipient;
+    if (setup_data.request == request::kGetDescriptor) {
+      return OnHubDescriptorReceived(reinterpret_cast<const uint8_t*>(buf), len);
+    } else if (recipient == request_type::kOther &&
+               setup_data.request == request::kGetStatus) {
+      return OnPortStatusReceived(setup_data.index);
+    } else if (recipient == request_type::kOther &&
+               setup_data.request == request::kSetFeature &&
+               setup_data.value == feature::kPortPower) {
+      // EP0 の転送リングを溢れさせないよう，電源は 1 ポートずつ入れる
+      if (++num_powered_ports_ < num_ports_) {
+        return SetPortFeature(feature::kPortPower, num_powered_ports_ + 1);
+      }
+      // 電源が安定するのを待ってから状態変化の監視を始める
+      Log(kDebug, "HubDriver: all %d ports are powered. waiting %lu ms\n",
+          num_ports_, power_good_milliseconds_);
+      waiting_power_good_ = true;
+      StartTimer(power_good_milliseconds_, 0);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error HubDriver::OnAllPortsPowered() {
+    return ParentDevice()->InterruptIn(
+        ep_interrupt_in_, status_change_buf_.data(), (num_ports_ + 8) / 8);
+  }
+
+  void HubDriver::StartTimer(unsigned long msec, int port_num) {
+    // 現在の tick の残りが短くても msec 以上待つよう，1 tick 足しておく
+    const unsigned long timeout =
+        timer_manager->CurrentTick() + (msec * kTimerFreq + 999) / 1000 + 1;
+    if (port_num > 0) {
+      debounce_deadline_[port_num] = timeout;
+    }
+    timer_manager->AddTimer(Timer{timeout, kTimerTag | (hub_index_ << 8) | port_num});
+  }
+
+  bool HubDriver::OnTimerTimeout(int timer_value) {
+    if ((timer_value & 0xff000000) != kTimerTag) {
+      return false;
+    }
+    const int hub_index = (timer_value >> 8) & 0xff;
+    const int port_num = timer_value & 0xff;
+    if (hub_index >= kMaxHubs || hubs_[hub_index] == nullptr) {
+      return true;  // ハブが取り外された
+    }
+
+    auto hub = hubs_[hub_index];
+    auto dev = hub->ParentDevice();
+    dev->BeginBatch();
+    if (auto err = hub->OnTimeout(port_num)) {
+      Log(kError, "HubDriver: failed to handle timeout of port %d: %s at %s:%d\n",
+          port_num, err.Name(), err.File(), err.Line());
+    }
+    dev->EndBatch();
+    return true;
+  }
+
+  Error HubDriver::OnTimeout(int port_num) {
+    if (port_num == 0) {
+      if (!waiting_power_good_) {
+        return MAKE_ERROR(Error::kSuccess);
+      }
+      waiting_power_good_ = false;
+      return OnAllPortsPowered();
+    }
+
+    const uint16_t bit = 1u << port_num;
+    if ((debouncing_ports_ & bit) == 0 ||
+        timer_manager->CurrentTick() < debounce_deadline_[port_num]) {
+      return MAKE_ERROR(Error::kSuccess);  // デバウンス中に接続状態が変わり，待ち直している
+    }
+    // 待っている間に切断されていないか，状態を読み直してから接続を伝える
+    debouncing_ports_ &= ~bit;
+    debounced_ports_ |= bit;
+    return GetPortStatus(port_num);
+  }
+
+  Error HubDriver::OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) {
+    uint16_t changed = 0;
+    std::copy_n(reinterpret_cast<const uint8_t*>(buf), std::min(len, 2),
+                reinterpret_cast<uint8_t*>(&changed));
+
+    auto dev = ParentDevice();
+    dev->BeginBatch();
+    Error err = dev->InterruptIn(ep_interrupt_in_, status_change_buf_.data(), (num_ports_ + 8) / 8);
+    for (int port_num = 1; !err && port_num <= num_ports_; ++port_num) {
+      if (changed & (1u << port_num)) {
+        err = GetPortStatus(port_num);
+      }
+    }
+    dev->EndBatch();
+    return err;
+  }
+
+  Error HubDriver::ResetPort(int port_num) {
+    Log(kDebug, "HubDriver: resetting port %d\n", port_num);
+    return SetPortFeature(feature::kPortReset, port_num);
+  }
+
+  Error HubDriver::SetPortFeature(int feature, int port_num) {
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kOut;
+    setup_data.request_type.bits.type = request_type::kClass;
+    setup_data.request_type.bits.recipient = request_type::kOther;
+    setup_data.request = request::kSetFeature;
+    setup_data.value = feature;
+    setup_data.index = port_num;
+    setup_data.length = 0;
+    return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
+  }
+
+  Error HubDriver::ClearPortFeature(int feature, int port_num) {
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kOut;
+    setup_data.request_type.bits.type = request_type::kClass;
+    setup_data.request_type.bits.recipient = request_type::kOther;
+    setup_data.request = request::kClearFeature;
+    setup_data.value = feature;
+    setup_data.index = port_num;
+    setup_data.length = 0;
+    return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
+  }
+
+  Error HubDriver::GetPortStatus(int port_num) {
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kIn;
+    setup_data.request_type.bits.type = request_type::kClass;
+    setup_data.request_type.bits.recipient = request_type::kOther;
+    setup_data.request = request::kGetStatus;
+    setup_data.value = 0;
+    setup_data.index = port_num;
+    setup_data.length = 4;
+    return ParentDevice()->ControlIn(
+        kDefaultControlPipeID, setup_data, port_status_[port_num].data(), 4, this);
+  }
+
+  Error HubDriver::OnHubDescriptorReceived(const uint8_t* buf, int len) {
+    if (len < 7 || buf[1] != kHubDescriptorType) {
+      return MAKE_ERROR(Error::kInvalidDescriptor);
+    }
+    if (hub_index_ < 0) {
+      Log(kWarn, "HubDriver: more than %d hubs are not supported\n", kMaxHubs);
+      return MAKE_ERROR(Error::kFull);
+    }
+
+    num_ports_ = std::min<int>(buf[2], kMaxPorts);
+    const uint16_t characteristics = buf[3] | (static_cast<uint16_t>(buf[4]) << 8);
+    const int think_time = (characteristics >> 5) & 3;
+    power_good_milliseconds_ = 2 * buf[5];  // bPwrOn2PwrGood は 2 ミリ秒単位
+    Log(kInfo, "HubDriver: %d ports (%d reported), think time %d, multi TT %d\n",
+        num_ports_, buf[2], think_time, multi_tt_);
+
+    auto dev = ParentDevice();
+    if (auto err = dev->ConfigureHub(num_ports_, multi_tt_, think_time)) {
+      return err;
+    }
+
+    num_powered_ports_ = 0;
+    if (num_ports_ == 0) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    return SetPortFeature(feature::kPortPower, 1);
+  }
+
+  Error HubDriver::OnPortStatusReceived(int port_num) {
+    if (port_num < 1 || num_ports_ < port_num) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    const uint16_t status = port_status_[port_num][0];
+    const uint16_t change = port_status_[port_num][1];
+    Log(kDebug, "HubDriver: port %d status %04x change %04x\n", port_num, status, change);
+
+    auto dev = ParentDevice();
+    dev->BeginBatch();
+    for (auto [bit, feature] : kPortChangeFeatures) {
+      if (change & bit) {
+        ClearPortFeature(feature, port_num);
+      }
+    }
+    dev->EndBatch();
+
+    if ((change & 0x0010 /* C_PORT_RESET */) && (status & port_status::kEnable)) {
+      Speed speed = Speed::kFull;
+      if (status & port_status::kLowSpeed) {
+        speed = Speed::kLow;
+      } else if (status & port_status::kHighSpeed) {
+        speed = Speed::kHigh;
+      }
+      return dev->OnHubPortReset(this, port_num, speed);
+    }
+    const uint16_t bit = 1u << port_num;
+    if (change & 0x0001 /* C_PORT_CONNECTION */) {
+      // 繋がっていたデバイスは，差し直された場合も含めて取り外されている
+      auto err = dev->OnHubPortDisconnected(this, port_num);
+
+      // 接続状態が変わるたびにデバウンスを数え直す
+      debounced_ports_ &= ~bit;
+      debouncing_ports_ &= ~bit;
+      if (status & port_status::kConnection) {
+        debouncing_ports_ |= bit;
+        StartTimer(kDebounceMilliseconds, port_num);
+      }
+      return err;
+    }
+    if (debounced_ports_ & bit) {
+      debounced_ports_ &= ~bit;
+      if (status & port_status::kConnection) {
+        return dev->OnHubPortConnected(this, port_num);
+      }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+}  // namespace usb
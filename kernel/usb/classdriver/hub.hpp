@@ -0,0 +1,89 @@
+/**
+ * @file usb/classdriver/hub.hpp
+ *
+ * USB hub class driver.
+ */
+
+#pragma once
+
+#include <array>
+#include "usb/classdriver/base.hpp"
+
+namespace usb {
+  class HubDriver : public ClassDriver {
+   public:
+    /** @brief 扱えるダウンストリームポート数の上限．ルートストリングは 1 段あたり 4 ビット． */
+    static constexpr int kMaxPorts = 15;
+    /** @brief 同時に扱えるハブの数 */
+    static const int kMaxHubs = 16;
+    /** @brief ハブが使うタイマの Timer::Value の上位 8 ビット */
+    static const int kTimerTag = 0x48000000;
+    /** @brief 接続を検出してからポートをリセットするまで待つ時間（USB 2.0 7.1.7.3） */
+    static const unsigned long kDebounceMilliseconds = 100;
+
+    HubDriver(Device* dev, int interface_index, bool multi_tt);
+    ~HubDriver() override;
+
+    void* operator new(size_t size);
+    void operator delete(void* ptr) noexcept;
+
+    Error Initialize() override;
+    Error SetEndpoint(const EndpointConfig& config) override;
+    Error OnEndpointsConfigured() override;
+    Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                             const void* buf, int len) override;
+    Error OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) override;
+
+    /** @brief ダウンストリームポートのリセットを開始する．
+     *
+     * 完了するとステータス変化エンドポイントで通知され，
+     * Device::OnHubPortReset が呼ばれる．
+     */
+    Error ResetPort(int port_num);
+
+    int NumPorts() const { return num_ports_; }
+
+    /** @brief kTimerTimeout メッセージがハブのタイマなら処理して true を返す．
+     *
+     * 電源投入後の安定待ちと，接続検出後のデバウンスの完了をハブに伝える．
+     */
+    static bool OnTimerTimeout(int timer_value);
+
+   private:
+    /** 登録済みのハブ．添字をタイマの値に埋め込み，タイムアウトを通知する先を引く． */
+    static std::array<HubDriver*, kMaxHubs> hubs_;
+    int hub_index_{-1};
+
+    EndpointID ep_interrupt_in_;
+    const int interface_index_;
+    const bool multi_tt_;
+    int num_ports_{0};
+    int num_powered_ports_{0};
+    /** 電源を入れてから電源が安定するまでの時間（ハブディスクリプタの bPwrOn2PwrGood） */
+    unsigned long power_good_milliseconds_{0};
+    bool waiting_power_good_{false};
+
+    /** デバウンス中のポートのビットマップ（ビット i がポート i） */
+    uint16_t debouncing_ports_{0};
+    /** デバウンスを終え，ポートの状態を読み直しているポートのビットマップ */
+    uint16_t debounced_ports_{0};
+    /** ポートごとのデバウンスが終わる tick．接続状態が変わるたびに延ばす． */
+    std::array<unsigned long, kMaxPorts + 1> debounce_deadline_{};
+
+    std::array<uint8_t, 16> hub_desc_buf_{};
+    /** ステータス変化ビットマップ．ビット 0 がハブ自身，ビット i がポート i． */
+    std::array<uint8_t, 2> status_change_buf_{};
+    /** ポートごとの wPortStatus と wPortChange（index: ポート番号） */
+    std::array<std::array<uint16_t, 2>, kMaxPorts + 1> port_status_{};
+
+    Error SetPortFeature(int feature, int port_num);
+    Error ClearPortFeature(int feature, int port_num);
+    Error GetPortStatus(int port_num);
+    Error OnHubDescriptorReceived(const uint8_t* buf, int len);
+    Error OnPortStatusReceived(int port_num);
+    Error OnAllPortsPowered();
+    Error OnTimeout(int port_num);
+    /** @brief msec ミリ秒後に OnTimeout(port_num) が呼ばれるようにする．port_num 0 は電源の安定待ち． */
+    void StartTimer(unsigned long msec, int port_num);
+  };
+}
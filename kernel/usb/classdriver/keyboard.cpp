@@ -10,20 +10,62 @@ namespace usb {
   }
 
   Error HIDKeyboardDriver::OnDataReceived() {
-    for (int i = 2; i < 8; ++i) {
-      const uint8_t key = Buffer()[i];
-      if (key == 0) {
-        continue;
+    std::array<uint8_t, kMaxKeys> keys;
+    const int num_keys = ReadKeys(Buffer(), keys);
+    const uint8_t modifier = ReadModifier(Buffer());
+
+    auto contains = [](const std::array<uint8_t, kMaxKeys>& a, int n, uint8_t key) {
+      return std::find(a.begin(), a.begin() + n, key) != a.begin() + n;
+    };
+
+    // 1 - 3 はエラー（ErrorRollOver など）で，キーの状態を表さない．
+    // 同時押しが多すぎる間に届くので，押されているキーは変わらないものとする
+    for (int i = 0; i < num_keys; ++i) {
+      if (1 <= keys[i] && keys[i] <= 3) {
+        return MAKE_ERROR(Error::kSuccess);
+      }
+    }
+
+    // 0 は「押されていない」
+    for (int i = 0; i < num_pressed_keys_; ++i) {
+      const uint8_t key = pressed_keys_[i];
+      if (key != 0 && !contains(keys, num_keys, key)) {
+        NotifyKeyPush(modifier, key, false);
       }
-      const auto& prev_buf = PreviousBuffer();
-      if (std::find(prev_buf.begin(), prev_buf.end(), key) != prev_buf.end()) {
-        continue;
+    }
+    for (int i = 0; i < num_keys; ++i) {
+      const uint8_t key = keys[i];
+      if (key != 0 && !contains(pressed_keys_, num_pressed_keys_, key)) {
+        NotifyKeyPush(modifier, key, true);
       }
-      NotifyKeyPush(key);
     }
+    pressed_keys_ = keys;
+    num_pressed_keys_ = num_keys;
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  bool HIDKeyboardDriver::AcceptReportLayout(const HIDReportLayout& layout) {
+    return layout.IsKeyboard();
+  }
+
+  int HIDKeyboardDriver::ReadKeys(const std::array<uint8_t, kBufferSize>& report,
+                                  std::array<uint8_t, kMaxKeys>& keys) const {
+    if (!UsesReportProtocol()) {
+      std::copy_n(report.begin() + 2, 6, keys.begin());  // boot: modifiers, reserved, 6 keys
+      return 6;
+    }
+
+    const auto& layout = ReportLayout();
+    const uint8_t* data = ReportData(report);
+    const int len = report.data() + kBufferSize - data;
+    const int num_keys = std::min<int>(layout.num_keys, kMaxKeys);
+    HIDField field = layout.keys;
+    for (int i = 0; i < num_keys; ++i, field.bit_offset += 8) {
+      keys[i] = ExtractField(data, len, field);
+    }
+    return num_keys;
+  }
+
   void* HIDKeyboardDriver::operator new(size_t size) {
     return AllocMem(sizeof(HIDKeyboardDriver), 0, 0);
   }
@@ -32,16 +74,23 @@ namespace usb {
     FreeMem(ptr);
   }
 
-  void HIDKeyboardDriver::SubscribeKeyPush(
-      std::function<void(uint8_t keycode)> observer) {
+  void HIDKeyboardDriver::SubscribeKeyPush(Delegate<ObserverType> observer) {
     observers_[num_observers_++] = observer;
   }
 
-  std::function<HIDKeyboardDriver::ObserverType> HIDKeyboardDriver::default_observer;
+  Delegate<HIDKeyboardDriver::ObserverType> HIDKeyboardDriver::default_observer;
 
-  void HIDKeyboardDriver::NotifyKeyPush(uint8_t keycode) {
+  void HIDKeyboardDriver::NotifyKeyPush(uint8_t modifier, uint8_t keycode, bool press) {
     for (int i = 0; i < num_observers_; ++i) {
-      observers_[i](keycode);
+      observers_[i](modifier, keycode, press);
+    }
+  }
+
+  uint8_t HIDKeyboardDriver::ReadModifier(const std::array<uint8_t, kBufferSize>& report) const {
+    if (!UsesReportProtocol()) {
+      return report[0];
     }
+    const uint8_t* data = ReportData(report);
+    return ExtractField(data, report.data() + kBufferSize - data, ReportLayout().modifiers);
   }
 }  // namespace usb
@@ -6,7 +6,7 @@
 
 #pragma once
 
-#include <functional>
+#include "delegate.hpp"
 #include "usb/classdriver/hid.hpp"
 
 namespace usb {
@@ -18,15 +18,35 @@ namespace usb {
     void operator delete(void* ptr) noexcept;
 
     Error OnDataReceived() override;
+    bool AcceptReportLayout(const HIDReportLayout& layout) override;
 
-    using ObserverType = void (uint8_t keycode);
-    void SubscribeKeyPush(std::function<ObserverType> observer);
-    static std::function<ObserverType> default_observer;
+    /** @brief キーの押下（press = true）と解放を受け取るオブザーバ．
+     *
+     * modifier はレポートの修飾キーのビット列．同じレポートで変化した
+     * キーは，離されたキー，押されたキーの順に通知される．
+     */
+    using ObserverType = void (uint8_t modifier, uint8_t keycode, bool press);
+    void SubscribeKeyPush(Delegate<ObserverType> observer);
+    static Delegate<ObserverType> default_observer;
 
    private:
-    std::array<std::function<ObserverType>, 4> observers_;
+    /** @brief 1 レポートから読み出すキーコードの最大数 */
+    static constexpr int kMaxKeys = 16;
+
+    std::array<Delegate<ObserverType>, 4> observers_;
     int num_observers_ = 0;
 
-    void NotifyKeyPush(uint8_t keycode);
+    /** @brief 最後に受け取った有効なレポートで押されていたキー．
+     * ErrorRollOver のレポートでは更新しない．
+     */
+    std::array<uint8_t, kMaxKeys> pressed_keys_{};
+    int num_pressed_keys_ = 0;
+
+    void NotifyKeyPush(uint8_t modifier, uint8_t keycode, bool press);
+    /** @brief report の修飾キーのビット列を読み出す */
+    uint8_t ReadModifier(const std::array<uint8_t, kBufferSize>& report) const;
+    /** @brief report から押されているキーのキーコードを読み出す．@return キーの数 */
+    int ReadKeys(const std::array<uint8_t, kBufferSize>& report,
+                 std::array<uint8_t, kMaxKeys>& keys) const;
   };
 }
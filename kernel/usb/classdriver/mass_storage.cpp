@@ -0,0 +1,400 @@
+#include "usb/classdriver/mass_storage.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include "logger.hpp"
+#include "usb/device.hpp"
+#include "usb/memory.hpp"
+
+namespace {
+  namespace scsi {
+    const uint8_t kRequestSense = 0x03;
+    const uint8_t kInquiry = 0x12;
+    const uint8_t kReadCapacity10 = 0x25;
+    const uint8_t kRead10 = 0x28;
+    const uint8_t kWrite10 = 0x2a;
+  }
+
+  const int kInquiryLength = 36;
+  const int kReadCapacityLength = 8;
+  const int kRequestSenseLength = 18;
+  const int kMaxCapacityRetries = 3;
+
+  const int kMaxRecoveryRetries = 3;
+
+  const int kBulkOnlyMassStorageReset = 0xff;
+  const int kFeatureEndpointHalt = 0;
+
+  /** @brief bEndpointAddress の形式（ビット 7 が IN）のエンドポイントアドレス */
+  uint16_t EndpointAddress(usb::EndpointID ep_id) {
+    return ep_id.Number() | (ep_id.IsIn() ? 0x80 : 0);
+  }
+
+  uint32_t ReadBE32(const uint8_t* p) {
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+           (static_cast<uint32_t>(p[2]) << 8) | p[3];
+  }
+
+  void WriteBE32(uint8_t* p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+  }
+
+  void WriteBE16(uint8_t* p, uint16_t value) {
+    p[0] = value >> 8;
+    p[1] = value;
+  }
+}  // namespace
+
+namespace usb {
+  MassStorageDriver::MassStorageDriver(Device* dev, int interface_index)
+      : ClassDriver{dev}, interface_index_{interface_index}, params_{default_params} {
+  }
+
+  void* MassStorageDriver::operator new(size_t size) {
+    return AllocMem(sizeof(MassStorageDriver), 0, 0);
+  }
+
+  void MassStorageDriver::operator delete(void* ptr) noexcept {
+    FreeMem(ptr);
+  }
+
+  Error MassStorageDriver::Initialize() {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error MassStorageDriver::SetEndpoint(const EndpointConfig& config) {
+    if (config.ep_type == EndpointType::kBulk && config.ep_id.IsIn()) {
+      ep_bulk_in_ = config.ep_id;
+    } else if (config.ep_type == EndpointType::kBulk && !config.ep_id.IsIn()) {
+      ep_bulk_out_ = config.ep_id;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error MassStorageDriver::OnEndpointsConfigured() {
+    state_ = State::kInquiry;
+    return SendInquiry();
+  }
+
+  Error MassStorageDriver::OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                                              const void* buf, int len) {
+    if (state_ != State::kResetRecovery) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+
+    if (setup_data.request == kBulkOnlyMassStorageReset) {
+      return ClearEndpointHalt(ep_bulk_in_);
+    }
+    if (setup_data.request == request::kClearFeature &&
+        setup_data.index == EndpointAddress(ep_bulk_in_)) {
+      return ClearEndpointHalt(ep_bulk_out_);
+    }
+    return FinishResetRecovery();
+  }
+
+  Error MassStorageDriver::OnControlFailed(EndpointID ep_id, SetupData setup_data, Error err) {
+    if (state_ != State::kResetRecovery) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+
+    Log(kWarn, "MassStorage: reset recovery request %02x failed: %s\n",
+        setup_data.request, err.Name());
+    if (++recovery_retries_ > kMaxRecoveryRetries) {
+      return AbandonDevice();
+    }
+    return SendMassStorageReset();
+  }
+
+  Error MassStorageDriver::OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error MassStorageDriver::OnBulkCompleted(EndpointID ep_id, Error err,
+                                           const void* buf, int len) {
+    if (state_ == State::kResetRecovery) {
+      // リセット前に積んだ転送の残り
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    if (err) {
+      Log(kWarn, "MassStorageDriver: bulk transfer failed (ep addr %d)\n",
+          ep_id.Address());
+      return StartResetRecovery();
+    }
+
+    // CBW とデータ段はまとめて発行しているので，完了は CSW の受信で判断する
+    if (buf != &csw_) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    if (len < static_cast<int>(sizeof(csw_)) ||
+        csw_.signature != CommandStatusWrapper::kSignature ||
+        csw_.tag != cbw_.tag) {
+      Log(kError, "MassStorageDriver: invalid CSW (sig %08x, tag %u, expected %u)\n",
+          csw_.signature, csw_.tag, cbw_.tag);
+      return StartResetRecovery();
+    }
+    if (csw_.status == 2) {
+      Log(kError, "MassStorageDriver: phase error\n");
+      return StartResetRecovery();
+    }
+    return OnCommandCompleted();
+  }
+
+  Error MassStorageDriver::Read(uint32_t lba, int num_blocks, void* buf,
+                                Delegate<CompletionCallbackType> callback) {
+    return PushRequest(Request{false, lba, num_blocks,
+                               reinterpret_cast<uint8_t*>(buf), callback});
+  }
+
+  Error MassStorageDriver::Write(uint32_t lba, int num_blocks, const void* buf,
+                                 Delegate<CompletionCallbackType> callback) {
+    return PushRequest(Request{true, lba, num_blocks,
+                               reinterpret_cast<uint8_t*>(const_cast<void*>(buf)), callback});
+  }
+
+  void MassStorageDriver::SetParams(const MassStorageParams& params) {
+    params_.max_transfer_blocks = std::clamp(params.max_transfer_blocks, 1, 0xffff);
+    params_.queue_depth = std::clamp(params.queue_depth, 1, kMaxQueueDepth);
+  }
+
+  void MassStorageDriver::SubscribeReady(Delegate<ReadyObserverType> observer) {
+    ready_observer_ = observer;
+  }
+
+  Delegate<MassStorageDriver::ReadyObserverType> MassStorageDriver::default_observer;
+  MassStorageParams MassStorageDriver::default_params = kDefaultMassStorageParams;
+
+  Error MassStorageDriver::PushRequest(const Request& req) {
+    if (!IsReady()) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+    if (req.num_blocks <= 0 || req.lba + static_cast<uint64_t>(req.num_blocks) > num_blocks_) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    if (requests_.Count() >= static_cast<size_t>(params_.queue_depth)) {
+      return MAKE_ERROR(Error::kFull);
+    }
+
+    if (auto err = requests_.Push(req)) {
+      return err;
+    }
+    return StartNextRequest();
+  }
+
+  Error MassStorageDriver::SendCommand(const uint8_t* cb, int cb_len, bool dir_in,
+                                       void* data, uint32_t data_len) {
+    cbw_ = CommandBlockWrapper{};
+    cbw_.signature = CommandBlockWrapper::kSignature;
+    cbw_.tag = ++tag_;
+    cbw_.data_transfer_length = data_len;
+    cbw_.flags = dir_in ? 0x80 : 0;
+    cbw_.lun = 0;
+    cbw_.cb_length = cb_len;
+    memcpy(cbw_.cb, cb, cb_len);
+
+    // CBW，データ段，CSW の転送を一度に積み，ドアベルもまとめて鳴らす
+    auto dev = ParentDevice();
+    dev->BeginBatch();
+    Error err = dev->BulkOut(ep_bulk_out_, &cbw_, sizeof(cbw_));
+    if (!err && data_len > 0) {
+      err = dir_in ? dev->BulkIn(ep_bulk_in_, data, data_len)
+                   : dev->BulkOut(ep_bulk_out_, data, data_len);
+    }
+    if (!err) {
+      err = dev->BulkIn(ep_bulk_in_, &csw_, sizeof(csw_));
+    }
+    dev->EndBatch();
+    return err;
+  }
+
+  Error MassStorageDriver::SendInquiry() {
+    const uint8_t cb[6] = {scsi::kInquiry, 0, 0, 0, kInquiryLength, 0};
+    return SendCommand(cb, sizeof(cb), true, data_buf_.data(), kInquiryLength);
+  }
+
+  Error MassStorageDriver::SendReadCapacity() {
+    const uint8_t cb[10] = {scsi::kReadCapacity10};
+    return SendCommand(cb, sizeof(cb), true, data_buf_.data(), kReadCapacityLength);
+  }
+
+  Error MassStorageDriver::SendRequestSense() {
+    const uint8_t cb[6] = {scsi::kRequestSense, 0, 0, 0, kRequestSenseLength, 0};
+    return SendCommand(cb, sizeof(cb), true, data_buf_.data(), kRequestSenseLength);
+  }
+
+  Error MassStorageDriver::SendNextTransfer() {
+    const auto& req = requests_.Front();
+    // 1 回のバルク転送で扱える長さを超えないよう，コマンドのブロック数を抑える
+    const int max_blocks = std::min<uint32_t>(params_.max_transfer_blocks,
+                                              kMaxBulkTransferLength / block_size_);
+    command_blocks_ = std::min(req.num_blocks - done_blocks_, max_blocks);
+
+    uint8_t cb[10] = {req.write ? scsi::kWrite10 : scsi::kRead10};
+    WriteBE32(&cb[2], req.lba + done_blocks_);
+    WriteBE16(&cb[7], command_blocks_);
+    return SendCommand(cb, sizeof(cb), !req.write,
+                       req.buf + static_cast<size_t>(done_blocks_) * block_size_,
+                       command_blocks_ * block_size_);
+  }
+
+  Error MassStorageDriver::OnCommandCompleted() {
+    const bool passed = csw_.status == 0;
+
+    switch (state_) {
+    case State::kInquiry:
+      if (passed) {
+        Log(kInfo, "MassStorage: vendor '%.8s', product '%.16s'\n",
+            &data_buf_[8], &data_buf_[16]);
+      }
+      state_ = State::kReadCapacity;
+      return SendReadCapacity();
+    case State::kReadCapacity:
+      if (!passed) {
+        // 接続直後は UNIT ATTENTION で失敗することがあるので，
+        // センスデータを読み出してからやり直す
+        if (++capacity_retries_ > kMaxCapacityRetries) {
+          Log(kError, "MassStorage: READ CAPACITY failed\n");
+          return MAKE_ERROR(Error::kTransferFailed);
+        }
+        state_ = State::kRequestSense;
+        return SendRequestSense();
+      }
+      block_size_ = ReadBE32(&data_buf_[4]);
+      if (block_size_ == 0 || block_size_ > static_cast<uint32_t>(kMaxBulkTransferLength)) {
+        Log(kError, "MassStorage: unsupported block size %u\n", block_size_);
+        block_size_ = 0;
+        state_ = State::kNotConfigured;
+        return MAKE_ERROR(Error::kInvalidFormat);
+      }
+      num_blocks_ = static_cast<uint64_t>(ReadBE32(&data_buf_[0])) + 1;
+      Log(kInfo, "MassStorage: %lu blocks x %u bytes\n", num_blocks_, block_size_);
+      state_ = State::kIdle;
+      if (ready_observer_) {
+        ready_observer_(this);
+      }
+      return StartNextRequest();
+    case State::kRequestSense:
+      Log(kDebug, "MassStorage: sense key %x, asc %02x, ascq %02x\n",
+          data_buf_[2] & 0xfu, data_buf_[12], data_buf_[13]);
+      if (!IsReady()) {
+        state_ = State::kReadCapacity;
+        return SendReadCapacity();
+      }
+      return CompleteRequest(MAKE_ERROR(Error::kTransferFailed));
+    case State::kTransferring:
+      if (!passed) {
+        state_ = State::kRequestSense;
+        return SendRequestSense();
+      }
+      done_blocks_ += command_blocks_;
+      if (done_blocks_ < requests_.Front().num_blocks) {
+        return SendNextTransfer();
+      }
+      return CompleteRequest(MAKE_ERROR(Error::kSuccess));
+    default:
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+  }
+
+  Error MassStorageDriver::CompleteRequest(Error err) {
+    const Request req = requests_.Front();
+    requests_.Pop();
+    state_ = State::kIdle;
+
+    if (req.callback) {
+      req.callback(this, err, req.lba, req.buf, req.num_blocks);
+    }
+    return StartNextRequest();
+  }
+
+  Error MassStorageDriver::StartNextRequest() {
+    if (state_ != State::kIdle || requests_.Count() == 0) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    state_ = State::kTransferring;
+    done_blocks_ = 0;
+    return SendNextTransfer();
+  }
+
+  Error MassStorageDriver::StartResetRecovery() {
+    recovery_from_ = state_;
+    state_ = State::kResetRecovery;
+    recovery_retries_ = 0;
+
+    auto dev = ParentDevice();
+    for (auto ep_id : {ep_bulk_in_, ep_bulk_out_}) {
+      if (auto err = dev->ResetEndpoint(ep_id)) {
+        Log(kError, "MassStorageDriver: failed to reset ep addr %d: %s\n",
+            ep_id.Address(), err.Name());
+      }
+    }
+    return SendMassStorageReset();
+  }
+
+  Error MassStorageDriver::SendMassStorageReset() {
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kOut;
+    setup_data.request_type.bits.type = request_type::kClass;
+    setup_data.request_type.bits.recipient = request_type::kInterface;
+    setup_data.request = kBulkOnlyMassStorageReset;
+    setup_data.value = 0;
+    setup_data.index = interface_index_;
+    setup_data.length = 0;
+    return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
+  }
+
+  Error MassStorageDriver::ClearEndpointHalt(EndpointID ep_id) {
+    SetupData setup_data{};
+    setup_data.request_type.bits.direction = request_type::kOut;
+    setup_data.request_type.bits.type = request_type::kStandard;
+    setup_data.request_type.bits.recipient = request_type::kEndpoint;
+    setup_data.request = request::kClearFeature;
+    setup_data.value = kFeatureEndpointHalt;
+    setup_data.index = EndpointAddress(ep_id);
+    setup_data.length = 0;
+    return ParentDevice()->ControlOut(kDefaultControlPipeID, setup_data, nullptr, 0, this);
+  }
+
+  Error MassStorageDriver::FinishResetRecovery() {
+    Log(kInfo, "MassStorage: reset recovery completed\n");
+
+    if (!IsReady()) {
+      // 初期化中に失敗したら，容量の取得からやり直す
+      if (++capacity_retries_ > kMaxCapacityRetries) {
+        Log(kError, "MassStorage: giving up initialization\n");
+        state_ = State::kNotConfigured;
+        return MAKE_ERROR(Error::kTransferFailed);
+      }
+      state_ = State::kReadCapacity;
+      return SendReadCapacity();
+    }
+
+    // 中断したコマンドの要求は失敗として返し，次の要求に進む
+    if (recovery_from_ != State::kIdle && requests_.Count() > 0) {
+      return CompleteRequest(MAKE_ERROR(Error::kTransferFailed));
+    }
+    state_ = State::kIdle;
+    return StartNextRequest();
+  }
+
+  Error MassStorageDriver::AbandonDevice() {
+    Log(kError, "MassStorage: reset recovery failed, giving up the device\n");
+    state_ = State::kNotConfigured;
+    block_size_ = 0;  // IsReady() を偽にして新たな要求を断る
+    num_blocks_ = 0;
+
+    while (requests_.Count() > 0) {
+      const Request req = requests_.Front();
+      requests_.Pop();
+      if (req.callback) {
+        req.callback(this, MAKE_ERROR(Error::kTransferFailed),
+                     req.lba, req.buf, req.num_blocks);
+      }
+    }
+    return MAKE_ERROR(Error::kTransferFailed);
+  }
+}  // namespace usb
@@ -0,0 +1,173 @@
+/**
+ * @file usb/classdriver/mass_storage.hpp
+ *
+ * USB mass storage (Bulk-Only Transport, SCSI transparent command set) class driver.
+ */
+
+#pragma once
+
+#include <array>
+#include "delegate.hpp"
+#include "queue.hpp"
+#include "usb/classdriver/base.hpp"
+
+namespace usb {
+  /** @brief マスストレージドライバの転送パラメータ */
+  struct MassStorageParams {
+    /** 1 つの SCSI コマンドで転送する最大ブロック数（1 - 65535）．
+     * 転送長が kMaxBulkTransferLength を超える分は，さらに分割される．
+     */
+    int max_transfer_blocks;
+    /** 同時に受け付ける読み書き要求の数（1 - MassStorageDriver::kMaxQueueDepth） */
+    int queue_depth;
+  };
+
+  /** @brief 512 バイトブロックで 64KiB ずつ転送し，8 個まで要求を溜められる */
+  constexpr MassStorageParams kDefaultMassStorageParams{128, 8};
+
+  /** @brief Command Block Wrapper */
+  struct CommandBlockWrapper {
+    static const uint32_t kSignature = 0x43425355;  // "USBC"
+
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t data_transfer_length;
+    uint8_t flags;  // ビット 7 が 1 なら IN
+    uint8_t lun;
+    uint8_t cb_length;
+    uint8_t cb[16];
+  } __attribute__((packed));
+
+  /** @brief Command Status Wrapper */
+  struct CommandStatusWrapper {
+    static const uint32_t kSignature = 0x53425355;  // "USBS"
+
+    uint32_t signature;
+    uint32_t tag;
+    uint32_t data_residue;
+    uint8_t status;  // 0: passed, 1: failed, 2: phase error
+  } __attribute__((packed));
+
+  class MassStorageDriver : public ClassDriver {
+   public:
+    static constexpr int kMaxQueueDepth = 16;
+
+    MassStorageDriver(Device* dev, int interface_index);
+
+    void* operator new(size_t size);
+    void operator delete(void* ptr) noexcept;
+
+    Error Initialize() override;
+    Error SetEndpoint(const EndpointConfig& config) override;
+    Error OnEndpointsConfigured() override;
+    Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
+                             const void* buf, int len) override;
+    Error OnControlFailed(EndpointID ep_id, SetupData setup_data, Error err) override;
+    Error OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) override;
+    Error OnBulkCompleted(EndpointID ep_id, Error err, const void* buf, int len) override;
+
+    /** @brief 読み書き要求の完了を通知するコールバック．buf と num_blocks は要求時の値． */
+    using CompletionCallbackType = void (MassStorageDriver* driver, Error err,
+                                         uint32_t lba, void* buf, int num_blocks);
+
+    /** @brief lba から num_blocks ブロックを buf に読み込む要求を積む．
+     *
+     * 要求は積んだ順に処理され，params の max_transfer_blocks ごとに
+     * READ(10) コマンドに分割される．全ブロックを読み終えるか失敗したら
+     * callback が呼ばれる．
+     *
+     * @return 要求を積めたら Error::kSuccess．初期化前なら Error::kInvalidPhase，
+     *   要求が queue_depth 個溜まっていたら Error::kFull．
+     */
+    Error Read(uint32_t lba, int num_blocks, void* buf,
+               Delegate<CompletionCallbackType> callback);
+    /** @brief buf の内容を lba から num_blocks ブロック書き込む要求を積む． */
+    Error Write(uint32_t lba, int num_blocks, const void* buf,
+                Delegate<CompletionCallbackType> callback);
+
+    bool IsReady() const { return block_size_ != 0; }
+    uint32_t BlockSize() const { return block_size_; }
+    uint64_t NumBlocks() const { return num_blocks_; }
+
+    const MassStorageParams& Params() const { return params_; }
+    void SetParams(const MassStorageParams& params);
+
+    /** @brief 容量の取得が終わり読み書きできるようになったら呼ばれる */
+    using ReadyObserverType = void (MassStorageDriver* driver);
+    void SubscribeReady(Delegate<ReadyObserverType> observer);
+    static Delegate<ReadyObserverType> default_observer;
+    /** @brief 新たに生成するドライバに設定するパラメータ */
+    static MassStorageParams default_params;
+
+   private:
+    enum class State {
+      kNotConfigured,
+      kInquiry,
+      kReadCapacity,
+      kRequestSense,
+      kIdle,
+      kTransferring,
+      kResetRecovery,
+    };
+
+    struct Request {
+      bool write;
+      uint32_t lba;
+      int num_blocks;
+      uint8_t* buf;
+      Delegate<CompletionCallbackType> callback;
+    };
+
+    EndpointID ep_bulk_in_;
+    EndpointID ep_bulk_out_;
+    const int interface_index_;
+    MassStorageParams params_;
+
+    State state_{State::kNotConfigured};
+    /** @brief リセットリカバリを始めたときの状態 */
+    State recovery_from_{State::kNotConfigured};
+    /** @brief リセットリカバリ中にコントロール転送が失敗した回数 */
+    int recovery_retries_{0};
+    int capacity_retries_{0};
+    uint32_t block_size_{0};
+    uint64_t num_blocks_{0};
+
+    std::array<Request, kMaxQueueDepth> request_buf_{};
+    ArrayQueue<Request> requests_{request_buf_};
+    /** @brief 先頭の要求のうち転送済みのブロック数と，転送中のコマンドのブロック数 */
+    int done_blocks_{0}, command_blocks_{0};
+
+    uint32_t tag_{0};
+    CommandBlockWrapper cbw_{};
+    CommandStatusWrapper csw_{};
+    std::array<uint8_t, 64> data_buf_{};
+
+    Delegate<ReadyObserverType> ready_observer_;
+
+    Error PushRequest(const Request& req);
+    Error SendCommand(const uint8_t* cb, int cb_len, bool dir_in,
+                      void* data, uint32_t data_len);
+    Error SendInquiry();
+    Error SendReadCapacity();
+    Error SendRequestSense();
+    Error SendNextTransfer();
+    Error OnCommandCompleted();
+    Error CompleteRequest(Error err);
+    Error StartNextRequest();
+
+    /** @brief Bulk-Only Transport のリセットリカバリを始める．
+     *
+     * ホスト側の両バルクエンドポイントの TD を捨てた上で，Bulk-Only Mass Storage
+     * Reset，バルク IN と OUT への CLEAR_FEATURE(ENDPOINT_HALT) を順に発行する．
+     * 完了したら FinishResetRecovery で中断したコマンドを失敗として片付ける．
+     * 途中のコントロール転送が失敗したら Mass Storage Reset からやり直し，
+     * kMaxRecoveryRetries 回を超えたら AbandonDevice で諦める．
+     */
+    Error StartResetRecovery();
+    Error SendMassStorageReset();
+    Error ClearEndpointHalt(EndpointID ep_id);
+    Error FinishResetRecovery();
+    /** @brief 溜まっている要求をすべて失敗させ，以後の要求を受け付けない． */
+    Error AbandonDevice();
+  };
+}
@@ -11,14 +11,30 @@ namespace usb {
   }
 
   Error HIDMouseDriver::OnDataReceived() {
-    uint8_t buttons = Buffer()[0];
-    int8_t displacement_x = Buffer()[1];
-    int8_t displacement_y = Buffer()[2];
-    NotifyMouseMove(buttons, displacement_x, displacement_y);
-    Log(kDebug, "%02x,(%3d,%3d)\n", buttons, displacement_x, displacement_y);
+    uint8_t buttons;
+    int displacement_x, displacement_y, wheel = 0;
+    if (UsesReportProtocol()) {
+      const auto& layout = ReportLayout();
+      const uint8_t* report = ReportData(Buffer());
+      const int len = Buffer().data() + kBufferSize - report;
+      buttons = ExtractField(report, len, layout.buttons);
+      displacement_x = ExtractField(report, len, layout.x);
+      displacement_y = ExtractField(report, len, layout.y);
+      wheel = ExtractField(report, len, layout.wheel);
+    } else {
+      buttons = Buffer()[0];
+      displacement_x = static_cast<int8_t>(Buffer()[1]);
+      displacement_y = static_cast<int8_t>(Buffer()[2]);
+    }
+    NotifyMouseMove(buttons, displacement_x, displacement_y, wheel);
+    Log(kDebug, "%02x,(%3d,%3d),%d\n", buttons, displacement_x, displacement_y, wheel);
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  bool HIDMouseDriver::AcceptReportLayout(const HIDReportLayout& layout) {
+    return layout.IsMouse() && layout.x.is_signed && layout.y.is_signed;
+  }
+
   void* HIDMouseDriver::operator new(size_t size) {
     return AllocMem(sizeof(HIDMouseDriver), 0, 0);
   }
@@ -27,18 +43,19 @@ namespace usb {
     FreeMem(ptr);
   }
 
-  void HIDMouseDriver::SubscribeMouseMove(std::function<ObserverType> observer) {
+  void HIDMouseDriver::SubscribeMouseMove(Delegate<ObserverType> observer) {
     observers_[num_observers_++] = observer;
   }
 
-  std::function<HIDMouseDriver::ObserverType> HIDMouseDriver::default_observer;
+  Delegate<HIDMouseDriver::ObserverType> HIDMouseDriver::default_observer;
 
   void HIDMouseDriver::NotifyMouseMove(
       uint8_t buttons,
-      int8_t displacement_x,
-      int8_t displacement_y) {
+      int displacement_x,
+      int displacement_y,
+      int wheel) {
     for (int i = 0; i < num_observers_; ++i) {
-      observers_[i](buttons, displacement_x, displacement_y);
+      observers_[i](buttons, displacement_x, displacement_y, wheel);
     }
   }
 }  // namespace usb
@@ -6,7 +6,7 @@
 
 #pragma once
 
-#include <functional>
+#include "delegate.hpp"
 #include "usb/classdriver/hid.hpp"
 
 namespace usb {
@@ -18,15 +18,22 @@ namespace usb {
     void operator delete(void* ptr) noexcept;
 
     Error OnDataReceived() override;
-
-    using ObserverType = void (uint8_t buttons, int8_t displacement_x, int8_t displacement_y);
-    void SubscribeMouseMove(std::function<ObserverType> observer);
-    static std::function<ObserverType> default_observer;
+    bool AcceptReportLayout(const HIDReportLayout& layout) override;
+
+    /** @brief マウスの移動とボタン・ホイールの状態を受け取るオブザーバ．
+     *
+     * レポートプロトコルでは移動量は 8 ビットに丸められない．
+     * wheel はホイールが無いか，ブートプロトコルのときは 0．
+     */
+    using ObserverType = void (uint8_t buttons, int displacement_x, int displacement_y,
+                               int wheel);
+    void SubscribeMouseMove(Delegate<ObserverType> observer);
+    static Delegate<ObserverType> default_observer;
 
    private:
-    std::array<std::function<ObserverType>, 4> observers_;
+    std::array<Delegate<ObserverType>, 4> observers_;
     int num_observers_ = 0;
 
-    void NotifyMouseMove(uint8_t buttons, int8_t displacement_x, int8_t displacement_y);
+    void NotifyMouseMove(uint8_t buttons, int displacement_x, int displacement_y, int wheel);
   };
 }
@@ -1,7 +1,9 @@
 #include "usb/device.hpp"
 
 #include "usb/classdriver/base.hpp"
+#include "usb/classdriver/hub.hpp"
 #include "usb/classdriver/keyboard.hpp"
+#include "usb/classdriver/mass_storage.hpp"
 #include "usb/classdriver/mouse.hpp"
 #include "usb/descriptor.hpp"
 #include "usb/setupdata.hpp"
@@ -68,6 +70,18 @@ namespace {
         }
         return mouse_driver;
       }
+    } else if (if_desc.interface_class == 8 &&
+               if_desc.interface_sub_class == 6 &&    // SCSI transparent command set
+               if_desc.interface_protocol == 0x50) {  // Bulk-Only Transport
+      auto storage_driver = new usb::MassStorageDriver{dev, if_desc.interface_number};
+      if (usb::MassStorageDriver::default_observer) {
+        storage_driver->SubscribeReady(usb::MassStorageDriver::default_observer);
+      }
+      return storage_driver;
+    } else if (if_desc.interface_class == 9) {  // hub
+      // interface_protocol 2 は Multi TT のハブ（通常は代替設定 1 に現れる）
+      return new usb::HubDriver{dev, if_desc.interface_number,
+                                if_desc.interface_protocol == 2};
     }
     return nullptr;
   }
@@ -105,16 +119,10 @@ namespace usb {
   }
 
   Error Device::ControlIn(EndpointID ep_id, SetupData setup_data, void* buf, int len, ClassDriver* issuer) {
-    if (issuer) {
-      event_waiters_.Put(setup_data, issuer);
-    }
     return MAKE_ERROR(Error::kSuccess);
   }
 
   Error Device::ControlOut(EndpointID ep_id, SetupData setup_data, const void* buf, int len, ClassDriver* issuer) {
-    if (issuer) {
-      event_waiters_.Put(setup_data, issuer);
-    }
     return MAKE_ERROR(Error::kSuccess);
   }
 
@@ -126,6 +134,34 @@ namespace usb {
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  Error Device::BulkIn(EndpointID ep_id, void* buf, int len) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Device::BulkOut(EndpointID ep_id, const void* buf, int len) {
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Device::ResetEndpoint(EndpointID ep_id) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error Device::ConfigureHub(int num_ports, bool multi_tt, int think_time) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error Device::OnHubPortConnected(HubDriver* hub, int port_num) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error Device::OnHubPortDisconnected(HubDriver* hub, int port_num) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
+  Error Device::OnHubPortReset(HubDriver* hub, int port_num, Speed speed) {
+    return MAKE_ERROR(Error::kNotImplemented);
+  }
+
   Error Device::StartInitialize() {
     is_initialized_ = false;
     initialize_phase_ = 1;
@@ -144,12 +180,28 @@ namespace usb {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error Device::OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void* buf, int len) {
+  void Device::DestroyClassDrivers() {
+    // 1 つのクラスドライバが複数のエンドポイントに割り当てられている
+    for (auto& class_driver : class_drivers_) {
+      auto d = class_driver;
+      if (d == nullptr) {
+        continue;
+      }
+      for (auto& other : class_drivers_) {
+        if (other == d) {
+          other = nullptr;
+        }
+      }
+      delete d;
+    }
+  }
+
+  Error Device::OnControlCompleted(EndpointID ep_id, SetupData setup_data, const void* buf, int len, ClassDriver* issuer) {
     Log(kDebug, "Device::OnControlCompleted: buf 0x%08x, len %d, dir %d\n",
         buf, len, setup_data.request_type.bits.direction);
     if (is_initialized_) {
-      if (auto w = event_waiters_.Get(setup_data)) {
-        return w.value()->OnControlCompleted(ep_id, setup_data, buf, len);
+      if (issuer) {
+        return issuer->OnControlCompleted(ep_id, setup_data, buf, len);
       }
       return MAKE_ERROR(Error::kNoWaiter);
     }
@@ -177,6 +229,15 @@ namespace usb {
     return MAKE_ERROR(Error::kNotImplemented);
   }
 
+  Error Device::OnControlFailed(EndpointID ep_id, SetupData setup_data,
+                                ClassDriver* issuer, Error err) {
+    Log(kDebug, "Device::OnControlFailed: req %02x, %s\n", setup_data.request, err.Name());
+    if (is_initialized_ && issuer) {
+      return issuer->OnControlFailed(ep_id, setup_data, err);
+    }
+    return err;  // 初期化中の要求は再送しない
+  }
+
   Error Device::OnInterruptCompleted(EndpointID ep_id, const void* buf, int len) {
     Log(kDebug, "Device::OnInterruptCompleted: ep addr %d\n", ep_id.Address());
     if (auto w = class_drivers_[ep_id.Number()]) {
@@ -185,6 +246,15 @@ namespace usb {
     return MAKE_ERROR(Error::kNoWaiter);
   }
 
+  Error Device::OnBulkCompleted(EndpointID ep_id, Error err, const void* buf, int len) {
+    Log(kDebug, "Device::OnBulkCompleted: ep addr %d, %s, len %d\n",
+        ep_id.Address(), err.Name(), len);
+    if (auto w = class_drivers_[ep_id.Number()]) {
+      return w->OnBulkCompleted(ep_id, err, buf, len);
+    }
+    return MAKE_ERROR(Error::kNoWaiter);
+  }
+
   Error Device::InitializePhase1(const uint8_t* buf, int len) {
     const auto device_desc = DescriptorDynamicCast<DeviceDescriptor>(buf);
     num_configurations_ = device_desc->num_configurations;
@@ -11,10 +11,24 @@
 #include "error.hpp"
 #include "usb/setupdata.hpp"
 #include "usb/endpoint.hpp"
-#include "usb/arraymap.hpp"
 
 namespace usb {
   class ClassDriver;
+  class HubDriver;
+
+  /** @brief ハブがポートの状態として報告するデバイスの速度 */
+  enum class Speed {
+    kLow,
+    kFull,
+    kHigh,
+    kSuper,
+  };
+
+  /** @brief 1 回のバルク転送で扱える最大バイト数．
+   *
+   * xHCI の Event Data TRB が報告する転送長（EDTLA）が 24 ビットのため．
+   */
+  const int kMaxBulkTransferLength = (1 << 24) - 1;
 
   class Device {
    public:
@@ -25,6 +39,40 @@ namespace usb {
                              const void* buf, int len, ClassDriver* issuer);
     virtual Error InterruptIn(EndpointID ep_id, void* buf, int len);
     virtual Error InterruptOut(EndpointID ep_id, void* buf, int len);
+    virtual Error BulkIn(EndpointID ep_id, void* buf, int len);
+    virtual Error BulkOut(EndpointID ep_id, const void* buf, int len);
+    /** @brief ホスト側のエンドポイントを転送可能な状態に戻し，完了していない転送を破棄する．
+     *
+     * 破棄した転送の完了は通知されない．デバイス側のエンドポイントの
+     * Halt は，必要なら CLEAR_FEATURE(ENDPOINT_HALT) で別途解除する．
+     */
+    virtual Error ResetEndpoint(EndpointID ep_id);
+
+    /** @brief 転送要求をまとめて発行する区間を開始・終了する．
+     *
+     * BeginBatch から EndBatch までに発行された転送要求は，EndBatch で
+     * まとめてホストコントローラに通知される．入れ子にしてよい．
+     */
+    virtual void BeginBatch() {}
+    virtual void EndBatch() {}
+
+    /** @brief このデバイスがハブであることをホストコントローラに知らせる．
+     *
+     * @param num_ports  ダウンストリームポート数
+     * @param multi_tt  ポートごとに Transaction Translator を持つなら true
+     * @param think_time  ハブディスクリプタの TT Think Time（0 - 3）
+     */
+    virtual Error ConfigureHub(int num_ports, bool multi_tt, int think_time);
+    /** @brief ハブのポートに新たなデバイスが接続されたときに hub から呼ばれる． */
+    virtual Error OnHubPortConnected(HubDriver* hub, int port_num);
+    /** @brief ハブのポートからデバイスが取り外されたときに hub から呼ばれる． */
+    virtual Error OnHubPortDisconnected(HubDriver* hub, int port_num);
+    /** @brief ハブのポートのリセットが完了したときに hub から呼ばれる．
+     *
+     * speed はリセット後のポートの状態から読み取った接続先デバイスの速度．
+     * ホストコントローラ固有の表現への変換は派生クラスで行う．
+     */
+    virtual Error OnHubPortReset(HubDriver* hub, int port_num, Speed speed);
 
     Error StartInitialize();
     bool IsInitialized() { return is_initialized_; }
@@ -34,10 +82,22 @@ namespace usb {
 
     uint8_t* Buffer() { return buf_.data(); }
 
+    /** @brief デバイスが取り外されたときに，割り当て済みのクラスドライバを破棄する． */
+    void DestroyClassDrivers();
+
    protected:
+    /** @brief コントロール転送の完了を処理する．
+     *
+     * issuer は ControlIn / ControlOut に渡された発行元で，初期化完了後は
+     * issuer のクラスドライバに完了を通知する．
+     */
     Error OnControlCompleted(EndpointID ep_id, SetupData setup_data,
-                             const void* buf, int len);
+                             const void* buf, int len, ClassDriver* issuer);
+    /** @brief コントロール転送の失敗を issuer のクラスドライバに通知する． */
+    Error OnControlFailed(EndpointID ep_id, SetupData setup_data,
+                          ClassDriver* issuer, Error err);
     Error OnInterruptCompleted(EndpointID ep_id, const void* buf, int len);
+    Error OnBulkCompleted(EndpointID ep_id, Error err, const void* buf, int len);
 
    private:
     /** @brief エンドポイントに割り当て済みのクラスドライバ．
@@ -65,11 +125,6 @@ namespace usb {
     Error InitializePhase2(const uint8_t* buf, int len);
     Error InitializePhase3(uint8_t config_value);
     Error InitializePhase4();
-
-    /** OnControlCompleted の中で要求の発行元を特定するためのマップ構造．
-     * ControlOut または ControlIn を発行したときに発行元が登録される．
-     */
-    ArrayMap<SetupData, ClassDriver*, 4> event_waiters_{};
   };
 
   Error GetDescriptor(Device& dev, EndpointID ep_id,
@@ -62,6 +62,7 @@ namespace usb {
     const int kBOS = 15;
     const int kDeviceCapability = 16;
     const int kHID = 33;
+    const int kReport = 34;
     const int kSuperspeedUSBEndpointCompanion = 48;
     const int kSuperspeedPlusIsochronousEndpointCompanion = 49;
   }
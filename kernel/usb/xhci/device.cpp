@@ -1,8 +1,11 @@
 #include "usb/xhci/device.hpp"
 
+#include <algorithm>
 #include "logger.hpp"
 #include "usb/memory.hpp"
 #include "usb/xhci/ring.hpp"
+#include "usb/xhci/speed.hpp"
+#include "usb/xhci/xhci.hpp"
 
 namespace {
   using namespace usb::xhci;
@@ -77,8 +80,14 @@ namespace {
 }  // namespace
 
 namespace usb::xhci {
-  Device::Device(uint8_t slot_id, DoorbellRegister* dbreg)
-      : slot_id_{slot_id}, dbreg_{dbreg} {
+  Device::Device(uint8_t slot_id, DoorbellRegister* dbreg, Controller* xhc)
+      : slot_id_{slot_id}, dbreg_{dbreg}, xhc_{xhc} {
+  }
+
+  Device::~Device() {
+    for (auto ctx : control_contexts_) {
+      delete[] ctx;
+    }
   }
 
   Error Device::Initialize() {
@@ -101,9 +110,46 @@ namespace usb::xhci {
       tr->Initialize(buf_size);
     }
     transfer_rings_[i] = tr;
+
+    // コントロール転送は EP0 にしか積まないので，他のリングには用意しない．
+    // DMA 用のプールは解放できないため，通常のヒープから確保する
+    if (index.value == 1) {
+      delete[] control_contexts_[i];
+      control_contexts_[i] = new ControlContext[buf_size]{};
+    }
     return tr;
   }
 
+  Device::ControlContext* Device::FindControlContext(DeviceContextIndex dci,
+                                                     const TRB* ioc_trb) {
+    if (dci.value < 1 || 31 < dci.value) {
+      return nullptr;
+    }
+    auto tr = transfer_rings_[dci.value - 1];
+    auto ctx = control_contexts_[dci.value - 1];
+    if (tr == nullptr || ctx == nullptr) {
+      return nullptr;
+    }
+    const int i = tr->IndexOf(ioc_trb);
+    return i < 0 ? nullptr : &ctx[i];
+  }
+
+  Error Device::SetControlContext(DeviceContextIndex dci, const TRB* ioc_trb,
+                                  SetupData setup_data, ClassDriver* issuer) {
+    auto ctx = FindControlContext(dci, ioc_trb);
+    if (ctx == nullptr) {
+      return MAKE_ERROR(Error::kTransferRingNotSet);
+    }
+    if (ctx->in_use) {
+      // 完了していない転送の TRB をリングが一周して上書きした
+      Log(kError, "Device::SetControlContext: transfer ring overflow (dci %d)\n",
+          dci.value);
+      return MAKE_ERROR(Error::kFull);
+    }
+    *ctx = ControlContext{true, setup_data, issuer};
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
   Error Device::ControlIn(EndpointID ep_id, SetupData setup_data, void* buf, int len, ClassDriver* issuer) {
     if (auto err = usb::Device::ControlIn(ep_id, setup_data, buf, len, issuer)) {
       return err;
@@ -124,28 +170,33 @@ namespace usb::xhci {
       return MAKE_ERROR(Error::kTransferRingNotSet);
     }
 
+    // IOC を立てる TRB（DataStage か StatusStage）は TD の 2 番目になる．
+    // リングを書き換える前に空きと ControlContext を確保しておく
+    if (tr->NumFreeTRBs() < 3) {
+      return MAKE_ERROR(Error::kFull);
+    }
+    if (auto err = SetControlContext(dci, tr->EnqueuePointer(1), setup_data, issuer)) {
+      return err;
+    }
+
     auto status = StatusStageTRB{};
 
     if (buf) {
-      auto setup_trb_position = TRBDynamicCast<SetupStageTRB>(tr->Push(
-          MakeSetupStageTRB(setup_data, SetupStageTRB::kInDataStage)));
+      tr->Push(MakeSetupStageTRB(setup_data, SetupStageTRB::kInDataStage));
       auto data = MakeDataStageTRB(buf, len, true);
       data.bits.interrupt_on_completion = true;
-      auto data_trb_position = tr->Push(data);
+      data.bits.interrupter_target = interrupter_target_;
+      tr->Push(data);
       tr->Push(status);
-
-      setup_stage_map_.Put(data_trb_position, setup_trb_position);
     } else {
-      auto setup_trb_position = TRBDynamicCast<SetupStageTRB>(tr->Push(
-          MakeSetupStageTRB(setup_data, SetupStageTRB::kNoDataStage)));
+      tr->Push(MakeSetupStageTRB(setup_data, SetupStageTRB::kNoDataStage));
       status.bits.direction = true;
       status.bits.interrupt_on_completion = true;
-      auto status_trb_position = tr->Push(status);
-
-      setup_stage_map_.Put(status_trb_position, setup_trb_position);
+      status.bits.interrupter_target = interrupter_target_;
+      tr->Push(status);
     }
 
-    dbreg_->Ring(dci.value);
+    RingDoorbell(dci);
 
     return MAKE_ERROR(Error::kSuccess);
   }
@@ -170,28 +221,31 @@ namespace usb::xhci {
       return MAKE_ERROR(Error::kTransferRingNotSet);
     }
 
+    if (tr->NumFreeTRBs() < 3) {
+      return MAKE_ERROR(Error::kFull);
+    }
+    if (auto err = SetControlContext(dci, tr->EnqueuePointer(1), setup_data, issuer)) {
+      return err;
+    }
+
     auto status = StatusStageTRB{};
     status.bits.direction = true;
 
     if (buf) {
-      auto setup_trb_position = TRBDynamicCast<SetupStageTRB>(tr->Push(
-          MakeSetupStageTRB(setup_data, SetupStageTRB::kOutDataStage)));
+      tr->Push(MakeSetupStageTRB(setup_data, SetupStageTRB::kOutDataStage));
       auto data = MakeDataStageTRB(buf, len, false);
       data.bits.interrupt_on_completion = true;
-      auto data_trb_position = tr->Push(data);
+      data.bits.interrupter_target = interrupter_target_;
+      tr->Push(data);
       tr->Push(status);
-
-      setup_stage_map_.Put(data_trb_position, setup_trb_position);
     } else {
-      auto setup_trb_position = TRBDynamicCast<SetupStageTRB>(tr->Push(
-          MakeSetupStageTRB(setup_data, SetupStageTRB::kNoDataStage)));
+      tr->Push(MakeSetupStageTRB(setup_data, SetupStageTRB::kNoDataStage));
       status.bits.interrupt_on_completion = true;
-      auto status_trb_position = tr->Push(status);
-
-      setup_stage_map_.Put(status_trb_position, setup_trb_position);
+      status.bits.interrupter_target = interrupter_target_;
+      tr->Push(status);
     }
 
-    dbreg_->Ring(dci.value);
+    RingDoorbell(dci);
 
     return MAKE_ERROR(Error::kSuccess);
   }
@@ -214,12 +268,315 @@ namespace usb::xhci {
     normal.bits.trb_transfer_length = len;
     normal.bits.interrupt_on_short_packet = true;
     normal.bits.interrupt_on_completion = true;
+    normal.bits.interrupter_target = interrupter_target_;
 
-    tr->Push(normal);
-    dbreg_->Ring(dci.value);
+    if (tr->Push(normal) == nullptr) {
+      return MAKE_ERROR(Error::kFull);
+    }
+    RingDoorbell(dci);
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  Error Device::BulkIn(EndpointID ep_id, void* buf, int len) {
+    if (auto err = usb::Device::BulkIn(ep_id, buf, len)) {
+      return err;
+    }
+    return PushBulkTD(ep_id, buf, len);
+  }
+
+  Error Device::BulkOut(EndpointID ep_id, const void* buf, int len) {
+    if (auto err = usb::Device::BulkOut(ep_id, buf, len)) {
+      return err;
+    }
+    return PushBulkTD(ep_id, buf, len);
+  }
+
+  Error Device::PushBulkTD(EndpointID ep_id, const void* buf, int len) {
+    Log(kDebug, "Device::PushBulkTD: ep addr %d, buf %08lx, len %d\n",
+        ep_id.Address(), buf, len);
+    if (ep_id.Number() < 1 || 15 < ep_id.Number()) {
+      return MAKE_ERROR(Error::kInvalidEndpointNumber);
+    }
+    // 長さ 0 の NormalTRB は積まない．完了時の転送長は 24 ビットで報告される
+    if (len <= 0 || kMaxBulkTransferLength < len) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    const DeviceContextIndex dci{ep_id};
+
+    Ring* tr = transfer_rings_[dci.value - 1];
+
+    if (tr == nullptr) {
+      return MAKE_ERROR(Error::kTransferRingNotSet);
+    }
+
+    int max_packet_size = ctx_.ep_contexts[dci.value - 1].bits.max_packet_size;
+    if (max_packet_size == 0) {
+      max_packet_size = 512;
+    }
+
+    // 1 つの TRB が指すバッファは 64KiB 境界を跨いではならない
+    const uintptr_t kBoundary = 64 * 1024;
+    uintptr_t p = reinterpret_cast<uintptr_t>(buf);
+    const uintptr_t end = p + len;
+
+    // TD の途中でリングが溢れないよう，NormalTRB と EventDataTRB の分の空きを確かめる
+    const size_t num_trbs = ((end - 1) / kBoundary - p / kBoundary + 1) + 1;
+    if (tr->NumFreeTRBs() < num_trbs) {
+      return MAKE_ERROR(Error::kFull);
+    }
+
+    do {
+      const uintptr_t chunk_end = std::min(end, (p + kBoundary) & ~(kBoundary - 1));
+      const int remaining_packets = (end - chunk_end + max_packet_size - 1) / max_packet_size;
+
+      NormalTRB normal{};
+      normal.SetPointer(reinterpret_cast<const void*>(p));
+      normal.bits.trb_transfer_length = chunk_end - p;
+      normal.bits.td_size = std::min(remaining_packets, 31);
+      normal.bits.chain_bit = true;
+      normal.bits.interrupter_target = interrupter_target_;
+      tr->Push(normal);
+
+      p = chunk_end;
+    } while (p < end);
+
+    EventDataTRB event_data{};
+    event_data.SetPointer(buf);
+    event_data.bits.interrupt_on_completion = true;
+    event_data.bits.interrupter_target = interrupter_target_;
+    tr->Push(event_data);
+
+    RingDoorbell(dci);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  void Device::BeginBatch() {
+    ++batch_depth_;
+  }
+
+  void Device::EndBatch() {
+    if (batch_depth_ == 0 || --batch_depth_ > 0) {
+      return;
+    }
+
+    // リセット中のエンドポイントは，リセットが終わるまで保留したままにする
+    const uint32_t ready = pending_doorbells_ & ~resetting_endpoints_;
+    for (int dci = 1; dci <= 31; ++dci) {
+      if (ready & (1u << dci)) {
+        dbreg_->Ring(dci);
+      }
+    }
+    pending_doorbells_ &= ~ready;
+  }
+
+  void Device::RingDoorbell(DeviceContextIndex dci) {
+    const uint32_t bit = 1u << dci.value;
+    if (batch_depth_ > 0 || (resetting_endpoints_ & bit)) {
+      pending_doorbells_ |= bit;
+    } else {
+      dbreg_->Ring(dci.value);
+    }
+  }
+
+  Error Device::ResetEndpoint(EndpointID ep_id) {
+    if (ep_id.Number() < 0 || 15 < ep_id.Number()) {
+      return MAKE_ERROR(Error::kInvalidEndpointNumber);
+    }
+
+    const DeviceContextIndex dci{ep_id};
+    Ring* tr = transfer_rings_[dci.value - 1];
+    if (tr == nullptr) {
+      return MAKE_ERROR(Error::kTransferRingNotSet);
+    }
+
+    const uint32_t bit = 1u << dci.value;
+    if (resetting_endpoints_ & bit) {
+      return MAKE_ERROR(Error::kSuccess);
+    }
+    reset_dequeues_[dci.value - 1] = DequeueState{tr->EnqueuePointer(), tr->CycleBit()};
+
+    switch (ctx_.ep_contexts[dci.value - 1].bits.ep_state) {
+      case 1: // Running
+        xhc_->CommandRing()->Push(StopEndpointCommandTRB{ep_id, slot_id_});
+        break;
+      case 2: // Halted
+        xhc_->CommandRing()->Push(ResetEndpointCommandTRB{ep_id, slot_id_});
+        break;
+      case 3: // Stopped
+      case 4: // Error
+        PushSetTRDequeuePointer(ep_id);
+        break;
+      default:
+        return MAKE_ERROR(Error::kInvalidPhase);
+    }
+    Log(kDebug, "Device::ResetEndpoint: slot %d, ep addr %d\n", slot_id_, ep_id.Address());
+
+    resetting_endpoints_ |= bit;
+    xhc_->RingCommandDoorbell();
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error Device::OnEndpointCommandCompleted(const TRB* cmd_trb, int completion_code) {
+    if (completion_code != 1 /* Success */) {
+      Log(kWarn, "Device::OnEndpointCommandCompleted: %s failed: %s (slot %d)\n",
+          kTRBTypeToName[cmd_trb->bits.trb_type],
+          kTRBCompletionCodeToName[completion_code], slot_id_);
+    }
+
+    if (auto stop = TRBDynamicCast<const StopEndpointCommandTRB>(cmd_trb)) {
+      const DeviceContextIndex dci{stop->EndpointID()};
+      if (ctx_.ep_contexts[dci.value - 1].bits.ep_state == 2 /* Halted */) {
+        // Stop Endpoint の発行と前後してエンドポイントが Halted になった
+        xhc_->CommandRing()->Push(ResetEndpointCommandTRB{stop->EndpointID(), slot_id_});
+      } else {
+        PushSetTRDequeuePointer(stop->EndpointID());
+      }
+    } else if (auto reset = TRBDynamicCast<const ResetEndpointCommandTRB>(cmd_trb)) {
+      PushSetTRDequeuePointer(reset->EndpointID());
+    } else if (auto set_deq = TRBDynamicCast<const SetTRDequeuePointerCommandTRB>(cmd_trb)) {
+      const DeviceContextIndex dci{set_deq->EndpointID()};
+      const uint32_t bit = 1u << dci.value;
+      transfer_rings_[dci.value - 1]->SetDequeuePointer(set_deq->Pointer());
+      resetting_endpoints_ &= ~bit;
+      // リセット中に積まれた転送があれば，ここでドアベルを鳴らす
+      if (batch_depth_ == 0 && (pending_doorbells_ & bit)) {
+        pending_doorbells_ &= ~bit;
+        dbreg_->Ring(dci.value);
+      }
+      return MAKE_ERROR(Error::kSuccess);
+    } else {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+
+    xhc_->RingCommandDoorbell();
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  void Device::PushSetTRDequeuePointer(EndpointID ep_id) {
+    const DeviceContextIndex dci{ep_id};
+    const auto& deq = reset_dequeues_[dci.value - 1];
+    xhc_->CommandRing()->Push(SetTRDequeuePointerCommandTRB{
+        deq.pointer, deq.cycle_bit, ep_id, slot_id_});
+  }
+
+  Error Device::AbortControlTransfers(const TransferEventTRB& trb) {
+    Ring* tr = transfer_rings_[0];
+    ControlContext* ctxs = control_contexts_[0];
+    if (tr == nullptr || ctxs == nullptr) {
+      return MAKE_ERROR(Error::kTransferRingNotSet);
+    }
+
+    // STALL などで EP0 も Halted になるので，リセットして後続の TD ごと捨てる
+    if (auto err = ResetEndpoint(kDefaultControlPipeID)) {
+      Log(kError, "failed to reset EP0: %s at %s:%d\n",
+          err.Name(), err.File(), err.Line());
+    }
+
+    // 失敗した TD からリセット開始時の書き込み位置までに IOC を持つ TD が，
+    // 捨てられる転送．リセット中に積まれた TD はその先にあるので残る
+    const int end = tr->IndexOf(reset_dequeues_[0].pointer);
+    int i = tr->IndexOf(trb.Pointer());
+    if (i < 0) {
+      return MAKE_ERROR(Error::kTransferFailed);
+    }
+
+    Error result = MAKE_ERROR(Error::kSuccess);
+    for (size_t n = 0; n < tr->Size() && i != end; ++n, i = (i + 1) % tr->Size()) {
+      if (!ctxs[i].in_use) {
+        continue;
+      }
+      const ControlContext ctx = ctxs[i];
+      ctxs[i].in_use = false;
+      if (auto err = this->OnControlFailed(kDefaultControlPipeID, ctx.setup_data,
+                                           ctx.issuer, MAKE_ERROR(Error::kTransferFailed))) {
+        result = err;
+      }
+    }
+    return result;
+  }
+
+  void Device::UpdateDequeuePointer(const TransferEventTRB& trb) {
+    const DeviceContextIndex dci{trb.EndpointID()};
+    if (dci.value < 1 || 31 < dci.value) {
+      return;
+    }
+    Ring* tr = transfer_rings_[dci.value - 1];
+    if (tr == nullptr) {
+      return;
+    }
+
+    if (!trb.bits.event_data) {
+      tr->MarkConsumed(trb.Pointer());
+      return;
+    }
+
+    // Event Data の値はバッファの先頭なので，処理済みの位置から
+    // 同じ値を持つ最初の EventDataTRB を探す
+    const void* buf = trb.Pointer();
+    int i = tr->IndexOf(tr->DequeuePointer());
+    for (size_t n = 0; n < tr->Size(); ++n) {
+      auto event_data = TRBDynamicCast<const EventDataTRB>(&tr->Buffer()[i]);
+      if (event_data && event_data->Pointer() == buf) {
+        tr->MarkConsumed(&tr->Buffer()[i]);
+        return;
+      }
+      i = (i + 1) % tr->Size();
+    }
+  }
+
+  const void* Device::FindBulkTDBuffer(DeviceContextIndex dci, const TRB* trb) {
+    Ring* tr = transfer_rings_[dci.value - 1];
+    int i = tr->IndexOf(trb);
+    if (i < 0) {
+      return nullptr;
+    }
+
+    for (size_t n = 0; n < tr->Size(); ++n) {
+      const TRB* t = &tr->Buffer()[i];
+      if (auto event_data = TRBDynamicCast<const EventDataTRB>(t)) {
+        return event_data->Pointer();
+      }
+      if (((t->data[3] >> 4) & 1u) == 0) {  // chain bit
+        break;
+      }
+      i = (i + 1) % tr->Size();  // LinkTRB の次はリングの先頭
+    }
+    return nullptr;
+  }
+
+  Error Device::ConfigureHub(int num_ports, bool multi_tt, int think_time) {
+    return usb::xhci::ConfigureHub(*xhc_, *this, num_ports, multi_tt, think_time);
+  }
+
+  Error Device::OnHubPortConnected(HubDriver* hub, int port_num) {
+    return AttachHubPort(*xhc_, *this, *hub, port_num);
+  }
+
+  Error Device::OnHubPortDisconnected(HubDriver* hub, int port_num) {
+    return DetachHubPort(*xhc_, *this, port_num);
+  }
+
+  Error Device::OnHubPortReset(HubDriver* hub, int port_num, usb::Speed speed) {
+    // ハブの報告する速度を xHCI の既定の Protocol Speed ID に直す
+    int psi = kFullSpeed;
+    switch (speed) {
+      case usb::Speed::kLow:
+        psi = kLowSpeed;
+        break;
+      case usb::Speed::kFull:
+        psi = kFullSpeed;
+        break;
+      case usb::Speed::kHigh:
+        psi = kHighSpeed;
+        break;
+      case usb::Speed::kSuper:
+        psi = kSuperSpeed;
+        break;
+    }
+    return usb::xhci::OnHubPortReset(*xhc_, *this, port_num, psi);
+  }
+
   Error Device::InterruptOut(EndpointID ep_id, void* buf, int len) {
     if (auto err = usb::Device::InterruptOut(ep_id, buf, len)) {
       return err;
@@ -235,10 +592,46 @@ namespace usb::xhci {
 
     if (trb.bits.completion_code != 1 /* Success */ &&
         trb.bits.completion_code != 13 /* Short Packet */) {
-      Log(kDebug, trb);
+      if (26 <= trb.bits.completion_code && trb.bits.completion_code <= 28) {
+        // Stopped 系：ResetEndpoint の Stop Endpoint で中断された TD．
+        // この TD は Set TR Dequeue Pointer で破棄されるので通知しない
+        Log(kDebug, trb);
+        return MAKE_ERROR(Error::kSuccess);
+      }
+      Log(kWarn, trb);
+      UpdateDequeuePointer(trb);
+
+      const DeviceContextIndex dci{trb.EndpointID()};
+      const auto ep_type = ctx_.ep_contexts[dci.value - 1].bits.ep_type;
+      if (ep_type == 2 /* Bulk Out */ || ep_type == 6 /* Bulk In */) {
+        // TD の途中の NormalTRB で失敗すると EventDataTRB のイベントは来ず，
+        // エンドポイントは Halted になって後続の TD も止まる．
+        // エンドポイントを戻して残りの TD を捨て，失敗をクラスドライバに伝える
+        const void* buf = trb.bits.event_data
+            ? trb.Pointer() : FindBulkTDBuffer(dci, trb.Pointer());
+        if (auto err = ResetEndpoint(trb.EndpointID())) {
+          Log(kError, "failed to reset endpoint: %s at %s:%d\n",
+              err.Name(), err.File(), err.Line());
+        }
+        return this->OnBulkCompleted(
+            trb.EndpointID(), MAKE_ERROR(Error::kTransferFailed), buf, 0);
+      }
+
+      if (dci.value == 1) {
+        return AbortControlTransfers(trb);
+      }
       return MAKE_ERROR(Error::kTransferFailed);
     }
     Log(kDebug, trb);
+    UpdateDequeuePointer(trb);
+
+    if (trb.bits.event_data) {
+      // EventDataTRB によるイベントでは，TRB ポインタの位置に Event Data の値
+      // （バッファの先頭）が，転送長の位置に TD 全体の転送済みバイト数が入る
+      return this->OnBulkCompleted(
+          trb.EndpointID(), MAKE_ERROR(Error::kSuccess),
+          trb.Pointer(), trb.bits.trb_transfer_length);
+    }
 
     TRB* issuer_trb = trb.Pointer();
     if (auto normal_trb = TRBDynamicCast<NormalTRB>(issuer_trb)) {
@@ -248,8 +641,8 @@ namespace usb::xhci {
           trb.EndpointID(), normal_trb->Pointer(), transfer_length);
     }
 
-    auto opt_setup_stage_trb = setup_stage_map_.Get(issuer_trb);
-    if (!opt_setup_stage_trb) {
+    auto ctx = FindControlContext(trb.EndpointID(), issuer_trb);
+    if (ctx == nullptr || !ctx->in_use) {
       Log(kDebug, "No Corresponding Setup Stage for issuer %s\n",
           kTRBTypeToName[issuer_trb->bits.trb_type]);
       if (auto data_trb = TRBDynamicCast<DataStageTRB>(issuer_trb)) {
@@ -257,15 +650,8 @@ namespace usb::xhci {
       }
       return MAKE_ERROR(Error::kNoCorrespondingSetupStage);
     }
-    setup_stage_map_.Delete(issuer_trb);
-
-    auto setup_stage_trb = opt_setup_stage_trb.value();
-    SetupData setup_data{};
-    setup_data.request_type.data = setup_stage_trb->bits.request_type;
-    setup_data.request = setup_stage_trb->bits.request;
-    setup_data.value = setup_stage_trb->bits.value;
-    setup_data.index = setup_stage_trb->bits.index;
-    setup_data.length = setup_stage_trb->bits.length;
+    const ControlContext control_ctx = *ctx;
+    ctx->in_use = false;
 
     void* data_stage_buffer{nullptr};
     int transfer_length{0};
@@ -279,6 +665,7 @@ namespace usb::xhci {
       return MAKE_ERROR(Error::kNotImplemented);
     }
     return this->OnControlCompleted(
-        trb.EndpointID(), setup_data, data_stage_buffer, transfer_length);
+        trb.EndpointID(), control_ctx.setup_data, data_stage_buffer, transfer_length,
+        control_ctx.issuer);
   }
 }  // namespace usb::xhci
@@ -11,12 +11,13 @@
 
 #include "error.hpp"
 #include "usb/device.hpp"
-#include "usb/arraymap.hpp"
 #include "usb/xhci/context.hpp"
 #include "usb/xhci/trb.hpp"
 #include "usb/xhci/registers.hpp"
 
 namespace usb::xhci {
+  class Controller;
+
   class Device : public usb::Device {
    public:
     enum class State {
@@ -33,7 +34,8 @@ namespace usb::xhci {
         int trb_transfer_length,
         TRB* issue_trb);
 
-    Device(uint8_t slot_id, DoorbellRegister* dbreg);
+    Device(uint8_t slot_id, DoorbellRegister* dbreg, Controller* xhc);
+    ~Device() override;
 
     Error Initialize();
 
@@ -45,6 +47,10 @@ namespace usb::xhci {
     State State() const { return state_; }
     uint8_t SlotID() const { return slot_id_; }
 
+    /** @brief 転送完了イベントを受け取るインタラプタ番号 */
+    uint16_t InterrupterTarget() const { return interrupter_target_; }
+    void SetInterrupterTarget(uint16_t value) { interrupter_target_ = value; }
+
     void SelectForSlotAssignment();
     Ring* AllocTransferRing(DeviceContextIndex index, size_t buf_size);
 
@@ -54,8 +60,32 @@ namespace usb::xhci {
                      const void* buf, int len, ClassDriver* issuer) override;
     Error InterruptIn(EndpointID ep_id, void* buf, int len) override;
     Error InterruptOut(EndpointID ep_id, void* buf, int len) override;
+    Error BulkIn(EndpointID ep_id, void* buf, int len) override;
+    Error BulkOut(EndpointID ep_id, const void* buf, int len) override;
+    /** @brief エンドポイントの状態を戻し，転送リングに積まれた TD を破棄する．
+     *
+     * Halted なら Reset Endpoint，Running なら Stop Endpoint コマンドを発行し，
+     * その完了後に Set TR Dequeue Pointer でデキューポインタを呼び出し時点の
+     * 書き込み位置まで進める．すべて完了するまで，このエンドポイントの
+     * ドアベルは保留する．
+     */
+    Error ResetEndpoint(EndpointID ep_id) override;
+
+    /** @brief ドアベルの発行を EndBatch まで遅延させる． */
+    void BeginBatch() override;
+    /** @brief 最も外側の EndBatch で，転送待ちのエンドポイントのドアベルを
+     * それぞれ 1 回だけ鳴らす．
+     */
+    void EndBatch() override;
+
+    Error ConfigureHub(int num_ports, bool multi_tt, int think_time) override;
+    Error OnHubPortConnected(HubDriver* hub, int port_num) override;
+    Error OnHubPortDisconnected(HubDriver* hub, int port_num) override;
+    Error OnHubPortReset(HubDriver* hub, int port_num, usb::Speed speed) override;
 
     Error OnTransferEventReceived(const TransferEventTRB& trb);
+    /** @brief ResetEndpoint が発行したコマンドの完了を処理する． */
+    Error OnEndpointCommandCompleted(const TRB* cmd_trb, int completion_code);
 
    private:
     alignas(64) struct DeviceContext ctx_;
@@ -63,14 +93,72 @@ namespace usb::xhci {
 
     const uint8_t slot_id_;
     DoorbellRegister* const dbreg_;
+    Controller* const xhc_;
+    uint16_t interrupter_target_ = 0;
+
+    /** @brief BeginBatch の入れ子の深さ */
+    int batch_depth_ = 0;
+    /** @brief ドアベルを鳴らしていない DCI のビットマップ（ビット i が DCI i） */
+    uint32_t pending_doorbells_ = 0;
+    /** @brief ResetEndpoint の処理中の DCI のビットマップ */
+    uint32_t resetting_endpoints_ = 0;
+    /** @brief ResetEndpoint を始めた時点の書き込み位置と cycle bit（index = dci - 1）．
+     * リセット中に積まれた TD は捨てずに残す．
+     */
+    struct DequeueState {
+      TRB* pointer;
+      bool cycle_bit;
+    };
+    std::array<DequeueState, 31> reset_dequeues_{};
+
+    /** @brief バルク転送の TD を転送リングに積む．
+     *
+     * バッファを 64KiB 境界で分割した NormalTRB を chain bit でつなぎ，
+     * 末尾に IOC 付きの EventDataTRB を置く．転送完了イベントは
+     * EventDataTRB から生成され，TD 全体の転送長とバッファの先頭を運ぶ．
+     */
+    Error PushBulkTD(EndpointID ep_id, const void* buf, int len);
+
+    /** @brief 転送イベントが示す位置まで，転送リングの処理済みの位置を進める． */
+    void UpdateDequeuePointer(const TransferEventTRB& trb);
+
+    /** @brief 失敗したバルク転送の TRB から，その TD のバッファの先頭を求める．
+     *
+     * TD 末尾の EventDataTRB まで chain bit をたどる．見つからなければ nullptr．
+     */
+    const void* FindBulkTDBuffer(DeviceContextIndex dci, const TRB* trb);
+
+    /** @brief Set TR Dequeue Pointer コマンドで，ResetEndpoint の時点で積まれていた TRB を捨てる． */
+    void PushSetTRDequeuePointer(EndpointID ep_id);
+
+    /** @brief 失敗したコントロール転送と，それに続いて捨てられる転送の発行元に失敗を通知する． */
+    Error AbortControlTransfers(const TransferEventTRB& trb);
+
+    /** @brief バッチ中や ResetEndpoint の処理中ならドアベルを保留し，
+     * そうでなければ即座に鳴らす．
+     */
+    void RingDoorbell(DeviceContextIndex dci);
 
     enum State state_;
     std::array<Ring*, 31> transfer_rings_; // index = dci - 1
 
-    /** コントロール転送が完了した際に DataStageTRB や StatusStageTRB
-     * から対応する SetupStageTRB を検索するためのマップ．
+    /** @brief コントロール転送の完了イベントから要求を特定するための情報 */
+    struct ControlContext {
+      bool in_use;
+      SetupData setup_data;
+      ClassDriver* issuer;
+    };
+
+    /** 転送リングごとの ControlContext の配列（index = dci - 1）．
+     * コントロール転送を積む EP0（DCI 1）の分だけをヒープに確保し，他は nullptr．
+     * 各配列の添字は，IOC を立てた DataStageTRB または StatusStageTRB の
+     * リング上の位置．転送イベントの TRB ポインタから O(1) で引ける．
      */
-    ArrayMap<const void*, const SetupStageTRB*, 16> setup_stage_map_{};
+    std::array<ControlContext*, 31> control_contexts_{};
+
+    ControlContext* FindControlContext(DeviceContextIndex dci, const TRB* ioc_trb);
+    Error SetControlContext(DeviceContextIndex dci, const TRB* ioc_trb,
+                            SetupData setup_data, ClassDriver* issuer);
 
     //usb::Device* usb_device_;
   };
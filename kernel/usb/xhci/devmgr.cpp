@@ -2,6 +2,17 @@
 
 #include "usb/memory.hpp"
 
+namespace {
+  // ルートハブのポート番号は 1 以上なので，key は 0 にならない
+  uint32_t PortIndexKey(uint8_t port_num, uint32_t route_string) {
+    return (route_string << 8) | port_num;
+  }
+
+  size_t PortIndexHash(uint32_t key, size_t bits) {
+    return (key * 2654435761u) >> (32 - bits);
+  }
+}
+
 namespace usb::xhci {
   Error DeviceManager::Initialize(size_t max_slots) {
     max_slots_ = max_slots;
@@ -30,14 +41,8 @@ namespace usb::xhci {
   }
 
   Device* DeviceManager::FindByPort(uint8_t port_num, uint32_t route_string) const {
-    for (size_t i = 1; i <= max_slots_; ++i) {
-      auto dev = devices_[i];
-      if (dev == nullptr) continue;
-      if (dev->DeviceContext()->slot_context.bits.root_hub_port_num == port_num) {
-        return dev;
-      }
-    }
-    return nullptr;
+    const int i = FindPortIndexEntry(PortIndexKey(port_num, route_string));
+    return i < 0 ? nullptr : FindBySlot(port_index_[i].slot_id);
   }
 
   Device* DeviceManager::FindByState(enum Device::State state) const {
@@ -67,7 +72,8 @@ namespace usb::xhci {
   }
   */
 
-  Error DeviceManager::AllocDevice(uint8_t slot_id, DoorbellRegister* dbreg) {
+  Error DeviceManager::AllocDevice(uint8_t slot_id, DoorbellRegister* dbreg,
+                                   Controller* xhc) {
     if (slot_id > max_slots_) {
       return MAKE_ERROR(Error::kInvalidSlotID);
     }
@@ -77,10 +83,83 @@ namespace usb::xhci {
     }
 
     devices_[slot_id] = AllocArray<Device>(1, 64, 4096);
-    new (devices_[slot_id]) Device(slot_id, dbreg);
+    new (devices_[slot_id]) Device(slot_id, dbreg, xhc);
     return MAKE_ERROR(Error::kSuccess);
   }
 
+  Error DeviceManager::AssignPort(uint8_t slot_id, uint8_t port_num, uint32_t route_string,
+                                  uint8_t hub_slot_id) {
+    if (slot_id == 0 || slot_id > max_slots_ || hub_slot_id > max_slots_) {
+      return MAKE_ERROR(Error::kInvalidSlotID);
+    }
+
+    const uint32_t key = PortIndexKey(port_num, route_string);
+    const size_t mask = port_index_.size() - 1;
+    size_t i = PortIndexHash(key, kPortIndexBits);
+    for (size_t n = 0; port_index_[i].key != 0 && port_index_[i].key != key;
+         i = (i + 1) & mask) {
+      if (++n == port_index_.size()) {
+        return MAKE_ERROR(Error::kFull);
+      }
+    }
+    if (port_index_[i].key == key) {
+      // 取り外されたデバイスの片付けが済む前に，同じ位置に別のデバイスが繋がった
+      port_keys_[port_index_[i].slot_id] = 0;
+    }
+    port_index_[i] = PortIndexEntry{key, slot_id};
+    port_keys_[slot_id] = key;
+
+    UnlinkChild(slot_id);
+    if (hub_slot_id != 0) {
+      parent_hub_[slot_id] = hub_slot_id;
+      next_sibling_[slot_id] = first_child_[hub_slot_id];
+      first_child_[hub_slot_id] = slot_id;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  int DeviceManager::FindPortIndexEntry(uint32_t key) const {
+    const size_t mask = port_index_.size() - 1;
+    for (size_t i = PortIndexHash(key, kPortIndexBits), n = 0;
+         n < port_index_.size() && port_index_[i].key != 0;
+         i = (i + 1) & mask, ++n) {
+      if (port_index_[i].key == key) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  void DeviceManager::RemovePortIndexEntry(size_t index) {
+    // 後ろの要素のうち，空いた位置より前を本来の位置とするものを詰めて，
+    // 探査の連鎖が途切れないようにする
+    const size_t mask = port_index_.size() - 1;
+    size_t hole = index;
+    for (size_t i = (hole + 1) & mask; port_index_[i].key != 0; i = (i + 1) & mask) {
+      const size_t home = PortIndexHash(port_index_[i].key, kPortIndexBits);
+      if (((i - home) & mask) >= ((i - hole) & mask)) {
+        port_index_[hole] = port_index_[i];
+        hole = i;
+      }
+    }
+    port_index_[hole] = PortIndexEntry{};
+  }
+
+  void DeviceManager::UnlinkChild(uint8_t slot_id) {
+    const uint8_t hub_slot_id = parent_hub_[slot_id];
+    if (hub_slot_id != 0) {
+      uint8_t* link = &first_child_[hub_slot_id];
+      while (*link != 0 && *link != slot_id) {
+        link = &next_sibling_[*link];
+      }
+      if (*link == slot_id) {
+        *link = next_sibling_[slot_id];
+      }
+    }
+    parent_hub_[slot_id] = 0;
+    next_sibling_[slot_id] = 0;
+  }
+
   Error DeviceManager::LoadDCBAA(uint8_t slot_id) {
     if (slot_id > max_slots_) {
       return MAKE_ERROR(Error::kInvalidSlotID);
@@ -92,9 +171,50 @@ namespace usb::xhci {
   }
 
   Error DeviceManager::Remove(uint8_t slot_id) {
+    if (slot_id == 0 || slot_id > max_slots_) {
+      return MAKE_ERROR(Error::kInvalidSlotID);
+    }
+
+    if (port_keys_[slot_id] != 0) {
+      const int i = FindPortIndexEntry(port_keys_[slot_id]);
+      if (i >= 0 && port_index_[i].slot_id == slot_id) {
+        RemovePortIndexEntry(i);
+      }
+      port_keys_[slot_id] = 0;
+    }
+
+    // 子デバイスは親より後に片付くことがあるので，親子の関係だけを切っておく
+    UnlinkChild(slot_id);
+    for (uint8_t child = first_child_[slot_id]; child != 0; ) {
+      const uint8_t next = next_sibling_[child];
+      parent_hub_[child] = 0;
+      next_sibling_[child] = 0;
+      child = next;
+    }
+    first_child_[slot_id] = 0;
+
     device_context_pointers_[slot_id] = nullptr;
+    if (devices_[slot_id]) {
+      devices_[slot_id]->~Device();
+    }
     FreeMem(devices_[slot_id]);
     devices_[slot_id] = nullptr;
     return MAKE_ERROR(Error::kSuccess);
   }
+
+  void DeviceManager::BeginBatch() {
+    for (size_t i = 1; i <= max_slots_; ++i) {
+      if (auto dev = devices_[i]) {
+        dev->BeginBatch();
+      }
+    }
+  }
+
+  void DeviceManager::EndBatch() {
+    for (size_t i = 1; i <= max_slots_; ++i) {
+      if (auto dev = devices_[i]) {
+        dev->EndBatch();
+      }
+    }
+  }
 }  // namespace usb::xhci
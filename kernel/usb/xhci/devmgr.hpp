@@ -6,6 +6,7 @@
 
 #pragma once
 
+#include <array>
 #include <cstddef>
 #include <cstdint>
 
@@ -14,19 +15,42 @@
 #include "usb/xhci/device.hpp"
 
 namespace usb::xhci {
+  class Controller;
+
   class DeviceManager {
 
    public:
     Error Initialize(size_t max_slots);
     DeviceContext** DeviceContexts() const;
+    /** @brief ルートハブのポート番号とルートストリングからデバイスを引く．
+     *
+     * 索引は AssignPort で登録したものを使う．
+     */
     Device* FindByPort(uint8_t port_num, uint32_t route_string) const;
     Device* FindByState(enum Device::State state) const;
     Device* FindBySlot(uint8_t slot_id) const;
     //WithError<Device*> Get(uint8_t device_id) const;
-    Error AllocDevice(uint8_t slot_id, DoorbellRegister* dbreg);
+    Error AllocDevice(uint8_t slot_id, DoorbellRegister* dbreg, Controller* xhc);
+    /** @brief スロットのデバイスを (port_num, route_string) で引けるよう索引に登録する．
+     *
+     * hub_slot_id は直接の接続先のハブのスロット ID で，ルートハブなら 0．
+     * 0 でなければ，そのハブの子デバイスのリストにも加える．
+     */
+    Error AssignPort(uint8_t slot_id, uint8_t port_num, uint32_t route_string,
+                     uint8_t hub_slot_id);
+    /** @brief ハブに接続された子デバイスのスロット ID をたどる．
+     *
+     * FirstChild(hub_slot_id) から始め，NextSibling で次の子に進む．0 なら終わり．
+     */
+    uint8_t FirstChild(uint8_t hub_slot_id) const { return first_child_[hub_slot_id]; }
+    uint8_t NextSibling(uint8_t slot_id) const { return next_sibling_[slot_id]; }
     Error LoadDCBAA(uint8_t slot_id);
     Error Remove(uint8_t slot_id);
 
+    /** @brief 管理下の全デバイスで Device::BeginBatch / EndBatch を呼ぶ． */
+    void BeginBatch();
+    void EndBatch();
+
    private:
     // device_context_pointers_ can be used as DCBAAP's value.
     // The number of elements is max_slots_ + 1.
@@ -35,5 +59,30 @@ namespace usb::xhci {
 
     // The number of elements is max_slots_ + 1.
     Device** devices_;
+
+    /** @brief (port_num, route_string) からスロット ID を引くハッシュ表．
+     *
+     * オープンアドレス法（線形探査）．key が 0 の要素は空き．
+     * 削除時は後続の要素を詰め直すので，削除済みの印は残らない．
+     * スロット数（最大 255）の倍以上の大きさにしておき，探査が短く済むようにする．
+     */
+    struct PortIndexEntry {
+      uint32_t key;
+      uint8_t slot_id;
+    };
+    static const size_t kPortIndexBits = 9;
+    std::array<PortIndexEntry, 1u << kPortIndexBits> port_index_{};
+    /** @brief スロットごとの索引の key．0 なら未登録 */
+    std::array<uint32_t, 256> port_keys_{};
+
+    /** @brief ハブの子デバイスのリスト（スロット ID の片方向リスト）と親のスロット ID */
+    std::array<uint8_t, 256> first_child_{};
+    std::array<uint8_t, 256> next_sibling_{};
+    std::array<uint8_t, 256> parent_hub_{};
+
+    /** @brief key を持つ要素の添字を返す．なければ -1． */
+    int FindPortIndexEntry(uint32_t key) const;
+    void RemovePortIndexEntry(size_t index);
+    void UnlinkChild(uint8_t slot_id);
   };
 }
@@ -0,0 +1,109 @@
+#include "usb/xhci/moderation.hpp"
+
+#include <algorithm>
+#include "logger.hpp"
+#include "timer.hpp"
+
+namespace {
+  /** @brief 統計を集計する期間（tick）．1 秒． */
+  const unsigned long kWindowTicks = kTimerFreq;
+
+  /** @brief 現在の tick．xHC はタイマより先に初期化されるので，それまでは 0 を返す． */
+  unsigned long CurrentTick() {
+    return timer_manager ? timer_manager->CurrentTick() : 0;
+  }
+
+  uint64_t PerSecond(uint64_t count, unsigned long ticks) {
+    return count * kTimerFreq / ticks;
+  }
+}
+
+namespace usb::xhci {
+  void InterruptModerator::Initialize(InterrupterRegisterSet* interrupter,
+                                      const ModerationPolicy& policy) {
+    interrupter_ = interrupter;
+    stats_ = {};
+    StartWindow(CurrentTick());
+    SetPolicy(policy);
+  }
+
+  void InterruptModerator::SetPolicy(const ModerationPolicy& policy) {
+    policy_ = policy;
+    if (policy_.min_interval > policy_.max_interval) {
+      std::swap(policy_.min_interval, policy_.max_interval);
+    }
+    WriteInterval(policy_.interval);
+  }
+
+  void InterruptModerator::OnEventsProcessed(int num_events) {
+    UpdateStats(CurrentTick());
+    ++window_batches_;
+    window_events_ += num_events;
+    window_max_batch_ = std::max(window_max_batch_, num_events);
+
+    if (policy_.mode != ModerationPolicy::Mode::kAdaptive) {
+      return;
+    }
+
+    int interval = interval_;
+    if (num_events >= policy_.high_watermark) {
+      interval = std::max(interval * 2, 1);
+    } else if (num_events <= policy_.low_watermark) {
+      interval /= 2;
+    } else {
+      return;
+    }
+    interval = std::clamp<int>(interval, policy_.min_interval, policy_.max_interval);
+
+    if (interval != interval_) {
+      Log(kDebug, "IMODI: %u -> %d (%d events)\n",
+          interval_, interval, num_events);
+      WriteInterval(interval);
+      ++window_interval_changes_;
+    }
+  }
+
+  void InterruptModerator::WriteInterval(uint16_t interval) {
+    interval_ = interval;
+    if (interrupter_ == nullptr) {
+      return;
+    }
+
+    auto imod = interrupter_->IMOD.Read();
+    imod.bits.interrupt_moderation_interval = interval;
+    imod.bits.interrupt_moderation_counter = 0;
+    interrupter_->IMOD.Write(imod);
+  }
+
+  void InterruptModerator::UpdateStats(unsigned long now) {
+    const unsigned long ticks = now - window_start_;
+    if (ticks < kWindowTicks) {
+      return;
+    }
+
+    const uint64_t interrupts = interrupts_;
+    stats_.ticks = ticks;
+    stats_.interrupts_per_sec = PerSecond(interrupts - window_interrupts_base_, ticks);
+    stats_.batches_per_sec = PerSecond(window_batches_, ticks);
+    stats_.events_per_sec = PerSecond(window_events_, ticks);
+    stats_.max_batch = window_max_batch_;
+    stats_.interval = interval_;
+    stats_.interval_changes = window_interval_changes_;
+
+    Log(kDebug, "IMOD stats: %lu intr/s, %lu batches/s, %lu events/s, "
+        "max batch %d, IMODI %u (%d changes) over %lu ticks\n",
+        stats_.interrupts_per_sec, stats_.batches_per_sec, stats_.events_per_sec,
+        stats_.max_batch, stats_.interval, stats_.interval_changes, ticks);
+
+    StartWindow(now);
+  }
+
+  void InterruptModerator::StartWindow(unsigned long now) {
+    window_start_ = now;
+    window_interrupts_base_ = interrupts_;
+    window_batches_ = 0;
+    window_events_ = 0;
+    window_max_batch_ = 0;
+    window_interval_changes_ = 0;
+  }
+}  // namespace usb::xhci
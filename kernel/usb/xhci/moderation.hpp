@@ -0,0 +1,118 @@
+/**
+ * @file usb/xhci/moderation.hpp
+ *
+ * インタラプタの割り込みモデレーション（IMOD）制御．
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "usb/xhci/registers.hpp"
+
+namespace usb::xhci {
+  /** @brief 割り込みモデレーションの方針．
+   *
+   * 間隔はすべて IMODI と同じ 250 ナノ秒単位で指定する．
+   * 間隔を広げると割り込み回数が減る代わりに，イベントの通知が最大で
+   * その間隔だけ遅れる．
+   */
+  struct ModerationPolicy {
+    enum class Mode {
+      /** interval を固定で使う */
+      kFixed,
+      /** イベントリングの混み具合に応じて min_interval から max_interval の間で調整する */
+      kAdaptive,
+    } mode;
+
+    /** 初期の間隔．kFixed ではこの値を使い続ける． */
+    uint16_t interval;
+    uint16_t min_interval;
+    uint16_t max_interval;
+
+    /** 1 回の読み出しで処理したイベント数がこれ以上なら間隔を 2 倍に広げる */
+    int high_watermark;
+    /** 1 回の読み出しで処理したイベント数がこれ以下なら間隔を半分に狭める */
+    int low_watermark;
+  };
+
+  /** @brief 既定の方針．空いている間は 10 マイクロ秒，混雑時は最大 1 ミリ秒． */
+  constexpr ModerationPolicy kDefaultModerationPolicy{
+      ModerationPolicy::Mode::kAdaptive, 40, 40, 4000, 8, 1};
+
+  /** @brief 割り込み頻度の統計情報．
+   *
+   * 約 1 秒の集計期間ごとの計数を，1 秒あたりの値に換算したもの．
+   */
+  struct ModerationStats {
+    /** 集計期間の長さ（tick） */
+    unsigned long ticks;
+    /** 1 秒あたりの割り込みの数 */
+    uint64_t interrupts_per_sec;
+    /** 1 秒あたりのイベントリング読み出し回数 */
+    uint64_t batches_per_sec;
+    /** 1 秒あたりに処理したイベントの数 */
+    uint64_t events_per_sec;
+    /** 1 回の読み出しで処理したイベント数の最大値 */
+    int max_batch;
+    /** 集計期間の終わりに設定されていた IMODI */
+    uint16_t interval;
+    /** 集計期間中に適応制御が IMODI を変更した回数 */
+    int interval_changes;
+  };
+
+  /** @brief 1 つのインタラプタの割り込みモデレーション間隔を管理するクラス． */
+  class InterruptModerator {
+   public:
+    /** @brief 対象のインタラプタと方針を設定し，IMOD レジスタに書き込む． */
+    void Initialize(InterrupterRegisterSet* interrupter,
+                    const ModerationPolicy& policy);
+
+    /** @brief 方針を変更する．間隔は policy.interval から再開する． */
+    void SetPolicy(const ModerationPolicy& policy);
+    const ModerationPolicy& Policy() const { return policy_; }
+
+    /** @brief 割り込みを受け付けたことを記録する．割り込みハンドラから呼ぶ．
+     *
+     * interrupts_ は割り込みハンドラだけが書き換え，メインループ側は読むだけにする．
+     */
+    void OnInterrupt() { ++interrupts_; }
+
+    /** @brief イベントリングを読み出し終えたことを通知する．
+     *
+     * kAdaptive のときは num_events に応じて間隔を調整する．
+     * 集計期間が過ぎていれば統計を確定し，ログに出力する．
+     *
+     * @param num_events  今回の読み出しで処理したイベントの数
+     */
+    void OnEventsProcessed(int num_events);
+
+    /** @brief 直近に確定した集計期間の統計．まだ 1 期間も経っていなければすべて 0． */
+    const ModerationStats& Stats() const { return stats_; }
+
+   private:
+    InterrupterRegisterSet* interrupter_{nullptr};
+    ModerationPolicy policy_{kDefaultModerationPolicy};
+    /** @brief 現在設定されている IMODI */
+    uint16_t interval_{0};
+
+    /** @brief 受け付けた割り込みの累計 */
+    volatile uint64_t interrupts_{0};
+
+    /** @brief 集計中の期間の開始 tick と，その時点の interrupts_ */
+    unsigned long window_start_{0};
+    uint64_t window_interrupts_base_{0};
+    /** @brief 集計中の期間の計数 */
+    uint64_t window_batches_{0};
+    uint64_t window_events_{0};
+    int window_max_batch_{0};
+    int window_interval_changes_{0};
+
+    ModerationStats stats_{};
+
+    void WriteInterval(uint16_t interval);
+    /** @brief 集計期間が過ぎていれば stats_ を更新して次の期間を始める． */
+    void UpdateStats(unsigned long now);
+    void StartWindow(unsigned long now);
+  };
+}
@@ -33,8 +33,6 @@ namespace usb::xhci {
     portsc.data[0] &= 0x0e00c3e0u;
     portsc.data[0] |= 0x00020010u;  // Write 1 to PR and CSC
     port_reg_set_.PORTSC.Write(portsc);
-    while (port_reg_set_.PORTSC.Read().bits.port_reset)
-      ;
     return MAKE_ERROR(Error::kSuccess);
   }
 
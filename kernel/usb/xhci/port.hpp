@@ -36,6 +36,12 @@ namespace usb::xhci {
     bool IsConnectStatusChanged() const;
     bool IsPortResetChanged() const;
     int Speed() const;
+
+    /** @brief ポートリセットを開始する．
+     *
+     * リセットの完了は待たない．完了すると PRC ビットが立ち，
+     * Port Status Change Event が発生する．
+     */
     Error Reset();
     Device* Initialize();
 
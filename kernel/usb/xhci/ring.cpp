@@ -1,5 +1,6 @@
 #include "usb/xhci/ring.hpp"
 
+#include <algorithm>
 #include <cstring>
 #include "usb/memory.hpp"
 
@@ -17,6 +18,7 @@ namespace usb::xhci {
 
     cycle_bit_ = true;
     write_index_ = 0;
+    read_index_ = 0;
     buf_size_ = buf_size;
 
     buf_ = AllocArray<TRB>(buf_size_, 64, 64 * 1024);
@@ -37,6 +39,10 @@ namespace usb::xhci {
   }
 
   TRB* Ring::Push(const std::array<uint32_t, 4>& data) {
+    if (NumFreeTRBs() == 0) {
+      return nullptr;
+    }
+
     auto trb_ptr = &buf_[write_index_];
     CopyToLast(data);
 
@@ -44,6 +50,8 @@ namespace usb::xhci {
     if (write_index_ == buf_size_ - 1) {
       LinkTRB link{buf_};
       link.bits.toggle_cycle = true;
+      // TD の途中でリング末尾に達したら，LinkTRB も TD の一部として連結する
+      link.bits.chain_bit = (data[3] >> 4) & 1u;
       CopyToLast(link.data);
 
       write_index_ = 0;
@@ -54,36 +62,45 @@ namespace usb::xhci {
   }
 
   Error EventRing::Initialize(size_t buf_size,
-                              InterrupterRegisterSet* interrupter) {
-    if (buf_ != nullptr) {
-      FreeMem(buf_);
+                              InterrupterRegisterSet* interrupter,
+                              size_t num_segments) {
+    if (erst_ != nullptr) {
+      for (size_t i = 0; i < num_segments_; ++i) {
+        FreeMem(SegmentBegin(i));
+      }
+      FreeMem(erst_);
     }
 
     cycle_bit_ = true;
     buf_size_ = buf_size;
+    num_segments_ = std::max<size_t>(1, std::min(num_segments, kMaxSegments));
     interrupter_ = interrupter;
 
-    buf_ = AllocArray<TRB>(buf_size_, 64, 64 * 1024);
-    if (buf_ == nullptr) {
-      return MAKE_ERROR(Error::kNoEnoughMemory);
-    }
-    memset(buf_, 0, buf_size_ * sizeof(TRB));
-
-    erst_ = AllocArray<EventRingSegmentTableEntry>(1, 64, 64 * 1024);
+    erst_ = AllocArray<EventRingSegmentTableEntry>(num_segments_, 64, 64 * 1024);
     if (erst_ == nullptr) {
-      FreeMem(buf_);
       return MAKE_ERROR(Error::kNoEnoughMemory);
     }
-    memset(erst_, 0, 1 * sizeof(EventRingSegmentTableEntry));
-
-    erst_[0].bits.ring_segment_base_address = reinterpret_cast<uint64_t>(buf_);
-    erst_[0].bits.ring_segment_size = buf_size_;
+    memset(erst_, 0, num_segments_ * sizeof(EventRingSegmentTableEntry));
+
+    // セグメントは個別に確保する．各セグメントは 64KiB 境界を跨いではならない．
+    for (size_t i = 0; i < num_segments_; ++i) {
+      auto segment = AllocArray<TRB>(buf_size_, 64, 64 * 1024);
+      if (segment == nullptr) {
+        return MAKE_ERROR(Error::kNoEnoughMemory);
+      }
+      memset(segment, 0, buf_size_ * sizeof(TRB));
+
+      erst_[i].bits.ring_segment_base_address = reinterpret_cast<uint64_t>(segment);
+      erst_[i].bits.ring_segment_size = buf_size_;
+    }
 
     ERSTSZ_Bitmap erstsz = interrupter_->ERSTSZ.Read();
-    erstsz.SetSize(1);
+    erstsz.SetSize(num_segments_);
     interrupter_->ERSTSZ.Write(erstsz);
 
-    WriteDequeuePointer(&buf_[0]);
+    dequeue_ = SegmentBegin(0);
+    segment_index_ = 0;
+    WriteDequeuePointer(dequeue_, segment_index_, false);
 
     ERSTBA_Bitmap erstba = interrupter_->ERSTBA.Read();
     erstba.SetPointer(reinterpret_cast<uint64_t>(erst_));
@@ -92,23 +109,30 @@ namespace usb::xhci {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  void EventRing::WriteDequeuePointer(TRB* p) {
+  void EventRing::WriteDequeuePointer(TRB* p, size_t segment_index,
+                                      bool clear_busy) {
     auto erdp = interrupter_->ERDP.Read();
     erdp.SetPointer(reinterpret_cast<uint64_t>(p));
+    erdp.bits.dequeue_erst_segment_index = segment_index;
+    // EHB は 1 を書き込むとクリアされる (RW1C)
+    erdp.bits.event_handler_busy = clear_busy;
     interrupter_->ERDP.Write(erdp);
   }
 
   void EventRing::Pop() {
-    auto p = ReadDequeuePointer() + 1;
-
-    TRB* segment_begin = reinterpret_cast<TRB*>(erst_[0].bits.ring_segment_base_address);
-    TRB* segment_end = segment_begin + erst_[0].bits.ring_segment_size;
-
-    if (p == segment_end) {
-      p = segment_begin;
-      cycle_bit_ = !cycle_bit_;
+    ++dequeue_;
+
+    if (dequeue_ == SegmentBegin(segment_index_) + buf_size_) {
+      ++segment_index_;
+      if (segment_index_ == num_segments_) {
+        segment_index_ = 0;
+        cycle_bit_ = !cycle_bit_;
+      }
+      dequeue_ = SegmentBegin(segment_index_);
     }
+  }
 
-    WriteDequeuePointer(p);
+  void EventRing::Flush() {
+    WriteDequeuePointer(dequeue_, segment_index_, true);
   }
 }  // namespace usb::xhci
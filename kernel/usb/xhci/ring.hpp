@@ -29,6 +29,7 @@ namespace usb::xhci {
     /** @brief TRB に cycle bit を設定した上でリング末尾に追加する．
      *
      * @return 追加された（リング上の）TRB を指すポインタ．
+     *   リングに空きがなければ何も書き込まずに nullptr を返す．
      */
     template <typename TRBType>
     TRB* Push(const TRBType& trb) {
@@ -37,6 +38,52 @@ namespace usb::xhci {
 
     TRB* Buffer() const { return buf_; }
 
+    /** @brief リングの TRB 数（LinkTRB の分を含む） */
+    size_t Size() const { return buf_size_; }
+
+    /** @brief trb がリング上の何番目の TRB かを返す．リング外の TRB なら -1 を返す． */
+    int IndexOf(const TRB* trb) const {
+      if (trb < buf_ || buf_ + buf_size_ <= trb) {
+        return -1;
+      }
+      return trb - buf_;
+    }
+
+    /** @brief これから n 個目（0 なら次）に TRB を書き込む位置．LinkTRB は飛ばして数える． */
+    TRB* EnqueuePointer(size_t n = 0) const {
+      return &buf_[(write_index_ + n) % (buf_size_ - 1)];
+    }
+    /** @brief 次に書き込む TRB に設定する cycle bit */
+    bool CycleBit() const { return cycle_bit_; }
+
+    /** @brief あと何個の TRB を追加できるか．
+     *
+     * xHC が処理を終えた位置は MarkConsumed と SetDequeuePointer で
+     * 知らされた分だけ進む．書き込み位置が追いつかないよう 1 つは空けておく．
+     */
+    size_t NumFreeTRBs() const {
+      const size_t usable = buf_size_ - 1;  // LinkTRB を除く
+      const size_t used = (write_index_ + usable - read_index_) % usable;
+      return usable - 1 - used;
+    }
+
+    /** @brief xHC が次に処理する（とソフトウェアが知っている）TRB の位置 */
+    TRB* DequeuePointer() const { return &buf_[read_index_]; }
+
+    /** @brief xHC が trb まで処理し終えたことを記録する． */
+    void MarkConsumed(const TRB* trb) {
+      if (const int i = IndexOf(trb); i >= 0) {
+        read_index_ = (i + 1) % (buf_size_ - 1);
+      }
+    }
+
+    /** @brief xHC が次に処理する TRB の位置を p にする． */
+    void SetDequeuePointer(const TRB* p) {
+      if (const int i = IndexOf(p); i >= 0) {
+        read_index_ = i % (buf_size_ - 1);
+      }
+    }
+
    private:
     TRB* buf_ = nullptr;
     size_t buf_size_ = 0;
@@ -45,6 +92,8 @@ namespace usb::xhci {
     bool cycle_bit_;
     /** @brief リング上で次に書き込む位置 */
     size_t write_index_;
+    /** @brief xHC が次に処理する（とソフトウェアが知っている）位置 */
+    size_t read_index_;
 
     /** @brief TRB に cycle bit を設定した上でリング末尾に書き込む．
      *
@@ -56,7 +105,8 @@ namespace usb::xhci {
      *
      * write_index_ をインクリメントする．その結果 write_index_ がリング末尾
      * に達したら LinkTRB を適切に配置して write_index_ を 0 に戻し，
-     * cycle bit を反転させる．
+     * cycle bit を反転させる．追加した TRB の chain bit が立っていれば
+     * LinkTRB の chain bit も立てる．
      *
      * @return 追加された（リング上の）TRB を指すポインタ．
      */
@@ -75,32 +125,61 @@ namespace usb::xhci {
     } __attribute__((packed)) bits;
   };
 
+  /** @brief Event Ring を表すクラス．
+   *
+   * 複数のセグメントから成るリングに対応する．セグメントは ERST に登録した
+   * 順に読み進め，最後のセグメントの末尾で先頭に戻ると cycle bit が反転する．
+   *
+   * デキューポインタはソフトウェア側で保持し，Pop では ERDP を更新しない．
+   * 溜まったイベントを読み終えたら Flush で ERDP をまとめて更新する．
+   */
   class EventRing {
    public:
-    Error Initialize(size_t buf_size, InterrupterRegisterSet* interrupter);
-
-    TRB* ReadDequeuePointer() const {
-      return reinterpret_cast<TRB*>(interrupter_->ERDP.Read().Pointer());
-    }
+    /** @brief 1 つのインタラプタに登録するセグメント数の上限 */
+    static constexpr size_t kMaxSegments = 8;
 
-    void WriteDequeuePointer(TRB* p);
+    /** @brief リングのメモリ領域を割り当て，インタラプタに登録する．
+     *
+     * @param buf_size  1 セグメントあたりの TRB 数
+     * @param interrupter  登録先のインタラプタ
+     * @param num_segments  セグメント数．1 以上 kMaxSegments 以下に制限される．
+     */
+    Error Initialize(size_t buf_size, InterrupterRegisterSet* interrupter,
+                     size_t num_segments = 1);
 
     bool HasFront() const {
       return Front()->bits.cycle_bit == cycle_bit_;
     }
 
     TRB* Front() const {
-      return ReadDequeuePointer();
+      return dequeue_;
     }
 
+    /** @brief 先頭のイベントを取り除く．ERDP は更新しない． */
     void Pop();
 
+    /** @brief 現在のデキューポインタを ERDP に書き込み，EHB をクリアする． */
+    void Flush();
+
+    size_t NumSegments() const { return num_segments_; }
+
    private:
-    TRB* buf_;
-    size_t buf_size_;
+    /** @brief 1 セグメントあたりの TRB 数 */
+    size_t buf_size_ = 0;
+    size_t num_segments_ = 0;
 
     bool cycle_bit_;
-    EventRingSegmentTableEntry* erst_;
-    InterrupterRegisterSet* interrupter_;
+    /** @brief 次に読むイベントの位置と，それが属するセグメントの番号 */
+    TRB* dequeue_ = nullptr;
+    size_t segment_index_ = 0;
+
+    EventRingSegmentTableEntry* erst_ = nullptr;
+    InterrupterRegisterSet* interrupter_ = nullptr;
+
+    TRB* SegmentBegin(size_t index) const {
+      return reinterpret_cast<TRB*>(erst_[index].bits.ring_segment_base_address);
+    }
+
+    void WriteDequeuePointer(TRB* p, size_t segment_index, bool clear_busy);
   };
 }
@@ -194,6 +194,39 @@ namespace usb::xhci {
     }
   };
 
+  union EventDataTRB {
+    static const unsigned int Type = 7;
+    std::array<uint32_t, 4> data{};
+    struct {
+      uint64_t event_data;
+
+      uint32_t : 22;
+      uint32_t interrupter_target : 10;
+
+      uint32_t cycle_bit : 1;
+      uint32_t evaluate_next_trb : 1;
+      uint32_t : 2;
+      uint32_t chain_bit : 1;
+      uint32_t interrupt_on_completion : 1;
+      uint32_t : 3;
+      uint32_t block_event_interrupt : 1;
+      uint32_t trb_type : 6;
+      uint32_t : 16;
+    } __attribute__((packed)) bits;
+
+    EventDataTRB() {
+      bits.trb_type = Type;
+    }
+
+    void* Pointer() const {
+      return reinterpret_cast<void*>(bits.event_data);
+    }
+
+    void SetPointer(const void* p) {
+      bits.event_data = reinterpret_cast<uint64_t>(p);
+    }
+  };
+
   union NoOpTRB {
     static const unsigned int Type = 8;
     std::array<uint32_t, 4> data{};
@@ -240,6 +273,29 @@ namespace usb::xhci {
     }
   };
 
+  union DisableSlotCommandTRB {
+    static const unsigned int Type = 10;
+    std::array<uint32_t, 4> data{};
+    struct {
+      uint32_t : 32;
+
+      uint32_t : 32;
+
+      uint32_t : 32;
+
+      uint32_t cycle_bit : 1;
+      uint32_t : 9;
+      uint32_t trb_type : 6;
+      uint32_t : 8;
+      uint32_t slot_id : 8;
+    } __attribute__((packed)) bits;
+
+    DisableSlotCommandTRB(uint8_t slot_id) {
+      bits.trb_type = Type;
+      bits.slot_id = slot_id;
+    }
+  };
+
   union AddressDeviceCommandTRB {
     static const unsigned int Type = 11;
     std::array<uint32_t, 4> data{};
@@ -304,6 +360,36 @@ namespace usb::xhci {
     }
   };
 
+  union ResetEndpointCommandTRB {
+    static const unsigned int Type = 14;
+    std::array<uint32_t, 4> data{};
+    struct {
+      uint32_t : 32;
+
+      uint32_t : 32;
+
+      uint32_t : 32;
+
+      uint32_t cycle_bit : 1;
+      uint32_t : 8;
+      uint32_t transfer_state_preserve : 1;
+      uint32_t trb_type : 6;
+      uint32_t endpoint_id : 5;
+      uint32_t : 3;
+      uint32_t slot_id : 8;
+    } __attribute__((packed)) bits;
+
+    ResetEndpointCommandTRB(EndpointID endpoint_id, uint8_t slot_id) {
+      bits.trb_type = Type;
+      bits.endpoint_id = endpoint_id.Address();
+      bits.slot_id = slot_id;
+    }
+
+    EndpointID EndpointID() const {
+      return usb::EndpointID{bits.endpoint_id};
+    }
+  };
+
   union StopEndpointCommandTRB {
     static const unsigned int Type = 15;
     std::array<uint32_t, 4> data{};
@@ -334,6 +420,47 @@ namespace usb::xhci {
     }
   };
 
+  union SetTRDequeuePointerCommandTRB {
+    static const unsigned int Type = 16;
+    std::array<uint32_t, 4> data{};
+    struct {
+      uint64_t dequeue_cycle_state : 1;
+      uint64_t stream_context_type : 3;
+      uint64_t new_tr_dequeue_pointer : 60;
+
+      uint32_t : 16;
+      uint32_t stream_id : 16;
+
+      uint32_t cycle_bit : 1;
+      uint32_t : 9;
+      uint32_t trb_type : 6;
+      uint32_t endpoint_id : 5;
+      uint32_t : 3;
+      uint32_t slot_id : 8;
+    } __attribute__((packed)) bits;
+
+    SetTRDequeuePointerCommandTRB(const TRB* dequeue, bool cycle_state,
+                                  EndpointID endpoint_id, uint8_t slot_id) {
+      bits.trb_type = Type;
+      bits.dequeue_cycle_state = cycle_state;
+      bits.endpoint_id = endpoint_id.Address();
+      bits.slot_id = slot_id;
+      SetPointer(dequeue);
+    }
+
+    TRB* Pointer() const {
+      return reinterpret_cast<TRB*>(bits.new_tr_dequeue_pointer << 4);
+    }
+
+    void SetPointer(const TRB* p) {
+      bits.new_tr_dequeue_pointer = reinterpret_cast<uint64_t>(p) >> 4;
+    }
+
+    EndpointID EndpointID() const {
+      return usb::EndpointID{bits.endpoint_id};
+    }
+  };
+
   union NoOpCommandTRB {
     static const unsigned int Type = 23;
     std::array<uint32_t, 4> data{};
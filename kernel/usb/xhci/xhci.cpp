@@ -1,7 +1,10 @@
 #include "usb/xhci/xhci.hpp"
 
+#include <algorithm>
 #include <cstring>
 #include "logger.hpp"
+#include "queue.hpp"
+#include "usb/classdriver/hub.hpp"
 #include "usb/descriptor.hpp"
 #include "usb/device.hpp"
 #include "usb/setupdata.hpp"
@@ -28,26 +31,140 @@ namespace {
     kAddressingDevice,
     kInitializingDevice,
     kConfiguringEndpoints,
+    kConfiguringHub,
     kConfigured,
+    kDisablingSlot,
   };
-  /* root hub port はリセット処理をしてからアドレスを割り当てるまでは
-   * 他の処理を挟まず，そのポートについての処理だけをしなければならない．
-   * kWaitingAddressed はリセット（kResettingPort）からアドレス割り当て
-   * （kAddressingDevice）までの一連の処理の実行を待っている状態．
+  /* ポート（ルートハブのポートとハブのダウンストリームポート）はリセット
+   * してからアドレスを割り当てるまでは他の処理を挟まず，そのポートについての
+   * 処理だけをしなければならない．リセット直後のデバイスはどれもアドレス 0
+   * で応答するため．kWaitingAddressed はリセット（kResettingPort）から
+   * アドレス割り当て（kAddressingDevice）までの一連の処理の実行を待っている状態．
+   * アドレス割り当て後のディスクリプタ取得やエンドポイント設定は
+   * 複数のデバイスで並行して進めてよく，その進み具合はスロットごとに管理する．
    */
 
-  std::array<volatile ConfigPhase, 256> port_config_phase{};  // index: port number
+  std::array<volatile ConfigPhase, 256> port_config_phase{};  // index: root hub port number
+  std::array<volatile ConfigPhase, 256> slot_config_phase{};  // index: slot ID
 
-  /** kResettingPort から kAddressingDevice までの処理を実行中のポート番号．
-   * 0 ならその状態のポートがないことを示す．
+  /** @brief リセットからアドレス割り当てまでの排他区間を待つ接続要求 */
+  struct AttachRequest {
+    uint8_t root_port;      // ルートハブのポート番号
+    uint32_t route_string;  // ルートハブから見た経路（ハブ 1 段につき 4 ビット）
+    usb::HubDriver* hub;    // 直接の接続先のハブ．ルートハブなら nullptr
+    uint8_t hub_slot_id;    // hub のスロット ID
+    uint8_t hub_port;       // hub のダウンストリームポート番号
+  };
+
+  /** 排他区間を待つ接続要求の FIFO．
+   * 排他区間が空くと先頭から順に取り出してリセットを始める．
    */
-  uint8_t addressing_port{0};
+  std::array<AttachRequest, 32> attach_request_buf{};
+  ArrayQueue<AttachRequest> attach_requests{attach_request_buf};
+
+  /** kResettingPort から kAddressingDevice までの処理を実行中の接続要求．
+   * attaching が false ならその状態の要求がないことを示す．
+   */
+  bool attaching{false};
+  AttachRequest current_attach{};
+  int current_attach_speed{0};
+  /** current_attach について Enable Slot コマンドを発行済みなら true */
+  bool current_attach_slot_requested{false};
+  /** current_attach のデバイスが処理中に取り外されたら true */
+  bool current_attach_removed{false};
+
+  /** @brief ルートストリング中のポート番号の段数 */
+  int RouteDepth(uint32_t route_string) {
+    int depth = 0;
+    while (depth < 5 && ((route_string >> (4 * depth)) & 0xfu) != 0) {
+      ++depth;
+    }
+    return depth;
+  }
+
+  /** @brief ハブのダウンストリームポートのルートストリングを求める */
+  WithError<uint32_t> HubPortRouteString(Device& hub_dev, int port_num) {
+    const auto& hub_slot = hub_dev.DeviceContext()->slot_context.bits;
+
+    // ルートストリングの 1 段は 4 ビットなので，ポート 16 以降は表せない
+    if (port_num < 1 || 15 < port_num) {
+      Log(kWarn, "HubPortRouteString: ignoring port %d of hub slot %d\n",
+          port_num, hub_dev.SlotID());
+      return {0, MAKE_ERROR(Error::kIndexOutOfRange)};
+    }
+
+    // ルートストリングの空いている最初の 4 ビットが次の段になる
+    const int depth = RouteDepth(hub_slot.route_string);
+    if (depth >= 5) {
+      Log(kWarn, "HubPortRouteString: too many hub tiers (slot %d)\n", hub_dev.SlotID());
+      return {0, MAKE_ERROR(Error::kNotImplemented)};
+    }
+    return {
+      hub_slot.route_string | (static_cast<uint32_t>(port_num) << (4 * depth)),
+      MAKE_ERROR(Error::kSuccess)
+    };
+  }
+
+  /** @brief デバイスのクラスドライバを破棄し，スロットの無効化を xHC に要求する．
+   *
+   * DeviceManager からは Disable Slot コマンドの完了を待って取り除く．
+   */
+  Error DisableSlot(Controller& xhc, uint8_t slot_id) {
+    if (auto dev = xhc.DeviceManager()->FindBySlot(slot_id)) {
+      dev->DestroyClassDrivers();
+    }
+    slot_config_phase[slot_id] = ConfigPhase::kDisablingSlot;
+
+    DisableSlotCommandTRB cmd{slot_id};
+    xhc.CommandRing()->Push(cmd);
+    xhc.RingCommandDoorbell();
+    return MAKE_ERROR(Error::kSuccess);
+  }
 
-  void InitializeSlotContext(SlotContext& ctx, Port& port) {
-    ctx.bits.route_string = 0;
-    ctx.bits.root_hub_port_num = port.Number();
+  /** @brief デバイスと，それがハブなら配下のすべてのデバイスのスロットを無効化する． */
+  void DisableSubtree(Controller& xhc, uint8_t slot_id) {
+    if (slot_config_phase[slot_id] == ConfigPhase::kDisablingSlot ||
+        slot_config_phase[slot_id] == ConfigPhase::kAddressingDevice) {
+      return;  // アドレス割り当て中のデバイスは current_attach_removed で扱う
+    }
+
+    // 子の一覧は Disable Slot の完了（DeviceManager::Remove）まで残る
+    auto devmgr = xhc.DeviceManager();
+    for (uint8_t child = devmgr->FirstChild(slot_id); child != 0;
+         child = devmgr->NextSibling(child)) {
+      DisableSubtree(xhc, child);
+    }
+    Log(kInfo, "DisableSubtree: slot %d is removed\n", slot_id);
+    DisableSlot(xhc, slot_id);
+  }
+
+  void InitializeSlotContext(Controller& xhc, SlotContext& ctx,
+                             const AttachRequest& req, int speed) {
+    ctx.bits.route_string = req.route_string;
+    ctx.bits.root_hub_port_num = req.root_port;
     ctx.bits.context_entries = 1;
-    ctx.bits.speed = port.Speed();
+    ctx.bits.speed = speed;
+
+    if (req.hub == nullptr || (speed != kFullSpeed && speed != kLowSpeed)) {
+      return;
+    }
+
+    // LS/FS デバイスへの分割トランザクションは，経路上で最も近い
+    // HS ハブの Transaction Translator が担う
+    auto hub_dev = xhc.DeviceManager()->FindBySlot(req.hub_slot_id);
+    if (hub_dev == nullptr) {
+      return;
+    }
+    const auto& hub_slot = hub_dev->DeviceContext()->slot_context.bits;
+    if (hub_slot.speed == kHighSpeed) {
+      ctx.bits.tt_hub_slot_id = req.hub_slot_id;
+      ctx.bits.tt_port_num = req.hub_port;
+      ctx.bits.mtt = hub_slot.mtt;
+    } else {
+      ctx.bits.tt_hub_slot_id = hub_slot.tt_hub_slot_id;
+      ctx.bits.tt_port_num = hub_slot.tt_port_num;
+      ctx.bits.mtt = hub_slot.mtt;
+    }
   }
 
   unsigned int DetermineMaxPacketSizeForControlPipe(unsigned int slot_speed) {
@@ -87,6 +204,74 @@ namespace {
     ctx.bits.error_count = 3;
   }
 
+  Error IssueEnableSlot(Controller& xhc, int speed) {
+    current_attach_speed = speed;
+    current_attach_slot_requested = true;
+    if (current_attach.hub == nullptr) {
+      port_config_phase[current_attach.root_port] = ConfigPhase::kEnablingSlot;
+    }
+
+    EnableSlotCommandTRB cmd{};
+    xhc.CommandRing()->Push(cmd);
+    xhc.RingCommandDoorbell();
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  /** @brief 排他区間が空いていれば，待っている接続要求を 1 つ取り出して処理を始める．
+   *
+   * 既に有効化されている USB3 のルートハブのポートはリンクトレーニングを
+   * 終えているのでリセットを省略してスロットの割り当てに進む．
+   * それ以外のポートはリセットを開始し，完了を待つ．完了はルートハブなら
+   * Port Status Change Event，ハブならハブのステータス変化で通知される．
+   */
+  Error StartNextAttach(Controller& xhc) {
+    while (!attaching && attach_requests.Count() > 0) {
+      const auto req = attach_requests.Front();
+      attach_requests.Pop();
+
+      if (req.hub != nullptr) {
+        if (xhc.DeviceManager()->FindBySlot(req.hub_slot_id) == nullptr) {
+          continue;  // ハブが取り外された
+        }
+        attaching = true;
+        current_attach = req;
+        current_attach_slot_requested = false;
+        current_attach_removed = false;
+        if (auto err = req.hub->ResetPort(req.hub_port)) {
+          attaching = false;
+          Log(kError, "StartNextAttach: failed to reset hub port %d: %s\n",
+              req.hub_port, err.Name());
+          continue;
+        }
+        return MAKE_ERROR(Error::kSuccess);
+      }
+
+      auto port = xhc.PortAt(req.root_port);
+      if (port_config_phase[req.root_port] != ConfigPhase::kWaitingAddressed) {
+        continue;
+      }
+      if (!port.IsConnected()) {
+        port_config_phase[req.root_port] = ConfigPhase::kNotConnected;
+        continue;
+      }
+
+      attaching = true;
+      current_attach = req;
+      current_attach_slot_requested = false;
+      current_attach_removed = false;
+      const int speed = port.Speed();
+      if (port.IsEnabled() && (speed == kSuperSpeed || speed == kSuperSpeedPlus)) {
+        Log(kDebug, "StartNextAttach: port %d is already enabled\n", req.root_port);
+        port.ClearConnectStatusChanged();
+        return IssueEnableSlot(xhc, speed);
+      }
+
+      port_config_phase[req.root_port] = ConfigPhase::kResettingPort;
+      return port.Reset();
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
   Error ResetPort(Controller& xhc, Port& port) {
     const bool is_connected = port.IsConnected();
     Log(kDebug, "ResetPort: port.IsConnected() = %s\n",
@@ -96,19 +281,19 @@ namespace {
       return MAKE_ERROR(Error::kSuccess);
     }
 
-    if (addressing_port != 0) {
-      port_config_phase[port.Number()] = ConfigPhase::kWaitingAddressed;
-    } else {
-      const auto port_phase = port_config_phase[port.Number()];
-      if (port_phase != ConfigPhase::kNotConnected &&
-          port_phase != ConfigPhase::kWaitingAddressed) {
-        return MAKE_ERROR(Error::kInvalidPhase);
-      }
-      addressing_port = port.Number();
-      port_config_phase[port.Number()] = ConfigPhase::kResettingPort;
-      port.Reset();
+    const auto port_phase = port_config_phase[port.Number()];
+    if (port_phase == ConfigPhase::kWaitingAddressed) {
+      return MAKE_ERROR(Error::kSuccess);  // already queued
     }
-    return MAKE_ERROR(Error::kSuccess);
+    if (port_phase != ConfigPhase::kNotConnected) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+
+    if (auto err = attach_requests.Push(AttachRequest{port.Number(), 0, nullptr, 0, 0})) {
+      return err;
+    }
+    port_config_phase[port.Number()] = ConfigPhase::kWaitingAddressed;
+    return StartNextAttach(xhc);
   }
 
   Error EnableSlot(Controller& xhc, Port& port) {
@@ -120,20 +305,16 @@ namespace {
 
     if (is_enabled && reset_completed) {
       port.ClearPortResetChange();
-
-      port_config_phase[port.Number()] = ConfigPhase::kEnablingSlot;
-
-      EnableSlotCommandTRB cmd{};
-      xhc.CommandRing()->Push(cmd);
-      xhc.DoorbellRegisterAt(0)->Ring(0);
+      return IssueEnableSlot(xhc, port.Speed());
     }
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error AddressDevice(Controller& xhc, uint8_t port_id, uint8_t slot_id) {
-    Log(kDebug, "AddressDevice: port_id = %d, slot_id = %d\n", port_id, slot_id);
+  Error AddressDevice(Controller& xhc, uint8_t slot_id) {
+    Log(kDebug, "AddressDevice: root port = %d, route = %05x, slot_id = %d\n",
+        current_attach.root_port, current_attach.route_string, slot_id);
 
-    xhc.DeviceManager()->AllocDevice(slot_id, xhc.DoorbellRegisterAt(slot_id));
+    xhc.DeviceManager()->AllocDevice(slot_id, xhc.DoorbellRegisterAt(slot_id), &xhc);
 
     Device* dev = xhc.DeviceManager()->FindBySlot(slot_id);
     if (dev == nullptr) {
@@ -147,50 +328,60 @@ namespace {
     auto slot_ctx = dev->InputContext()->EnableSlotContext();
     auto ep0_ctx = dev->InputContext()->EnableEndpoint(ep0_dci);
 
-    auto port = xhc.PortAt(port_id);
-    InitializeSlotContext(*slot_ctx, port);
+    InitializeSlotContext(xhc, *slot_ctx, current_attach, current_attach_speed);
 
     InitializeEP0Context(
         *ep0_ctx, dev->AllocTransferRing(ep0_dci, 32),
         DetermineMaxPacketSizeForControlPipe(slot_ctx->bits.speed));
 
     xhc.DeviceManager()->LoadDCBAA(slot_id);
+    xhc.DeviceManager()->AssignPort(
+        slot_id, current_attach.root_port, current_attach.route_string,
+        current_attach.hub ? current_attach.hub_slot_id : 0);
 
-    port_config_phase[port_id] = ConfigPhase::kAddressingDevice;
+    if (current_attach.hub == nullptr) {
+      port_config_phase[current_attach.root_port] = ConfigPhase::kAddressingDevice;
+    }
+    slot_config_phase[slot_id] = ConfigPhase::kAddressingDevice;
 
     AddressDeviceCommandTRB addr_dev_cmd{dev->InputContext(), slot_id};
     xhc.CommandRing()->Push(addr_dev_cmd);
-    xhc.DoorbellRegisterAt(0)->Ring(0);
+    xhc.RingCommandDoorbell();
 
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error InitializeDevice(Controller& xhc, uint8_t port_id, uint8_t slot_id) {
-    Log(kDebug, "InitializeDevice: port_id = %d, slot_id = %d\n", port_id, slot_id);
+  Error InitializeDevice(Controller& xhc, uint8_t slot_id) {
+    Log(kDebug, "InitializeDevice: slot_id = %d\n", slot_id);
 
     auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
     if (dev == nullptr) {
       return MAKE_ERROR(Error::kInvalidSlotID);
     }
 
-    port_config_phase[port_id] = ConfigPhase::kInitializingDevice;
+    slot_config_phase[slot_id] = ConfigPhase::kInitializingDevice;
     dev->StartInitialize();
 
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error CompleteConfiguration(Controller& xhc, uint8_t port_id, uint8_t slot_id) {
-    Log(kDebug, "CompleteConfiguration: port_id = %d, slot_id = %d\n", port_id, slot_id);
+  Error CompleteConfiguration(Controller& xhc, uint8_t slot_id) {
+    Log(kDebug, "CompleteConfiguration: slot_id = %d\n", slot_id);
 
     auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
     if (dev == nullptr) {
       return MAKE_ERROR(Error::kInvalidSlotID);
     }
 
-    dev->OnEndpointsConfigured();
+    slot_config_phase[slot_id] = ConfigPhase::kConfigured;
+    const auto& slot_ctx = dev->DeviceContext()->slot_context.bits;
+    if (slot_ctx.route_string == 0) {
+      port_config_phase[slot_ctx.root_hub_port_num] = ConfigPhase::kConfigured;
+    }
 
-    port_config_phase[port_id] = ConfigPhase::kConfigured;
-    return MAKE_ERROR(Error::kSuccess);
+    // ハブのクラスドライバはここから ConfigureHub を呼ぶので，
+    // フェーズは先に進めておく
+    return dev->OnEndpointsConfigured();
   }
 
   Error OnEvent(Controller& xhc, PortStatusChangeEventTRB& trb) {
@@ -201,6 +392,8 @@ namespace {
     switch (port_config_phase[port_id]) {
       case ConfigPhase::kNotConnected:
         return ResetPort(xhc, port);
+      case ConfigPhase::kWaitingAddressed:
+        return MAKE_ERROR(Error::kSuccess);
       case ConfigPhase::kResettingPort:
         return EnableSlot(xhc, port);
       default:
@@ -214,13 +407,15 @@ namespace {
     if (dev == nullptr) {
       return MAKE_ERROR(Error::kInvalidSlotID);
     }
+    if (slot_config_phase[slot_id] == ConfigPhase::kDisablingSlot) {
+      return MAKE_ERROR(Error::kSuccess);  // 取り外されたデバイスの残りのイベント
+    }
     if (auto err = dev->OnTransferEventReceived(trb)) {
       return err;
     }
 
-    const auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
     if (dev->IsInitialized() &&
-        port_config_phase[port_id] == ConfigPhase::kInitializingDevice) {
+        slot_config_phase[slot_id] == ConfigPhase::kInitializingDevice) {
       return ConfigureEndpoints(xhc, *dev);
     }
     return MAKE_ERROR(Error::kSuccess);
@@ -229,54 +424,83 @@ namespace {
   Error OnEvent(Controller& xhc, CommandCompletionEventTRB& trb) {
     const auto issuer_type = trb.Pointer()->bits.trb_type;
     const auto slot_id = trb.bits.slot_id;
+    xhc.CommandRing()->MarkConsumed(trb.Pointer());
     Log(kDebug, "CommandCompletionEvent: slot_id = %d, issuer = %s\n",
         trb.bits.slot_id, kTRBTypeToName[issuer_type]);
 
     if (issuer_type == EnableSlotCommandTRB::Type) {
-      if (port_config_phase[addressing_port] != ConfigPhase::kEnablingSlot) {
+      if (!attaching) {
+        return MAKE_ERROR(Error::kInvalidPhase);
+      }
+      if (current_attach.hub == nullptr &&
+          port_config_phase[current_attach.root_port] != ConfigPhase::kEnablingSlot) {
         return MAKE_ERROR(Error::kInvalidPhase);
       }
+      if (current_attach_removed) {
+        attaching = false;
+        DisableSlot(xhc, slot_id);
+        return StartNextAttach(xhc);
+      }
 
-      return AddressDevice(xhc, addressing_port, slot_id);
+      return AddressDevice(xhc, slot_id);
     } else if (issuer_type == AddressDeviceCommandTRB::Type) {
       auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
       if (dev == nullptr) {
         return MAKE_ERROR(Error::kInvalidSlotID);
       }
 
-      auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
-
-      if (port_id != addressing_port) {
+      if (!attaching || slot_config_phase[slot_id] != ConfigPhase::kAddressingDevice) {
         return MAKE_ERROR(Error::kInvalidPhase);
       }
-      if (port_config_phase[port_id] != ConfigPhase::kAddressingDevice) {
-        return MAKE_ERROR(Error::kInvalidPhase);
+      if (current_attach.hub == nullptr) {
+        port_config_phase[current_attach.root_port] = ConfigPhase::kInitializingDevice;
       }
 
-      addressing_port = 0;
-      for (int i = 0; i < port_config_phase.size(); ++i) {
-        if (port_config_phase[i] == ConfigPhase::kWaitingAddressed) {
-          auto port = xhc.PortAt(i);
-          if (auto err = ResetPort(xhc, port); err) {
-            return err;
-          }
-          break;
-        }
+      // 排他区間を抜けたので次のポートのリセットを始め，
+      // このデバイスのディスクリプタ取得と並行して進める
+      attaching = false;
+      if (current_attach_removed) {
+        DisableSlot(xhc, slot_id);
+        return StartNextAttach(xhc);
+      }
+      if (auto err = StartNextAttach(xhc)) {
+        return err;
       }
 
-      return InitializeDevice(xhc, port_id, slot_id);
+      return InitializeDevice(xhc, slot_id);
     } else if (issuer_type == ConfigureEndpointCommandTRB::Type) {
       auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
       if (dev == nullptr) {
         return MAKE_ERROR(Error::kInvalidSlotID);
       }
 
-      auto port_id = dev->DeviceContext()->slot_context.bits.root_hub_port_num;
-      if (port_config_phase[port_id] != ConfigPhase::kConfiguringEndpoints) {
-        return MAKE_ERROR(Error::kInvalidPhase);
+      switch (slot_config_phase[slot_id]) {
+        case ConfigPhase::kConfiguringEndpoints:
+          return CompleteConfiguration(xhc, slot_id);
+        case ConfigPhase::kConfiguringHub:
+          slot_config_phase[slot_id] = ConfigPhase::kConfigured;
+          return MAKE_ERROR(Error::kSuccess);
+        case ConfigPhase::kDisablingSlot:
+          return MAKE_ERROR(Error::kSuccess);
+        default:
+          return MAKE_ERROR(Error::kInvalidPhase);
       }
-
-      return CompleteConfiguration(xhc, port_id, slot_id);
+    } else if (issuer_type == DisableSlotCommandTRB::Type) {
+      Log(kDebug, "CommandCompletionEvent: slot %d is disabled\n", slot_id);
+      xhc.DeviceManager()->Remove(slot_id);
+      slot_config_phase[slot_id] = ConfigPhase::kNotConnected;
+      return MAKE_ERROR(Error::kSuccess);
+    } else if (issuer_type == ResetEndpointCommandTRB::Type ||
+               issuer_type == StopEndpointCommandTRB::Type ||
+               issuer_type == SetTRDequeuePointerCommandTRB::Type) {
+      auto dev = xhc.DeviceManager()->FindBySlot(slot_id);
+      if (dev == nullptr) {
+        return MAKE_ERROR(Error::kInvalidSlotID);
+      }
+      if (slot_config_phase[slot_id] == ConfigPhase::kDisablingSlot) {
+        return MAKE_ERROR(Error::kSuccess);
+      }
+      return dev->OnEndpointCommandCompleted(trb.Pointer(), trb.bits.completion_code);
     }
 
     return MAKE_ERROR(Error::kInvalidPhase);
@@ -323,7 +547,7 @@ namespace usb::xhci {
             cap_->HCSPARAMS1.Read().bits.max_ports)} {
   }
 
-  Error Controller::Initialize() {
+  Error Controller::Initialize(int num_interrupters) {
     if (auto err = devmgr_.Initialize(kDeviceSize)) {
       return err;
     }
@@ -377,22 +601,39 @@ namespace usb::xhci {
     dcbaap.SetPointer(reinterpret_cast<uint64_t>(devmgr_.DeviceContexts()));
     op_->DCBAAP.Write(dcbaap);
 
-    auto primary_interrupter = &InterrupterRegisterSets()[0];
     if (auto err = cr_.Initialize(32)) {
       return err;
     }
     if (auto err = RegisterCommandRing(&cr_, &op_->CRCR)) {
       return err;
     }
-    if (auto err = er_.Initialize(32, primary_interrupter)) {
-      return err;
-    }
 
-    // Enable interrupt for the primary interrupter
-    auto iman = primary_interrupter->IMAN.Read();
-    iman.bits.interrupt_pending = true;
-    iman.bits.interrupt_enable = true;
-    primary_interrupter->IMAN.Write(iman);
+    const int max_interrupters = cap_->HCSPARAMS1.Read().bits.max_interrupters;
+    num_interrupters_ = std::max(1, std::min({num_interrupters,
+                                              kMaxInterrupters,
+                                              max_interrupters}));
+    Log(kDebug, "xHC: using %d of %d interrupters\n",
+        num_interrupters_, max_interrupters);
+
+    // ERST Max は ERST に登録できるエントリ数の log2
+    const size_t erst_max =
+        1u << cap_->HCSPARAMS2.Read().bits.event_ring_segment_table_max;
+    const size_t num_segments = std::min(kEventRingSegments, erst_max);
+
+    for (int i = 0; i < num_interrupters_; ++i) {
+      auto interrupter = &InterrupterRegisterSets()[i];
+      if (auto err = er_[i].Initialize(kEventRingSegmentSize, interrupter,
+                                       num_segments)) {
+        return err;
+      }
+      moderator_[i].Initialize(interrupter, kDefaultModerationPolicy);
+
+      // Enable interrupt for the interrupter
+      auto iman = interrupter->IMAN.Read();
+      iman.bits.interrupt_pending = true;
+      iman.bits.interrupt_enable = true;
+      interrupter->IMAN.Write(iman);
+    }
 
     // Enable interrupt for the controller
     usbcmd = op_->USBCMD.Read();
@@ -419,6 +660,32 @@ namespace usb::xhci {
     return &DoorbellRegisters()[index];
   }
 
+  void Controller::RingCommandDoorbell() {
+    if (doorbell_batch_depth_ > 0) {
+      command_doorbell_pending_ = true;
+    } else {
+      DoorbellRegisterAt(0)->Ring(0);
+    }
+  }
+
+  void Controller::BeginDoorbellBatch() {
+    if (doorbell_batch_depth_++ == 0) {
+      devmgr_.BeginBatch();
+    }
+  }
+
+  void Controller::EndDoorbellBatch() {
+    if (doorbell_batch_depth_ == 0 || --doorbell_batch_depth_ > 0) {
+      return;
+    }
+
+    if (command_doorbell_pending_) {
+      command_doorbell_pending_ = false;
+      DoorbellRegisterAt(0)->Ring(0);
+    }
+    devmgr_.EndBatch();
+  }
+
   Error ConfigurePort(Controller& xhc, Port& port) {
     if (port_config_phase[port.Number()] == ConfigPhase::kNotConnected) {
       return ResetPort(xhc, port);
@@ -436,8 +703,8 @@ namespace usb::xhci {
 
     auto slot_ctx = dev.InputContext()->EnableSlotContext();
     slot_ctx->bits.context_entries = 31;
-    const auto port_id{dev.DeviceContext()->slot_context.bits.root_hub_port_num};
-    const int port_speed{xhc.PortAt(port_id).Speed()};
+    // ハブ配下のデバイスもあるので，ルートハブのポートではなくスロットの速度を使う
+    const int port_speed = slot_ctx->bits.speed;
     if (port_speed == 0 || port_speed > kSuperSpeedPlus) {
       return MAKE_ERROR(Error::kUnknownXHCISpeedID);
     }
@@ -475,7 +742,13 @@ namespace usb::xhci {
       ep_ctx->bits.interval = convert_interval(configs[i].ep_type, configs[i].interval);
       ep_ctx->bits.average_trb_length = 1;
 
-      auto tr = dev.AllocTransferRing(ep_dci, 32);
+      if (configs[i].ep_type == EndpointType::kBulk) {
+        ep_ctx->bits.average_trb_length = 3072;
+      }
+
+      // バルク転送は 1 つの TD が多数の TRB から成るので大きめのリングを使う
+      auto tr = dev.AllocTransferRing(
+          ep_dci, configs[i].ep_type == EndpointType::kBulk ? 128 : 32);
       ep_ctx->SetTransferRingBuffer(tr->Buffer());
 
       ep_ctx->bits.dequeue_cycle_state = 1;
@@ -484,22 +757,130 @@ namespace usb::xhci {
       ep_ctx->bits.error_count = 3;
     }
 
-    port_config_phase[port_id] = ConfigPhase::kConfiguringEndpoints;
+    // バルク・アイソクロナス転送のイベントは専用のイベントリングに流し，
+    // 大量の転送完了イベントが入力デバイスのイベントを待たせないようにする
+    int interrupter = kPrimaryInterrupter;
+    if (xhc.NumInterrupters() > kBulkInterrupter) {
+      for (int i = 0; i < len; ++i) {
+        if (configs[i].ep_type == EndpointType::kBulk ||
+            configs[i].ep_type == EndpointType::kIsochronous) {
+          interrupter = kBulkInterrupter;
+          break;
+        }
+      }
+    }
+    slot_ctx->bits.interrupter_target = interrupter;
+    dev.SetInterrupterTarget(interrupter);
+
+    slot_config_phase[dev.SlotID()] = ConfigPhase::kConfiguringEndpoints;
+
+    ConfigureEndpointCommandTRB cmd{dev.InputContext(), dev.SlotID()};
+    xhc.CommandRing()->Push(cmd);
+    xhc.RingCommandDoorbell();
+
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error ConfigureHub(Controller& xhc, Device& dev,
+                     int num_ports, bool multi_tt, int think_time) {
+    if (slot_config_phase[dev.SlotID()] != ConfigPhase::kConfigured) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+
+    // スロットコンテキストだけを評価させ，エンドポイントは設定済みのまま残す
+    memset(&dev.InputContext()->input_control_context, 0, sizeof(InputControlContext));
+    memcpy(&dev.InputContext()->slot_context,
+           &dev.DeviceContext()->slot_context, sizeof(SlotContext));
+
+    auto slot_ctx = dev.InputContext()->EnableSlotContext();
+    slot_ctx->bits.hub = 1;
+    slot_ctx->bits.num_ports = num_ports;
+    if (slot_ctx->bits.speed == kHighSpeed) {
+      slot_ctx->bits.mtt = multi_tt;
+      slot_ctx->bits.ttt = think_time;
+    }
+
+    slot_config_phase[dev.SlotID()] = ConfigPhase::kConfiguringHub;
 
     ConfigureEndpointCommandTRB cmd{dev.InputContext(), dev.SlotID()};
     xhc.CommandRing()->Push(cmd);
-    xhc.DoorbellRegisterAt(0)->Ring(0);
+    xhc.RingCommandDoorbell();
 
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error ProcessEvent(Controller& xhc) {
-    if (!xhc.PrimaryEventRing()->HasFront()) {
+  Error AttachHubPort(Controller& xhc, Device& hub_dev,
+                      usb::HubDriver& hub, int port_num) {
+    const auto& hub_slot = hub_dev.DeviceContext()->slot_context.bits;
+    const auto route = HubPortRouteString(hub_dev, port_num);
+    if (route.error) {
+      return route.error;
+    }
+    const uint32_t route_string = route.value;
+    Log(kDebug, "AttachHubPort: hub slot %d, port %d, route %05x\n",
+        hub_dev.SlotID(), port_num, route_string);
+
+    if (auto err = attach_requests.Push(AttachRequest{
+            static_cast<uint8_t>(hub_slot.root_hub_port_num), route_string,
+            &hub, hub_dev.SlotID(), static_cast<uint8_t>(port_num)})) {
+      return err;
+    }
+    return StartNextAttach(xhc);
+  }
+
+  Error DetachHubPort(Controller& xhc, Device& hub_dev, int port_num) {
+    const auto route = HubPortRouteString(hub_dev, port_num);
+    if (route.error) {
+      return route.error;
+    }
+    const uint32_t route_string = route.value;
+
+    // ポートとその配下（ポートに繋がっていたハブの先）は，ルートストリングの
+    // 下位の段がポートのものと一致する
+    const uint8_t root_port = hub_dev.DeviceContext()->slot_context.bits.root_hub_port_num;
+    const uint32_t mask = (1u << (4 * RouteDepth(route_string))) - 1;
+    auto under_port = [&](uint8_t dev_root_port, uint32_t dev_route_string) {
+      return dev_root_port == root_port && (dev_route_string & mask) == route_string;
+    };
+
+    for (size_t n = attach_requests.Count(); n > 0; --n) {
+      const auto req = attach_requests.Front();
+      attach_requests.Pop();
+      if (!under_port(req.root_port, req.route_string)) {
+        attach_requests.Push(req);
+      }
+    }
+    if (attaching && under_port(current_attach.root_port, current_attach.route_string)) {
+      if (current_attach_slot_requested) {
+        // スロットの割り当て後に，コマンドの完了を待って無効化する
+        current_attach_removed = true;
+      } else {
+        attaching = false;  // リセット中なので打ち切る
+      }
+    }
+
+    if (auto dev = xhc.DeviceManager()->FindByPort(root_port, route_string)) {
+      DisableSubtree(xhc, dev->SlotID());
+    }
+    return StartNextAttach(xhc);
+  }
+
+  Error OnHubPortReset(Controller& xhc, Device& hub_dev, int port_num, int speed) {
+    if (!attaching || current_attach.hub_slot_id != hub_dev.SlotID() ||
+        current_attach.hub_port != port_num) {
+      return MAKE_ERROR(Error::kInvalidPhase);
+    }
+    return IssueEnableSlot(xhc, speed);
+  }
+
+  Error ProcessEvent(Controller& xhc, int interrupter) {
+    auto er = xhc.EventRingAt(interrupter);
+    if (!er->HasFront()) {
       return MAKE_ERROR(Error::kSuccess);
     }
 
     Error err = MAKE_ERROR(Error::kNotImplemented);
-    auto event_trb = xhc.PrimaryEventRing()->Front();
+    auto event_trb = er->Front();
     if (auto trb = TRBDynamicCast<TransferEventTRB>(event_trb)) {
       err = OnEvent(xhc, *trb);
     } else if (auto trb = TRBDynamicCast<PortStatusChangeEventTRB>(event_trb)) {
@@ -507,8 +888,31 @@ namespace usb::xhci {
     } else if (auto trb = TRBDynamicCast<CommandCompletionEventTRB>(event_trb)) {
       err = OnEvent(xhc, *trb);
     }
-    xhc.PrimaryEventRing()->Pop();
+    er->Pop();
 
     return err;
   }
+
+  int ProcessEvents(Controller& xhc, int interrupter) {
+    if (interrupter >= xhc.NumInterrupters()) {
+      return 0;
+    }
+
+    auto er = xhc.EventRingAt(interrupter);
+    int num_events = 0;
+    // イベント処理中に積まれた TRB のドアベルは最後にまとめて鳴らす
+    xhc.BeginDoorbellBatch();
+    while (er->HasFront()) {
+      if (auto err = ProcessEvent(xhc, interrupter)) {
+        Log(kError, "Error while ProcessEvent: %s at %s:%d\n",
+            err.Name(), err.File(), err.Line());
+      }
+      ++num_events;
+    }
+    xhc.EndDoorbellBatch();
+    er->Flush();
+
+    xhc.ModeratorAt(interrupter)->OnEventsProcessed(num_events);
+    return num_events;
+  }
 }  // namespace usb::xhci
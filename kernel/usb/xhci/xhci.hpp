@@ -12,16 +12,50 @@
 #include "usb/xhci/ring.hpp"
 #include "usb/xhci/port.hpp"
 #include "usb/xhci/devmgr.hpp"
+#include "usb/xhci/moderation.hpp"
 
 namespace usb::xhci {
+  /** @brief コマンド，ポート状態変化，コントロール転送と割り込み転送のイベントを受け取るインタラプタ */
+  const int kPrimaryInterrupter = 0;
+  /** @brief バルク転送やアイソクロナス転送を行うデバイスのイベントを受け取るインタラプタ */
+  const int kBulkInterrupter = 1;
+
   class Controller {
    public:
+    /** @brief 使用するインタラプタ（とイベントリング）の最大数 */
+    static const int kMaxInterrupters = 2;
+    /** @brief イベントリングのセグメント数と 1 セグメントあたりの TRB 数 */
+    static constexpr size_t kEventRingSegments = 4;
+    static constexpr size_t kEventRingSegmentSize = 64;
+
     Controller(uintptr_t mmio_base);
-    Error Initialize();
+
+    /** @brief xHC を初期化する．
+     *
+     * @param num_interrupters  使用するインタラプタ数．割り込みベクタを
+     *   インタラプタごとに用意できない場合は 1 を指定する．
+     *   kMaxInterrupters と xHC がサポートする数で制限される．
+     */
+    Error Initialize(int num_interrupters = 1);
     Error Run();
     Ring* CommandRing() { return &cr_; }
-    EventRing* PrimaryEventRing() { return &er_; }
+    EventRing* PrimaryEventRing() { return &er_[kPrimaryInterrupter]; }
+    InterruptModerator* PrimaryModerator() { return &moderator_[kPrimaryInterrupter]; }
+    EventRing* EventRingAt(int interrupter) { return &er_[interrupter]; }
+    InterruptModerator* ModeratorAt(int interrupter) { return &moderator_[interrupter]; }
+    int NumInterrupters() const { return num_interrupters_; }
     DoorbellRegister* DoorbellRegisterAt(uint8_t index);
+
+    /** @brief コマンドリングのドアベルを鳴らす．バッチ中なら EndDoorbellBatch まで保留する． */
+    void RingCommandDoorbell();
+
+    /** @brief コマンドリングと全デバイスの転送リングのドアベルをまとめて鳴らす区間．
+     *
+     * 区間中に積まれた TRB のドアベルは，EndDoorbellBatch でリングごとに
+     * 1 回だけ鳴らす．
+     */
+    void BeginDoorbellBatch();
+    void EndDoorbellBatch();
     Port PortAt(uint8_t port_num) {
       return Port{port_num, PortRegisterSets()[port_num - 1]};
     }
@@ -38,7 +72,11 @@ namespace usb::xhci {
 
     class DeviceManager devmgr_;
     Ring cr_;
-    EventRing er_;
+    int doorbell_batch_depth_ = 0;
+    bool command_doorbell_pending_ = false;
+    int num_interrupters_ = 1;
+    EventRing er_[kMaxInterrupters];
+    InterruptModerator moderator_[kMaxInterrupters];
 
     InterrupterRegisterSetArray InterrupterRegisterSets() const {
       return {mmio_base_ + cap_->RTSOFF.Read().Offset() + 0x20u, 1024};
@@ -53,15 +91,57 @@ namespace usb::xhci {
     }
   };
 
+  /** @brief 接続されたポートの初期化要求を積む．
+   *
+   * リセットからアドレス割り当てまでは 1 ポートずつ順に処理し，
+   * それ以降の初期化は複数のデバイスで並行して進める．
+   */
   Error ConfigurePort(Controller& xhc, Port& port);
   Error ConfigureEndpoints(Controller& xhc, Device& dev);
 
+  /** @brief ハブのスロットコンテキストに Hub フラグとポート数などを設定する．
+   *
+   * ハブのエンドポイントの設定が済んだ後に，ハブのクラスドライバが
+   * ハブディスクリプタを読んでから呼ぶ．
+   */
+  Error ConfigureHub(Controller& xhc, Device& dev,
+                     int num_ports, bool multi_tt, int think_time);
+
+  /** @brief ハブのポートに接続されたデバイスの接続要求を積む．
+   *
+   * ルートハブのポートと同じ排他区間の待ち行列に入り，順番が来ると
+   * HubDriver::ResetPort でリセットが始まる．ルートストリングは
+   * ハブのルートストリングに 1 段分のポート番号を加えたもの．
+   */
+  Error AttachHubPort(Controller& xhc, Device& hub_dev,
+                      usb::HubDriver& hub, int port_num);
+  /** @brief ハブのポートから取り外されたデバイスとその配下のデバイスを片付ける．
+   *
+   * クラスドライバを破棄して Disable Slot コマンドを発行し，完了したら
+   * DeviceManager から取り除く．そのポート以下への接続要求も取り下げる．
+   */
+  Error DetachHubPort(Controller& xhc, Device& hub_dev, int port_num);
+  /** @brief ハブのポートのリセット完了を受けてスロットの割り当てに進む． */
+  Error OnHubPortReset(Controller& xhc, Device& hub_dev, int port_num, int speed);
+
   /** @brief イベントリングに登録されたイベントを高々1つ処理する．
    *
-   * xhc のプライマリイベントリングの先頭のイベントを処理する．
+   * 指定されたインタラプタのイベントリングの先頭のイベントを処理する．
    * イベントが無ければ即座に Error::kSuccess を返す．
+   * ERDP は更新しないので，呼び出し側で EventRing::Flush を呼ぶこと．
    *
    * @return イベントを正常に処理できたら Error::kSuccess
    */
-  Error ProcessEvent(Controller& xhc);
+  Error ProcessEvent(Controller& xhc, int interrupter = kPrimaryInterrupter);
+
+  /** @brief イベントリングに登録されたイベントをすべて処理する．
+   *
+   * 個々のイベントの処理で発生したエラーはログに記録して処理を続ける．
+   * イベント処理中に積まれた TRB のドアベルは最後にまとめて鳴らす．
+   * 読み出し終えたら ERDP を 1 度だけ更新し，処理したイベント数を
+   * 当該インタラプタの InterruptModerator に通知する．
+   *
+   * @return 処理したイベントの数
+   */
+  int ProcessEvents(Controller& xhc, int interrupter = kPrimaryInterrupter);
 }
@@ -0,0 +1,149 @@
+#include "virtio/blk.hpp"
+
+#include "logger.hpp"
+
+namespace {
+  namespace feature {
+    const uint64_t kReadOnly = 1ull << 5;
+    const uint64_t kBlockSize = 1ull << 6;
+  }
+
+  namespace request_type {
+    const uint32_t kIn = 0;   // 読み込み
+    const uint32_t kOut = 1;  // 書き込み
+  }
+
+  const uint8_t kStatusOK = 0;
+}  // namespace
+
+namespace virtio {
+  BlockDevice::BlockDevice(pci::Device& dev)
+      : transport_{dev}, msix_{dev} {
+  }
+
+  Error BlockDevice::Initialize(uint8_t apic_id, uint8_t vector) {
+    if (auto err = transport_.Initialize()) {
+      return err;
+    }
+
+    transport_.Reset();
+    transport_.AddStatus(device_status::kAcknowledge);
+    transport_.AddStatus(device_status::kDriver);
+
+    const auto features = transport_.NegotiateFeatures(
+        kFeatureVersion1 | feature::kReadOnly | feature::kBlockSize);
+    Error err = features.error;
+
+    // キューの割り込みは MSI-X テーブルの 0 番を使い，設定変更の通知は受けない．
+    // エントリはキューの設定が済むまでマスクしたままにしておく
+    bool msix_initialized = false;
+    if (!err) {
+      err = msix_.Initialize();
+      msix_initialized = !err;
+    }
+    if (!err) {
+      transport_.Common()->msix_config = kNoVector;
+      err = queue_.Initialize(transport_, 0, kMaxQueueSize, 0);
+    }
+    if (err) {
+      // 確保済みのキューのフレームは，このオブジェクトの破棄時に解放される
+      if (msix_initialized) {
+        msix_.SetFunctionMask(true);
+      }
+      transport_.AddStatus(device_status::kFailed);
+      return err;
+    }
+    msix_.SetVector(0, apic_id, pci::MSITriggerMode::kEdge,
+                    pci::MSIDeliveryMode::kFixed, vector);
+    msix_.Unmask(0);
+
+    auto config = transport_.DeviceConfig<BlockConfig>();
+    num_sectors_ = config->capacity;
+    if (features.value & feature::kBlockSize) {
+      block_size_ = config->blk_size;
+    }
+    read_only_ = features.value & feature::kReadOnly;
+
+    transport_.AddStatus(device_status::kDriverOK);
+    Log(kInfo, "virtio-blk: %lu sectors, block size %u%s, queue depth %d\n",
+        num_sectors_, block_size_, read_only_ ? ", read only" : "", QueueDepth());
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error BlockDevice::Read(uint64_t sector, int num_sectors, void* buf,
+                          Delegate<CompletionCallbackType> callback) {
+    return Submit(request_type::kIn, sector, num_sectors, buf, callback);
+  }
+
+  Error BlockDevice::Write(uint64_t sector, int num_sectors, const void* buf,
+                           Delegate<CompletionCallbackType> callback) {
+    if (read_only_) {
+      return MAKE_ERROR(Error::kTransferFailed);
+    }
+    return Submit(request_type::kOut, sector, num_sectors,
+                  const_cast<void*>(buf), callback);
+  }
+
+  void BlockDevice::BeginBatch() {
+    ++batch_depth_;
+  }
+
+  void BlockDevice::EndBatch() {
+    if (--batch_depth_ == 0) {
+      queue_.Notify();
+    }
+  }
+
+  Error BlockDevice::ProcessCompletions() {
+    while (queue_.HasUsed()) {
+      const auto used = queue_.PopUsed();
+      if (used.id >= requests_.size()) {
+        return MAKE_ERROR(Error::kIndexOutOfRange);
+      }
+
+      Request& req = requests_[used.id];
+      const Error err = req.status == kStatusOK ?
+          MAKE_ERROR(Error::kSuccess) : MAKE_ERROR(Error::kTransferFailed);
+      auto callback = req.callback;
+      req.callback = nullptr;
+      if (callback) {
+        callback(this, err, req.header.sector, req.buf, req.num_sectors);
+      }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  Error BlockDevice::Submit(uint32_t type, uint64_t sector, int num_sectors, void* buf,
+                            Delegate<CompletionCallbackType> callback) {
+    if (num_sectors <= 0 || sector + num_sectors > num_sectors_) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    if (queue_.NumFree() < 3) {
+      return MAKE_ERROR(Error::kFull);
+    }
+
+    // チェーンの先頭になる記述子の番号で Request を選び，ヘッダを書いてから積む
+    Request& req = requests_[queue_.NextHead()];
+    req.header = BlockRequestHeader{type, 0, sector};
+    req.status = 0xff;
+    req.buf = buf;
+    req.num_sectors = num_sectors;
+    req.callback = callback;
+
+    const Buffer bufs[3] = {
+      {&req.header, sizeof(BlockRequestHeader), false},
+      {buf, static_cast<uint32_t>(num_sectors * kSectorSize), type == request_type::kIn},
+      {&req.status, 1, true},
+    };
+    if (auto head = queue_.Push(bufs, 3); head.error) {
+      req.callback = nullptr;
+      return head.error;
+    }
+
+    if (batch_depth_ == 0) {
+      queue_.Notify();
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+}  // namespace virtio
@@ -0,0 +1,104 @@
+/**
+ * @file virtio/blk.hpp
+ *
+ * virtio-blk ドライバ．
+ */
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "delegate.hpp"
+#include "error.hpp"
+#include "pci.hpp"
+#include "virtio/queue.hpp"
+#include "virtio/transport.hpp"
+
+namespace virtio {
+  /** @brief virtio-blk のデバイス固有設定構造（使う部分のみ） */
+  struct BlockConfig {
+    uint64_t capacity;  // 512 バイトセクタ単位
+    uint32_t size_max;
+    uint32_t seg_max;
+    uint16_t cylinders;
+    uint8_t heads;
+    uint8_t sectors;
+    uint32_t blk_size;
+  } __attribute__((packed));
+
+  /** @brief 要求の先頭に置くヘッダ */
+  struct BlockRequestHeader {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+  } __attribute__((packed));
+
+  class BlockDevice {
+   public:
+    /** @brief 使用するキューの要素数の上限．1 要求に 3 つの記述子を使う */
+    static const uint16_t kMaxQueueSize = 128;
+    static const int kSectorSize = 512;
+
+    BlockDevice(pci::Device& dev);
+
+    /** @brief デバイスを初期化し，要求を受け付けられる状態にする
+     *
+     * キューの完了は MSI-X で apic_id の vector に通知される．
+     * 割り込みを受けたらメインループから ProcessCompletions() を呼ぶ．
+     */
+    Error Initialize(uint8_t apic_id, uint8_t vector);
+
+    /** @brief 読み書き要求の完了を通知するコールバック．sector 以降は要求時の値． */
+    using CompletionCallbackType = void (BlockDevice* dev, Error err,
+                                         uint64_t sector, void* buf, int num_sectors);
+
+    /** @brief sector から num_sectors セクタを buf に読み込む要求を積む
+     *
+     * バッチ中でなければすぐにデバイスに通知する．
+     *
+     * @return 要求を積めたら Error::kSuccess．キューに空きが無ければ Error::kFull．
+     */
+    Error Read(uint64_t sector, int num_sectors, void* buf,
+               Delegate<CompletionCallbackType> callback);
+    /** @brief buf の内容を sector から num_sectors セクタ書き込む要求を積む */
+    Error Write(uint64_t sector, int num_sectors, const void* buf,
+                Delegate<CompletionCallbackType> callback);
+
+    /** @brief 要求をまとめて積む区間．EndBatch で 1 回だけデバイスに通知する． */
+    void BeginBatch();
+    void EndBatch();
+
+    /** @brief used リングから完了した要求を取り出し，コールバックを呼ぶ */
+    Error ProcessCompletions();
+
+    uint64_t NumSectors() const { return num_sectors_; }
+    uint32_t BlockSize() const { return block_size_; }
+    bool IsReadOnly() const { return read_only_; }
+    /** @brief 同時に積める要求の数 */
+    int QueueDepth() const { return queue_.Size() / 3; }
+
+   private:
+    struct Request {
+      BlockRequestHeader header;
+      uint8_t status;
+      void* buf;
+      int num_sectors;
+      Delegate<CompletionCallbackType> callback;
+    };
+
+    PCITransport transport_;
+    pci::MSIX msix_;
+    Virtqueue queue_;
+    /** @brief 要求ごとのヘッダとステータス．添え字は記述子チェーンの先頭の番号 */
+    std::array<Request, kMaxQueueSize> requests_{};
+    int batch_depth_{0};
+
+    uint64_t num_sectors_{0};
+    uint32_t block_size_{kSectorSize};
+    bool read_only_{false};
+
+    Error Submit(uint32_t type, uint64_t sector, int num_sectors, void* buf,
+                 Delegate<CompletionCallbackType> callback);
+  };
+}
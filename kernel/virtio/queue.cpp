@@ -0,0 +1,148 @@
+#include "virtio/queue.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include "logger.hpp"
+#include "memory_manager.hpp"
+
+namespace {
+  size_t AlignUp(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+  }
+}  // namespace
+
+namespace virtio {
+  Virtqueue::~Virtqueue() {
+    if (num_frames_ > 0) {
+      memory_manager->Free(frame_, num_frames_);
+    }
+  }
+
+  Error Virtqueue::Initialize(PCITransport& transport, uint16_t index,
+                              uint16_t max_size, uint16_t msix_vector) {
+    auto common = transport.Common();
+    common->queue_select = index;
+    const uint16_t device_size = common->queue_size;
+    if (device_size == 0) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+    size_ = std::min(device_size, max_size);
+    // 要素数は 2 の冪でなければならない
+    while (size_ & (size_ - 1)) {
+      size_ &= size_ - 1;
+    }
+
+    // 記述子テーブル（16 バイト境界），available リング（2 バイト境界），
+    // used リング（4 バイト境界）の順に並べる
+    const size_t desc_bytes = sizeof(Descriptor) * size_;
+    const size_t avail_bytes = 2 * (3 + size_);
+    const size_t used_offset = AlignUp(desc_bytes + avail_bytes, 4);
+    const size_t used_bytes = 6 + sizeof(UsedElement) * size_;
+    const size_t num_frames = AlignUp(used_offset + used_bytes, kBytesPerFrame) / kBytesPerFrame;
+
+    const auto frame = memory_manager->Allocate(num_frames);
+    if (frame.error) {
+      return frame.error;
+    }
+    frame_ = frame.value;
+    num_frames_ = num_frames;
+    auto base = reinterpret_cast<uint8_t*>(frame.value.Frame());
+    memset(base, 0, num_frames * kBytesPerFrame);
+
+    desc_ = reinterpret_cast<volatile Descriptor*>(base);
+    avail_ = reinterpret_cast<volatile uint16_t*>(base + desc_bytes);
+    used_ = reinterpret_cast<volatile uint16_t*>(base + used_offset);
+
+    // 空き記述子を next でつないでおく
+    for (uint16_t i = 0; i < size_; ++i) {
+      desc_[i].next = i + 1;
+    }
+    free_head_ = 0;
+    num_free_ = size_;
+    avail_idx_ = notified_avail_idx_ = last_used_idx_ = 0;
+    index_ = index;
+
+    common->queue_size = size_;
+    common->queue_msix_vector = msix_vector;
+    if (common->queue_msix_vector != msix_vector) {
+      Log(kError, "virtio: queue %u rejected MSI-X vector %u\n", index, msix_vector);
+      return MAKE_ERROR(Error::kNoPCIMSI);
+    }
+    common->queue_desc = reinterpret_cast<uintptr_t>(desc_);
+    common->queue_driver = reinterpret_cast<uintptr_t>(avail_);
+    common->queue_device = reinterpret_cast<uintptr_t>(used_);
+    notify_ = transport.NotifyRegister(common->queue_notify_off);
+    common->queue_enable = 1;
+
+    Log(kDebug, "virtio: queue %u: size %u, %lu frames at %p\n",
+        index, size_, num_frames, base);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  WithError<uint16_t> Virtqueue::Push(const Buffer* bufs, int num_bufs) {
+    if (num_bufs <= 0 || num_free_ < num_bufs) {
+      return {0, MAKE_ERROR(Error::kFull)};
+    }
+
+    const uint16_t head = free_head_;
+    uint16_t i = head;
+    for (int n = 0; n < num_bufs; ++n) {
+      desc_[i].addr = reinterpret_cast<uintptr_t>(bufs[n].addr);
+      desc_[i].len = bufs[n].len;
+      desc_[i].flags = (bufs[n].device_writable ? desc_flag::kWrite : 0) |
+                       (n + 1 < num_bufs ? desc_flag::kNext : 0);
+      if (n + 1 < num_bufs) {
+        i = desc_[i].next;
+      }
+    }
+    free_head_ = desc_[i].next;
+    num_free_ -= num_bufs;
+
+    avail_[2 + avail_idx_ % size_] = head;
+    // 記述子とリングの内容を書き終えてから idx を進める
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ++avail_idx_;
+    avail_[1] = avail_idx_;
+
+    return {head, MAKE_ERROR(Error::kSuccess)};
+  }
+
+  void Virtqueue::Notify() {
+    if (notified_avail_idx_ == avail_idx_) {
+      return;
+    }
+    notified_avail_idx_ = avail_idx_;
+
+    // idx の書き込みより後に flags を読む必要がある
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    const bool no_notify = used_[0] & 1u;  // VIRTQ_USED_F_NO_NOTIFY
+    if (!no_notify) {
+      *notify_ = index_;
+    }
+  }
+
+  bool Virtqueue::HasUsed() const {
+    return last_used_idx_ != used_[1];
+  }
+
+  UsedElement Virtqueue::PopUsed() {
+    // idx を読んでからエントリを読む
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    volatile UsedElement& elem = UsedRing()[last_used_idx_ % size_];
+    const UsedElement used{elem.id, elem.len};
+    ++last_used_idx_;
+
+    // チェーンの記述子を空きリストの先頭に戻す
+    uint16_t i = used.id;
+    uint16_t n = 1;
+    while (desc_[i].flags & desc_flag::kNext) {
+      i = desc_[i].next;
+      ++n;
+    }
+    desc_[i].next = free_head_;
+    free_head_ = used.id;
+    num_free_ += n;
+
+    return used;
+  }
+}  // namespace virtio
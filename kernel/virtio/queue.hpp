@@ -0,0 +1,108 @@
+/**
+ * @file virtio/queue.hpp
+ *
+ * split virtqueue．
+ *
+ * 記述子テーブル，available リング，used リングを物理的に連続した
+ * フレームに配置する．メモリは恒等マッピングされているので，
+ * 仮想アドレスをそのまま記述子に書き込める．
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "error.hpp"
+#include "memory_manager.hpp"
+#include "virtio/transport.hpp"
+
+namespace virtio {
+  /** @brief 記述子テーブルの 1 エントリ */
+  struct Descriptor {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+  } __attribute__((packed));
+
+  namespace desc_flag {
+    const uint16_t kNext = 1;
+    const uint16_t kWrite = 2;  // デバイスが書き込むバッファ
+  }
+
+  /** @brief used リングの 1 エントリ */
+  struct UsedElement {
+    uint32_t id;   // 記述子チェーンの先頭の番号
+    uint32_t len;  // デバイスが書き込んだバイト数
+  } __attribute__((packed));
+
+  /** @brief 記述子チェーンに積むバッファ */
+  struct Buffer {
+    const void* addr;
+    uint32_t len;
+    bool device_writable;
+  };
+
+  class Virtqueue {
+   public:
+    Virtqueue() = default;
+    Virtqueue(const Virtqueue&) = delete;
+    /** @brief Initialize で確保したフレームを解放する */
+    ~Virtqueue();
+    Virtqueue& operator=(const Virtqueue&) = delete;
+
+    /** @brief 記述子テーブルなどを確保し，transport の index 番目のキューとして有効にする
+     *
+     * @param max_size  キューの要素数の上限．デバイスが示す値と小さい方を使う
+     * @param msix_vector  このキューの完了を通知する MSI-X テーブルのエントリ番号
+     */
+    Error Initialize(PCITransport& transport, uint16_t index,
+                     uint16_t max_size, uint16_t msix_vector);
+
+    uint16_t Size() const { return size_; }
+    uint16_t NumFree() const { return num_free_; }
+    /** @brief 次に Push() したときにチェーンの先頭になる記述子の番号 */
+    uint16_t NextHead() const { return free_head_; }
+
+    /** @brief bufs を 1 つの記述子チェーンにして available リングに積む
+     *
+     * デバイスへの通知は行わない．まとめて積んだ後に Notify() を 1 回呼ぶ．
+     *
+     * @return チェーンの先頭の記述子番号．空きが足りなければ Error::kFull
+     */
+    WithError<uint16_t> Push(const Buffer* bufs, int num_bufs);
+
+    /** @brief 前回の通知以降に積んだチェーンがあればデバイスに通知する
+     *
+     * デバイスが used リングの flags で通知を不要としている間は通知しない．
+     */
+    void Notify();
+
+    /** @brief 処理済みのチェーンが used リングにあれば真を返す */
+    bool HasUsed() const;
+
+    /** @brief 処理済みのチェーンを 1 つ取り出し，その記述子を空きに戻す */
+    UsedElement PopUsed();
+
+   private:
+    uint16_t size_{0};
+    volatile Descriptor* desc_{nullptr};
+    volatile uint16_t* avail_{nullptr};  // flags, idx, ring[size_]
+    volatile uint16_t* used_{nullptr};   // flags, idx, UsedElement ring[size_]
+    volatile uint16_t* notify_{nullptr};
+    uint16_t index_{0};
+    /** @brief 記述子テーブルなどを置いたフレーム */
+    FrameID frame_{kNullFrame};
+    size_t num_frames_{0};
+
+    uint16_t free_head_{0};
+    uint16_t num_free_{0};
+    uint16_t avail_idx_{0};
+    uint16_t notified_avail_idx_{0};
+    uint16_t last_used_idx_{0};
+
+    volatile UsedElement* UsedRing() const {
+      return reinterpret_cast<volatile UsedElement*>(used_ + 2);
+    }
+  };
+}
@@ -0,0 +1,93 @@
+#include "virtio/transport.hpp"
+
+#include "logger.hpp"
+
+namespace {
+  /** @brief virtio のケーパビリティはベンダ固有ケーパビリティとして並ぶ */
+  const uint8_t kCapabilityVendorSpecific = 0x09;
+
+  /** @brief virtio_pci_cap の cfg_type */
+  namespace cfg_type {
+    const uint8_t kCommon = 1;
+    const uint8_t kNotify = 2;
+    const uint8_t kDevice = 4;
+  }
+}  // namespace
+
+namespace virtio {
+  PCITransport::PCITransport(pci::Device& dev) : dev_{dev} {
+  }
+
+  Error PCITransport::Initialize() {
+    uint8_t cap_addr = pci::ReadConfReg(dev_, 0x34) & 0xfcu;
+    while (cap_addr != 0) {
+      const auto header = pci::ReadCapabilityHeader(dev_, cap_addr);
+      const uint8_t this_addr = cap_addr;
+      cap_addr = header.bits.next_ptr & 0xfcu;
+      if (header.bits.cap_id != kCapabilityVendorSpecific) {
+        continue;
+      }
+
+      // header.bits.cap の下位 8 ビットが cap_len，上位 8 ビットが cfg_type
+      const uint8_t type = header.bits.cap >> 8;
+      const uint8_t bar_index = pci::ReadConfReg(dev_, this_addr + 4) & 0xffu;
+      const uint32_t offset = pci::ReadConfReg(dev_, this_addr + 8);
+
+      const auto bar = pci::ReadBar(dev_, bar_index);
+      if (bar.error || (bar.value & 1u)) {  // IO 空間の BAR は使わない
+        continue;
+      }
+      const uintptr_t addr = (bar.value & ~static_cast<uint64_t>(0xf)) + offset;
+
+      // 同じ種類のケーパビリティが複数あれば最初のものを使う
+      if (type == cfg_type::kCommon && common_ == nullptr) {
+        common_ = reinterpret_cast<volatile CommonConfig*>(addr);
+      } else if (type == cfg_type::kNotify && notify_base_ == 0) {
+        notify_base_ = addr;
+        notify_off_multiplier_ = pci::ReadConfReg(dev_, this_addr + 16);
+      } else if (type == cfg_type::kDevice && device_cfg_ == nullptr) {
+        device_cfg_ = reinterpret_cast<volatile uint8_t*>(addr);
+      }
+    }
+
+    if (common_ == nullptr || notify_base_ == 0 || device_cfg_ == nullptr) {
+      Log(kError, "virtio: modern capabilities are not found\n");
+      return MAKE_ERROR(Error::kUnknownDevice);
+    }
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  void PCITransport::Reset() {
+    common_->device_status = 0;
+    while (common_->device_status != 0);
+  }
+
+  void PCITransport::AddStatus(uint8_t status) {
+    common_->device_status = common_->device_status | status;
+  }
+
+  WithError<uint64_t> PCITransport::NegotiateFeatures(uint64_t wanted) {
+    common_->device_feature_select = 0;
+    uint64_t device_features = common_->device_feature;
+    common_->device_feature_select = 1;
+    device_features |= static_cast<uint64_t>(common_->device_feature) << 32;
+
+    const uint64_t features = device_features & wanted;
+    if ((features & kFeatureVersion1) == 0) {
+      Log(kError, "virtio: device does not support VERSION_1\n");
+      return {0, MAKE_ERROR(Error::kUnknownDevice)};
+    }
+
+    common_->driver_feature_select = 0;
+    common_->driver_feature = features & 0xffffffffu;
+    common_->driver_feature_select = 1;
+    common_->driver_feature = features >> 32;
+
+    AddStatus(device_status::kFeaturesOK);
+    if ((Status() & device_status::kFeaturesOK) == 0) {
+      Log(kError, "virtio: device rejected features %016lx\n", features);
+      return {0, MAKE_ERROR(Error::kInvalidPhase)};
+    }
+    return {features, MAKE_ERROR(Error::kSuccess)};
+  }
+}  // namespace virtio
@@ -0,0 +1,96 @@
+/**
+ * @file virtio/transport.hpp
+ *
+ * PCI 上の virtio デバイス（virtio 1.x の modern インターフェース）を操作するクラス．
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "error.hpp"
+#include "pci.hpp"
+
+namespace virtio {
+  /** @brief Device Status フィールドのビット */
+  namespace device_status {
+    const uint8_t kAcknowledge = 1;
+    const uint8_t kDriver = 2;
+    const uint8_t kDriverOK = 4;
+    const uint8_t kFeaturesOK = 8;
+    const uint8_t kFailed = 128;
+  }
+
+  /** @brief VIRTIO_F_VERSION_1．modern インターフェースを使うときは必ず受け入れる */
+  const uint64_t kFeatureVersion1 = 1ull << 32;
+
+  /** @brief MSI-X ベクタを割り当てないことを表す値 */
+  const uint16_t kNoVector = 0xffffu;
+
+  /** @brief VIRTIO_PCI_CAP_COMMON_CFG が指す構造 */
+  struct CommonConfig {
+    uint32_t device_feature_select;
+    uint32_t device_feature;
+    uint32_t driver_feature_select;
+    uint32_t driver_feature;
+    uint16_t msix_config;
+    uint16_t num_queues;
+    uint8_t device_status;
+    uint8_t config_generation;
+
+    uint16_t queue_select;
+    uint16_t queue_size;
+    uint16_t queue_msix_vector;
+    uint16_t queue_enable;
+    uint16_t queue_notify_off;
+    uint64_t queue_desc;
+    uint64_t queue_driver;
+    uint64_t queue_device;
+  } __attribute__((packed));
+
+  /** @brief virtio デバイスの PCI ケーパビリティをたどって各設定構造を操作する */
+  class PCITransport {
+   public:
+    PCITransport(pci::Device& dev);
+
+    /** @brief virtio 用のケーパビリティを探し，各設定構造のアドレスを求める
+     *
+     * @return 必要なケーパビリティが揃っていなければ Error::kUnknownDevice
+     */
+    Error Initialize();
+
+    /** @brief デバイスをリセットし，リセットが終わるまで待つ */
+    void Reset();
+    void AddStatus(uint8_t status);
+    uint8_t Status() const { return common_->device_status; }
+
+    /** @brief デバイスが持つ機能のうち wanted に含まれるものを有効にする
+     *
+     * FEATURES_OK を設定し，デバイスがそれを受け入れたか確かめるところまで行う．
+     *
+     * @return 有効にした機能．デバイスが受け入れなければ Error::kInvalidPhase
+     */
+    WithError<uint64_t> NegotiateFeatures(uint64_t wanted);
+
+    volatile CommonConfig* Common() { return common_; }
+
+    /** @brief デバイス固有の設定構造を返す */
+    template <class T>
+    volatile T* DeviceConfig() { return reinterpret_cast<volatile T*>(device_cfg_); }
+
+    /** @brief queue_notify_off に対応するノティファイレジスタを返す */
+    volatile uint16_t* NotifyRegister(uint16_t queue_notify_off) const {
+      return reinterpret_cast<volatile uint16_t*>(
+          notify_base_ + queue_notify_off * notify_off_multiplier_);
+    }
+
+    pci::Device& PCIDevice() { return dev_; }
+
+   private:
+    pci::Device& dev_;
+    volatile CommonConfig* common_{nullptr};
+    uintptr_t notify_base_{0};
+    uint32_t notify_off_multiplier_{0};
+    volatile uint8_t* device_cfg_{nullptr};
+  };
+}
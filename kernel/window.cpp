@@ -51,6 +51,10 @@ void Window::SetTransparentColor(std::optional<PixelColor> c) {
   transparent_color_ = c;
 }
 
+std::optional<PixelColor> Window::TransparentColor() const {
+  return transparent_color_;
+}
+
 Window::WindowWriter* Window::Writer() {
   return &writer_;
 }
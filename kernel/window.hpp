@@ -54,6 +54,8 @@ public:
 
   /** @brief 透過色を設定する。 */
   void SetTransparentColor(std::optional<PixelColor> c);
+  /** @brief 設定されている透過色を返す。 */
+  std::optional<PixelColor> TransparentColor() const;
 
   /** @brief このインスタンスに紐付いた WindowWriter を取得する。 */
   WindowWriter* Writer();